@@ -0,0 +1,365 @@
+#include "cypheri/errors.hpp"
+#include "cypheri/parse.hpp"
+#include "cypheri/token.hpp"
+#include "cypheri/vm.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <vector>
+
+// Every benchmark prints one JSON object per line to stdout, so that runs
+// can be collected and compared by a script. Files given on the command
+// line are measured as extra corpora next to the generated ones.
+
+namespace {
+
+std::atomic<size_t> alloc_count{0}, alloc_bytes{0};
+
+} // namespace
+
+void *operator new(size_t size) {
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+	alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+	if (void *ptr = std::malloc(size ? size : 1)) {
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+	std::free(ptr);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Seconds to keep repeating a measurement for, after one warm-up run
+constexpr double MIN_SECONDS = 0.25;
+
+// Run f until enough time has passed, return the seconds per run
+template <typename F> double time_runs(F &&f) {
+	f();
+	size_t runs = 0;
+	auto begin = Clock::now();
+	double elapsed;
+	do {
+		f();
+		runs++;
+		elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+	} while (elapsed < MIN_SECONDS);
+	return elapsed / runs;
+}
+
+struct Corpus {
+	std::string name, source;
+};
+
+// A single expression nested depth levels deep per function
+std::string deep_expressions(int functions, int depth) {
+	std::string src;
+	for (int f = 0; f < functions; f++) {
+		src += std::format("Function deep{}(a, b)\n\tReturn ", f);
+		for (int i = 0; i < depth; i++) {
+			src += '(';
+		}
+		src += 'a';
+		for (int i = 0; i < depth; i++) {
+			static constexpr const char *ops[] = {" + b)", " * a)", " - b)",
+												  " / a)", " % b)"};
+			src += ops[i % 5];
+		}
+		src += ";\nEnd\n\n";
+	}
+	return src;
+}
+
+// Few functions, each with a long body of simple statements
+std::string wide_functions(int functions, int statements) {
+	std::string src;
+	for (int f = 0; f < functions; f++) {
+		src += std::format("Function wide{}(a)\n\tDeclare x = a;\n", f);
+		for (int i = 0; i < statements; i++) {
+			src += std::format("\tx = x * {} + a;\n", i % 7 + 2);
+		}
+		src += "\tReturn x;\nEnd\n\n";
+	}
+	return src;
+}
+
+std::string elseif_chains(int functions, int branches) {
+	std::string src;
+	for (int f = 0; f < functions; f++) {
+		src += std::format("Function pick{}(x)\n\tIf x == 0 Then\n"
+						   "\t\tReturn 0;\n",
+						   f);
+		for (int i = 1; i < branches; i++) {
+			src += std::format("\tElseIf x == {} Then\n\t\tReturn {};\n", i,
+							   i * 3);
+		}
+		src += "\tElse\n\t\tReturn -1;\n\tEnd\nEnd\n\n";
+	}
+	return src;
+}
+
+// Mostly distinct literals, some of them long and some with escapes
+std::string string_literals(int functions, int literals) {
+	std::string src;
+	for (int f = 0; f < functions; f++) {
+		src += std::format("Function text{}()\n\tDeclare s = \"\";\n", f);
+		for (int i = 0; i < literals; i++) {
+			if (i % 5 == 0) {
+				src += std::format("\ts = s + \"line {}\\tof {}\\n\";\n", i, f);
+			} else if (i % 5 == 1) {
+				src += std::format("\ts = s + \"{}\";\n",
+								   std::string(40 + i % 60, 'a' + i % 26));
+			} else {
+				src += std::format("\ts = s + \"literal {} {}\";\n", f, i);
+			}
+		}
+		src += "\tReturn s;\nEnd\n\n";
+	}
+	return src;
+}
+
+// Something like real code: small functions calling each other, locals,
+// conditions and a bit of string building
+std::string mixed_program(int functions) {
+	std::string src;
+	for (int f = 0; f < functions; f++) {
+		src += std::format(
+			"Function helper{0}(a, b)\n"
+			"\tDeclare res, tmp = a * {1} - b;\n"
+			"\tIf tmp > b && a != 0 Then\n"
+			"\t\tres = helper{2}(tmp % 17, b + 1);\n"
+			"\tElseIf tmp < 0 || b == {1} Then\n"
+			"\t\tres = \"negative \" + tmp;\n"
+			"\tElse\n"
+			"\t\tres = (a + b) * (a - b) / {3};\n"
+			"\tEnd\n"
+			"\tReturn res;\n"
+			"End\n\n",
+			f, f % 9 + 1, f > 0 ? f - 1 : 0, f % 5 + 2);
+	}
+	src += "Function onBoot()\n\tReturn helper0(1, 2);\nEnd\n";
+	return src;
+}
+
+std::vector<Corpus> make_corpora(int argc, char **argv) {
+	std::vector<Corpus> res;
+	res.push_back({"deep_expr", deep_expressions(400, 64)});
+	res.push_back({"wide_functions", wide_functions(8, 2000)});
+	res.push_back({"elseif_chain", elseif_chains(20, 500)});
+	res.push_back({"string_literals", string_literals(40, 500)});
+	res.push_back({"mixed", mixed_program(2000)});
+	for (int i = 1; i < argc; i++) {
+		std::ifstream in(argv[i], std::ios::binary);
+		if (!in) {
+			std::cerr << std::format("cannot read {}", argv[i]) << std::endl;
+			continue;
+		}
+		res.push_back({argv[i], std::string(std::istreambuf_iterator(in), {})});
+	}
+	return res;
+}
+
+void bench_tokenize(const Corpus &corpus) {
+	size_t tokens = 0;
+	double seconds = time_runs([&] {
+		cypheri::NameTable name_table;
+		auto res = cypheri::tokenize(corpus.source, name_table);
+		tokens = res.tokens.size();
+	});
+	double mb = corpus.source.size() / 1e6;
+	std::cout << std::format("{{\"bench\":\"tokenize\",\"corpus\":\"{}\","
+							 "\"bytes\":{},\"tokens\":{},\"seconds\":{:.6g},"
+							 "\"mb_per_s\":{:.4g}}}",
+							 corpus.name, corpus.source.size(), tokens,
+							 seconds, mb / seconds)
+			  << std::endl;
+}
+
+void bench_parse(const Corpus &corpus) {
+	size_t functions = 0;
+	bool failed = false;
+	auto compile = [&] {
+		cypheri::NameTable name_table;
+		cypheri::TokenStream tokens(corpus.source, name_table);
+		auto res = cypheri::parse(tokens, name_table);
+		if (auto mod = std::get_if<cypheri::BytecodeModule>(&res)) {
+			functions = mod->functions.size();
+		} else {
+			failed = true;
+		}
+	};
+
+	size_t count_before = alloc_count.load(std::memory_order_relaxed);
+	size_t bytes_before = alloc_bytes.load(std::memory_order_relaxed);
+	compile();
+	size_t allocs = alloc_count.load(std::memory_order_relaxed) - count_before;
+	size_t bytes = alloc_bytes.load(std::memory_order_relaxed) - bytes_before;
+	if (failed) {
+		std::cout << std::format("{{\"bench\":\"parse\",\"corpus\":\"{}\","
+								 "\"error\":true}}",
+								 corpus.name)
+				  << std::endl;
+		return;
+	}
+
+	double seconds = time_runs(compile);
+	std::cout << std::format(
+					 "{{\"bench\":\"parse\",\"corpus\":\"{}\","
+					 "\"functions\":{},\"seconds\":{:.6g},"
+					 "\"functions_per_s\":{:.4g},\"mb_per_s\":{:.4g},"
+					 "\"allocs_per_compile\":{},"
+					 "\"alloc_bytes_per_compile\":{}}}",
+					 corpus.name, functions, seconds, functions / seconds,
+					 corpus.source.size() / 1e6 / seconds, allocs, bytes)
+			  << std::endl;
+}
+
+// A function whose body repeats one statement, so that nearly every
+// instruction it runs belongs to that statement
+struct Kernel {
+	const char *name;
+	const char *statement;
+};
+
+constexpr Kernel KERNELS[] = {
+	{"add", "a = a + b;"},
+	{"sub", "a = a - b;"},
+	{"mul", "a = a * b;"},
+	{"div", "c = a / b;"},
+	{"number", "c = a / b - b / a;"},
+	{"concat", "c = \"n\" + a;"},
+	{"compare", "c = a < b;"},
+	{"equal", "c = a == b;"},
+	{"branch", "If a < b Then c = a; Else c = b; End"},
+	{"global", "c = id;"},
+	{"call", "c = id(a);"},
+	{"bitwise", "c = (a & b) | (a ^ b);"},
+	{"shift", "c = a << b;"},
+};
+
+constexpr int KERNEL_REPEAT = 256;
+
+std::string kernel_source() {
+	std::string src = "Function id(x)\n\tReturn x;\nEnd\n\n"
+					  "Function empty(a, b)\n\tReturn a;\nEnd\n\n";
+	for (const auto &kernel : KERNELS) {
+		src += std::format("Function k_{}(a, b)\n\tDeclare c;\n",
+						   kernel.name);
+		for (int i = 0; i < KERNEL_REPEAT; i++) {
+			src += std::format("\t{}\n", kernel.statement);
+		}
+		src += "\tReturn c;\nEnd\n\n";
+	}
+	src += "Function yields(a, b)\n";
+	for (int i = 0; i < KERNEL_REPEAT; i++) {
+		src += "\ta = _Yield a + b;\n";
+	}
+	src += "\tReturn a;\nEnd\n\n";
+	return src;
+}
+
+// ns per bytecode instruction of each kernel, after subtracting the cost of
+// calling an empty function from the host. Instructions are counted as
+// compiled, the branch kernel skips some of its own. isa is "stack",
+// "registers" or "jit", the last compiling each kernel on its first call.
+// Coroutines always run the stack ISA, so resuming one is measured with
+// "stack" only: ns per resume of a coroutine that yields KERNEL_REPEAT
+// times, spawning and releasing it included.
+void bench_vm(std::string_view isa) {
+	std::string source = kernel_source();
+	cypheri::NameTable name_table;
+	cypheri::TokenStream tokens(source, name_table);
+	auto parsed = cypheri::parse(tokens, name_table);
+	if (auto err = std::get_if<cypheri::SyntaxError>(&parsed)) {
+		std::cerr << std::format("kernels: {}", *err) << std::endl;
+		return;
+	}
+	const auto &mod = std::get<cypheri::BytecodeModule>(parsed);
+
+	cypheri::VMOptions options;
+	options.register_isa = isa != "stack";
+	options.jit = isa == "jit";
+	options.jit_threshold = 1;
+	cypheri::VM vm(name_table, options);
+	if (auto err = vm.load(mod)) {
+		std::cerr << std::format("kernels: {}", *err) << std::endl;
+		return;
+	}
+
+	const cypheri::Value args[] = {cypheri::Value::from_small_int(3),
+								   cypheri::Value::from_small_int(1)};
+	auto call = [&](std::string_view name) {
+		auto id = name_table.get_id(name);
+		return time_runs([&] { (void)vm.call(id, args); });
+	};
+
+	double overhead = call("empty");
+	std::cout << std::format("{{\"bench\":\"vm\",\"isa\":\"{}\","
+							 "\"kernel\":\"host_call\","
+							 "\"ns_per_call\":{:.4g}}}",
+							 isa, overhead * 1e9)
+			  << std::endl;
+
+	for (const auto &kernel : KERNELS) {
+		auto name = std::format("k_{}", kernel.name);
+		size_t ops =
+			mod.functions.find(name_table.get_id(name))->instructions.size();
+		double seconds = call(name) - overhead;
+		std::cout << std::format("{{\"bench\":\"vm\",\"isa\":\"{}\","
+								 "\"kernel\":\"{}\",\"ops\":{},"
+								 "\"ns_per_op\":{:.4g}}}",
+								 isa, kernel.name, ops, seconds * 1e9 / ops)
+				  << std::endl;
+	}
+
+	if (isa != "stack") {
+		return;
+	}
+	auto yields = vm.get_global(name_table.get_id("yields"));
+	double seconds = time_runs([&] {
+		auto spawned = vm.spawn(*yields, args);
+		auto co = std::get_if<cypheri::Coroutine *>(&spawned);
+		if (!co) {
+			return;
+		}
+		while ((*co)->status() == cypheri::CoroutineStatus::SUSPENDED) {
+			(void)vm.resume(**co, args[1]);
+		}
+		vm.release(**co);
+	});
+	std::cout << std::format("{{\"bench\":\"vm\",\"isa\":\"{}\","
+							 "\"kernel\":\"resume\","
+							 "\"ns_per_resume\":{:.4g}}}",
+							 isa, seconds * 1e9 / (KERNEL_REPEAT + 1))
+			  << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+	auto corpora = make_corpora(argc, argv);
+	for (const auto &corpus : corpora) {
+		bench_tokenize(corpus);
+	}
+	for (const auto &corpus : corpora) {
+		bench_parse(corpus);
+	}
+	bench_vm("stack");
+	bench_vm("registers");
+	bench_vm("jit");
+	return 0;
+}
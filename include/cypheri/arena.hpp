@@ -0,0 +1,87 @@
+#ifndef CYPHERI_ARENA_HPP
+#define CYPHERI_ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace cypheri {
+
+// Bump allocator for short-lived objects that die together. Nothing is
+// freed individually and no destructors run, reset() rewinds to the start
+// while keeping the blocks for reuse, so a warmed up arena doesn't touch
+// the heap at all.
+class Arena {
+public:
+	static constexpr size_t DEFAULT_BLOCK_SIZE = 16 * 1024;
+
+	explicit Arena(size_t block_size = DEFAULT_BLOCK_SIZE) noexcept;
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+	Arena(Arena &&) noexcept = default;
+	Arena &operator=(Arena &&) noexcept = default;
+
+	void *allocate(size_t size, size_t align) noexcept;
+
+	template <typename T, typename... Args> T *create(Args &&...args) noexcept {
+		static_assert(std::is_trivially_destructible_v<T>,
+					  "objects in an arena are never destroyed");
+		return new (allocate(sizeof(T), alignof(T)))
+			T(std::forward<Args>(args)...);
+	}
+
+	// Copy of the given elements, living as long as the arena
+	template <typename T> std::span<T> copy(std::span<const T> items) noexcept {
+		static_assert(std::is_trivially_copyable_v<T>,
+					  "arrays in an arena are copied bytewise");
+		if (items.empty()) {
+			return {};
+		}
+		auto *res = static_cast<T *>(
+			allocate(sizeof(T) * items.size(), alignof(T)));
+		std::uninitialized_copy(items.begin(), items.end(), res);
+		return {res, items.size()};
+	}
+
+	void reset() noexcept;
+
+	// Bytes handed out since the last reset
+	size_t used() const noexcept;
+
+	// Bytes in all blocks, whether handed out or not
+	size_t capacity() const noexcept;
+
+private:
+	struct Block {
+		std::unique_ptr<std::byte[]> data;
+		size_t size;
+	};
+
+	size_t block_size;
+	std::vector<Block> blocks;
+	size_t current = 0; // block being bumped into
+	size_t offset = 0;	// first free byte in it
+	size_t used_before = 0; // bytes in the blocks before current
+
+	void *allocate_slow(size_t size, size_t align) noexcept;
+};
+
+inline void *Arena::allocate(size_t size, size_t align) noexcept {
+	if (current < blocks.size()) {
+		auto &block = blocks[current];
+		size_t start = (offset + align - 1) & ~(align - 1);
+		if (start + size <= block.size) {
+			offset = start + size;
+			return block.data.get() + start;
+		}
+	}
+	return allocate_slow(size, align);
+}
+
+} // namespace cypheri
+
+#endif // CYPHERI_ARENA_HPP
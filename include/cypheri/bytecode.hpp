@@ -1,10 +1,13 @@
 #ifndef CYPHERI_IR_HPP
 #define CYPHERI_IR_HPP
 
+#include "cypheri/errors.hpp"
 #include "cypheri/nametable.hpp"
 #include <array>
 #include <cstdint>
 #include <format>
+#include <optional>
+#include <span>
 #include <vector>
 
 namespace cypheri {
@@ -42,11 +45,12 @@ enum class InstructionType : uint8_t {
 	// Stack Instructions
 	LII,	  // Load Immediate Integer
 	LIN,	  // Load Immediate Number
+	LIIW,	  // Load Immediate Integer, Wide (packed constant pool only)
 	LINULL,	  // Load Immediate Null
 	LIBOOL,	  // Load Immediate Boolean
 	LISTR,	  // Load Immediate String
-	LIARR,	  // Load Immediate Array
-	LIOBJ,	  // Load Immediate Object
+	LIARR,	  // Load Immediate Array, of the top n values
+	LIOBJ,	  // Load Immediate Object, empty with room for n properties
 	LILAMBDA, // Load Immediate Lambda
 	LDGLOBAL, // Load Global
 	LDLOCAL,  // Load Local
@@ -57,7 +61,10 @@ enum class InstructionType : uint8_t {
 	ROT3,	  // Rotate Top Three Elements: a b c -> c a b
 	DUP,	  // Duplicate Top Element
 
-	// Object Instructions
+	// Object Instructions. GET and SET name a property, the dynamic ones
+	// take the key from the stack: an integer index into an array, or a
+	// string naming an object's property. SET and SETDNY leave the object
+	// on the stack, so that a literal can be filled in one go.
 	GET,	// Get Property
 	SET,	// Set Property
 	GETDNY, // Get Dynamic Property
@@ -73,6 +80,28 @@ enum class InstructionType : uint8_t {
 	RETNULL, // Return Null
 	YIELD,	 // Yield Coroutine
 
+	// Register Instructions, only used by the register form (regcode.hpp)
+	MOV, // Move Register
+
+	// Superinstructions, only produced by the packed encoding (packed.hpp)
+	ADDLL,		// LDLOCAL a; LDLOCAL b; ADD
+	LTLI_JZ,	// LDLOCAL a; LII k; LT; JZ t
+	CALLGLOBAL, // LDGLOBAL g; CALL n
+
+	// Quickened Instructions, only written by the stack interpreter into
+	// its own copy of the packed code (vm.hpp). Each guards its operands
+	// and turns back into the generic instruction when they don't match.
+	ADD_NN, // ADD of two doubles
+	SUB_NN, // SUB of two doubles
+	MUL_NN, // MUL of two doubles
+	DIV_NN, // DIV of two doubles
+	DIV_II, // DIV of two inline integers
+	LT_NN,	// LT of two doubles
+	LE_NN,	// LE of two doubles
+	GT_NN,	// GT of two doubles
+	GE_NN,	// GE of two doubles
+	CONCAT, // ADD with a string on either side
+
 	// Guaranteed to be last
 	INSTRUCTION_COUNT,
 };
@@ -117,6 +146,7 @@ make_instruction_names_table() {
 	CYPHERI_MAKE_INSTRUCTION_NAME(NOT);
 	CYPHERI_MAKE_INSTRUCTION_NAME(LII);
 	CYPHERI_MAKE_INSTRUCTION_NAME(LIN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(LIIW);
 	CYPHERI_MAKE_INSTRUCTION_NAME(LINULL);
 	CYPHERI_MAKE_INSTRUCTION_NAME(LIBOOL);
 	CYPHERI_MAKE_INSTRUCTION_NAME(LISTR);
@@ -143,6 +173,20 @@ make_instruction_names_table() {
 	CYPHERI_MAKE_INSTRUCTION_NAME(RET);
 	CYPHERI_MAKE_INSTRUCTION_NAME(RETNULL);
 	CYPHERI_MAKE_INSTRUCTION_NAME(YIELD);
+	CYPHERI_MAKE_INSTRUCTION_NAME(MOV);
+	CYPHERI_MAKE_INSTRUCTION_NAME(ADDLL);
+	CYPHERI_MAKE_INSTRUCTION_NAME(LTLI_JZ);
+	CYPHERI_MAKE_INSTRUCTION_NAME(CALLGLOBAL);
+	CYPHERI_MAKE_INSTRUCTION_NAME(ADD_NN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(SUB_NN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(MUL_NN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(DIV_NN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(DIV_II);
+	CYPHERI_MAKE_INSTRUCTION_NAME(LT_NN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(LE_NN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(GT_NN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(GE_NN);
+	CYPHERI_MAKE_INSTRUCTION_NAME(CONCAT);
 #undef CYPHERI_MAKE_INSTRUCTION_NAME
 
 	return names;
@@ -170,11 +214,58 @@ public:
 	size_t &idx() noexcept;
 };
 
+struct LineEntry {
+	size_t pc; // first instruction of the run
+	SourceLocation loc;
+};
+
+// Source location of every instruction of a function, kept apart from the
+// instructions so that they stay small. Instructions from the same
+// statement form a run, stored as variable-length deltas to the run before
+// it: pc, then line and column zigzag encoded. A run usually takes 3 bytes.
+class LineTable {
+public:
+	// Start a run at pc, which must not be below that of the last one. A
+	// run left empty by that is replaced, one at the same location merged.
+	void add(size_t pc, SourceLocation loc) noexcept;
+
+	// Location of the run holding pc, std::nullopt before the first run
+	std::optional<SourceLocation> find(size_t pc) const noexcept;
+
+	std::vector<LineEntry> entries() const noexcept;
+
+	// The table after instruction i moved to remap[i], for code that was
+	// lowered or had instructions removed. remap must not decrease, runs
+	// that end up at the same pc keep the last one.
+	LineTable remapped(std::span<const size_t> remap) const noexcept;
+
+	// Move every run by delta lines, for functions an edit shifted
+	void shift_lines(int64_t delta) noexcept;
+
+	std::span<const uint8_t> bytes() const noexcept {
+		return data;
+	}
+
+	// std::nullopt if bytes aren't a valid table
+	static std::optional<LineTable>
+	from_bytes(std::span<const uint8_t> bytes) noexcept;
+
+private:
+	std::vector<uint8_t> data;
+
+	// The last run and where it starts in data, and the one before it, so
+	// that add() can take the last one back
+	LineEntry last{0, {0, 0}}, before_last{0, {0, 0}};
+	size_t last_offset = 0;
+	size_t runs = 0;
+};
+
 class BytecodeFunction {
 public:
 	NameIdType name;
 	size_t local_count = 0, arg_count = 0;
 	std::vector<BytecodeInstruction> instructions;
+	LineTable lines;
 };
 
 class BytecodeModule {
@@ -186,6 +277,21 @@ public:
 	std::vector<NameIdType> global_names;
 };
 
+struct StackEffect {
+	int pops, pushes;
+};
+
+// Number of operand stack slots an instruction consumes and produces, or
+// std::nullopt for instructions whose stack behaviour is not defined yet.
+std::optional<StackEffect> stack_effect(const BytecodeInstruction &inst) noexcept;
+
+// Operand stack depth before each instruction (-1 for unreachable ones).
+// Returns std::nullopt if the function is malformed: stack underflow, jumps
+// out of range, falling off the end, or two paths merging with different
+// depths.
+std::optional<std::vector<int>>
+compute_stack_depths(const BytecodeFunction &func) noexcept;
+
 } // namespace cypheri
 
 template <> struct std::formatter<cypheri::InstructionType> {
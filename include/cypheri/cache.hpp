@@ -0,0 +1,91 @@
+#ifndef CYPHERI_CACHE_HPP
+#define CYPHERI_CACHE_HPP
+
+#include "cypheri/bytecode.hpp"
+#include "cypheri/nametable.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace cypheri {
+
+// On-disk bytecode cache. A cache file holds one module together with the
+// slice of the name table it refers to, and is keyed by a hash of the source
+// it was compiled from. A hit saves tokenizing, parsing and optimizing, not
+// loading: opening a file maps and validates it, and the accessors below
+// read it in place, but to run it the module is rebuilt by to_module() and
+// then verified, lowered and linked by CodeImage::build() like a freshly
+// compiled one. Instructions are stored in the in-memory layout of
+// BytecodeInstruction, so rebuilding copies them in bulk. Name operands
+// (LDGLOBAL, STGLOBAL) hold indices into the name slice instead of
+// NameIdTypes, those are the only ones to patch.
+//
+// Bump CACHE_FORMAT_VERSION whenever the layout or the meaning of an
+// instruction changes, stale files are then rejected instead of misread.
+constexpr uint32_t CACHE_FORMAT_VERSION = 2;
+
+uint64_t hash_source(std::string_view source) noexcept;
+
+// Write to a temporary file next to path first and rename it into place, so
+// that readers never see a half written cache.
+bool write_bytecode_cache(const std::string &path, const BytecodeModule &mod,
+						  const NameTable &name_table,
+						  uint64_t source_hash) noexcept;
+
+struct CachedFunction {
+	uint32_t name; // index into the name slice
+	uint32_t local_count, arg_count;
+	std::span<const BytecodeInstruction> code;
+	std::span<const uint8_t> lines; // LineTable::bytes()
+};
+
+class MappedBytecode {
+public:
+	// std::nullopt if the file is missing, was written by another version or
+	// for another source, or is malformed; the caller recompiles then.
+	static std::optional<MappedBytecode> open(const std::string &path,
+											  uint64_t source_hash) noexcept;
+
+	MappedBytecode(MappedBytecode &&other) noexcept;
+	MappedBytecode &operator=(MappedBytecode &&other) noexcept;
+	MappedBytecode(const MappedBytecode &) = delete;
+	MappedBytecode &operator=(const MappedBytecode &) = delete;
+	~MappedBytecode();
+
+	size_t name_count() const noexcept;
+	std::string_view name(uint32_t idx) const noexcept;
+
+	size_t function_count() const noexcept;
+	CachedFunction function(size_t idx) const noexcept;
+
+	size_t str_lit_count() const noexcept;
+	std::string_view str_lit(size_t idx) const noexcept;
+
+	std::span<const uint32_t> global_names() const noexcept;
+
+	// Intern the name slice and rebuild the module, copying the code of
+	// every function out of the mapping and rewriting its name operands.
+	// Done on every load, the mapping itself is never run.
+	BytecodeModule to_module(NameTable &name_table) const noexcept;
+
+private:
+	MappedBytecode() noexcept = default;
+
+	const std::byte *data = nullptr;
+	size_t size = 0;
+	bool mapped = false; // otherwise data was read into a heap buffer
+
+	template <typename T> const T *at(uint64_t offset) const noexcept {
+		return reinterpret_cast<const T *>(data + offset);
+	}
+
+	void release() noexcept;
+	bool validate(uint64_t source_hash) const noexcept;
+};
+
+} // namespace cypheri
+
+#endif // CYPHERI_CACHE_HPP
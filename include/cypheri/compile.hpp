@@ -0,0 +1,40 @@
+#ifndef CYPHERI_COMPILE_HPP
+#define CYPHERI_COMPILE_HPP
+
+#include "cypheri/bytecode.hpp"
+#include "cypheri/errors.hpp"
+#include "cypheri/nametable.hpp"
+#include "cypheri/parse.hpp"
+#include <span>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace cypheri {
+
+struct CompileOptions {
+	// stats is ignored, every file gets its own in CompiledFile
+	ParseOptions parse;
+
+	// 0 uses one thread per hardware thread
+	size_t threads = 0;
+};
+
+struct CompiledFile {
+	std::string path;
+
+	// Files that can't be read fail with a SyntaxError at line 0
+	std::variant<BytecodeModule, SyntaxError> result;
+	ParseStats stats;
+};
+
+// Tokenize and parse each file into its own module on a work-stealing
+// thread pool, in the order of paths. The name table must be concurrent
+// to use more than one thread, otherwise everything runs on the caller's.
+std::vector<CompiledFile> compile_many(std::span<const std::string> paths,
+									   NameTable &name_table,
+									   CompileOptions options = {}) noexcept;
+
+} // namespace cypheri
+
+#endif // CYPHERI_COMPILE_HPP
@@ -19,6 +19,13 @@ public:
 	SourceLocation location;
 };
 
+class RuntimeError {
+public:
+	RuntimeError(const std::string &message) noexcept;
+
+	std::string message;
+};
+
 } // namespace cypheri
 
 template <>
@@ -43,4 +50,15 @@ struct std::formatter<cypheri::SyntaxError> {
 	}
 };
 
+template <>
+struct std::formatter<cypheri::RuntimeError> {
+	template <typename ParseContext>
+	constexpr auto parse(ParseContext& ctx) { return ctx.begin(); }
+
+	template <typename FormatContext>
+	auto format(const cypheri::RuntimeError& err, FormatContext& ctx) const {
+	    return format_to(ctx.out(), "Runtime error: {}.", err.message);
+	}
+};
+
 #endif // CYPHERI_ERRORS_HPP
\ No newline at end of file
@@ -0,0 +1,121 @@
+#ifndef CYPHERI_HEAP_HPP
+#define CYPHERI_HEAP_HPP
+
+#include "cypheri/arena.hpp"
+#include "cypheri/nametable.hpp"
+#include "cypheri/value.hpp"
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace cypheri {
+
+// Integer that doesn't fit inline in a Value
+struct BoxedInt {
+	int64_t value;
+};
+
+struct Array {
+	uint32_t size, capacity;
+	Value *items;
+};
+
+// Hidden class: which properties an object has and the slot of each.
+// Objects that got the same properties in the same order share a shape, so
+// a property access site can remember where the property lives per shape
+// instead of looking it up. Shapes form a tree rooted at the empty one, each
+// adding a single property to its parent.
+struct Shape {
+	const Shape *parent; // nullptr for the empty shape
+	NameIdType name;	 // the property added last, its slot is size - 1
+	uint32_t size;		 // number of properties
+
+	// Children by the property they add, almost always very few
+	mutable std::vector<std::pair<NameIdType, Shape *>> transitions;
+};
+
+struct Object {
+	const Shape *shape;
+	uint32_t capacity;
+	Value *slots; // shape->size of them are in use
+};
+
+struct HeapStats {
+	size_t live_bytes;	 // handed out and not given back, rounded up
+	size_t pooled_bytes; // pool blocks, whether in use or free
+	size_t large_bytes;	 // allocations over the largest size class
+	size_t shape_count;	 // including the empty shape
+};
+
+// Runtime objects of a VM. Small allocations are rounded up to a power of
+// two size class and carved out of pool blocks, with a free list per class,
+// so element arrays that grow in place reuse each other's memory. Larger
+// ones get an allocation of their own. Everything lives as long as the heap,
+// there is no collector yet.
+class Heap {
+public:
+	Heap() noexcept = default;
+	Heap(const Heap &) = delete;
+	Heap &operator=(const Heap &) = delete;
+	~Heap();
+
+	BoxedInt *make_int(int64_t value) noexcept;
+	Array *make_array(std::span<const Value> items) noexcept;
+	Object *make_object(size_t capacity = 0) noexcept;
+
+	void push(Array *arr, Value value) noexcept;
+
+	static constexpr uint32_t NO_SLOT = -1;
+
+	// Walks up the shape tree, NO_SLOT for properties the shape doesn't have
+	static uint32_t find_slot(const Shape *shape, NameIdType name) noexcept;
+
+	// The child of shape adding name, created on first use
+	const Shape *transition(const Shape *shape, NameIdType name) noexcept;
+
+	// NULL for properties the object doesn't have
+	static Value get(const Object *obj, NameIdType name) noexcept;
+	void set(Object *obj, NameIdType name, Value value) noexcept;
+
+	// Move obj to next, a transition of its shape, storing the new property
+	void add_property(Object *obj, const Shape *next, Value value) noexcept;
+
+	HeapStats stats() const noexcept;
+
+private:
+	static constexpr int MIN_CLASS_BITS = 4; // 16 bytes
+	static constexpr int CLASS_COUNT = 8;	 // up to 2 KiB
+	static constexpr size_t MAX_CLASS_SIZE =
+		size_t{1} << (MIN_CLASS_BITS + CLASS_COUNT - 1);
+
+	struct FreeCell {
+		FreeCell *next;
+	};
+
+	// Header in front of a large allocation, they are linked so that the
+	// destructor can find them
+	struct alignas(16) LargeHeader {
+		LargeHeader *prev, *next;
+		size_t size;
+	};
+
+	std::array<FreeCell *, CLASS_COUNT> free_lists{};
+	Arena pool;
+	LargeHeader *large = nullptr;
+	Shape empty_shape{nullptr, NameTable::INVALID_ID, 0, {}};
+	std::deque<Shape> shapes; // all but the empty one
+	size_t live_bytes = 0, large_bytes = 0;
+
+	void *allocate(size_t size) noexcept;
+	void deallocate(void *ptr, size_t size) noexcept;
+	template <typename T> T *allocate_array(size_t count) noexcept;
+	template <typename T>
+	T *grow(T *items, uint32_t size, uint32_t &capacity) noexcept;
+};
+
+} // namespace cypheri
+
+#endif // CYPHERI_HEAP_HPP
@@ -0,0 +1,66 @@
+#ifndef CYPHERI_IMAGE_HPP
+#define CYPHERI_IMAGE_HPP
+
+#include "cypheri/bytecode.hpp"
+#include "cypheri/errors.hpp"
+#include "cypheri/nametable.hpp"
+#include "cypheri/packed.hpp"
+#include "cypheri/regcode.hpp"
+#include <memory>
+#include <optional>
+#include <span>
+#include <variant>
+#include <vector>
+
+namespace cypheri {
+
+struct ImageOptions {
+	// Also lower functions to the register form where possible
+	bool register_isa = false;
+
+	// Fuse common instruction sequences in the packed encoding
+	bool superinstructions = true;
+};
+
+// A function ready to run. Global names in its code are linked to slot
+// indices of the image it belongs to.
+struct ImageFunction {
+	PackedFunction packed;
+
+	// local_count plus the maximum operand stack depth
+	size_t frame_size;
+
+	// Only with ImageOptions::register_isa, for functions it can lower
+	std::optional<RegisterFunction> registers;
+};
+
+// The verified and lowered code of a module. It never changes once built,
+// so any number of VMs on any number of threads can run the same image
+// without copying it, each keeping its own globals, heap and inline caches.
+// The name table it was built with must be a concurrent one to do so.
+class CodeImage {
+public:
+	// mod must outlive the image, string literals are referenced in place
+	static std::variant<std::shared_ptr<const CodeImage>, RuntimeError>
+	build(const BytecodeModule &mod, const NameTable &name_table,
+		  ImageOptions options = {}) noexcept;
+
+	const BytecodeModule &module() const noexcept;
+	std::span<const ImageFunction> functions() const noexcept;
+
+	// Name of each global slot, the image's own functions come first
+	std::span<const NameIdType> global_names() const noexcept;
+
+private:
+	const BytecodeModule *mod;
+	std::vector<ImageFunction> funcs;
+	std::vector<NameIdType> globals;
+	SpraseNameArray<uint32_t> global_slots;
+
+	uint32_t global_slot(NameIdType name) noexcept;
+	bool link_globals(ImageFunction &func) noexcept;
+};
+
+} // namespace cypheri
+
+#endif // CYPHERI_IMAGE_HPP
@@ -0,0 +1,92 @@
+#ifndef CYPHERI_JIT_HPP
+#define CYPHERI_JIT_HPP
+
+#include "cypheri/regcode.hpp"
+#include "cypheri/value.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Baseline compiler from the register form to native code. Only x86-64 with
+// the System V calling convention has a backend so far, elsewhere compile()
+// always gives up and functions stay interpreted.
+#ifndef CYPHERI_VM_JIT
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CYPHERI_VM_JIT 1
+#else
+#define CYPHERI_VM_JIT 0
+#endif
+#endif
+
+namespace cypheri {
+
+class VM;
+
+// Owned by the VM, see vm.hpp
+struct FunctionRecord;
+
+// What compiled code hands back, in RAX and RDX. Any status other than the
+// two below deoptimizes: the frame continues in the register interpreter at
+// instruction status - 1, its registers are where the interpreter keeps them.
+struct JitResult {
+	uint64_t value; // bits of the returned Value, with JIT_RETURNED
+	uint64_t status;
+};
+
+constexpr uint64_t JIT_RETURNED = 0;
+constexpr uint64_t JIT_FAILED = ~uint64_t{0}; // the VM holds the error
+
+// Entry points into the VM that compiled code calls, all taking the
+// instruction being run and the registers of its frame
+struct JitHelpers {
+	// Run an instruction the generic way, or return false without having
+	// changed anything when it would fail, to deoptimize there and let the
+	// interpreter report the error
+	bool (*slow)(VM *vm, const FunctionRecord *func, Value *reg,
+				 const RegisterInstruction *inst) noexcept;
+
+	// Run a CALL, JIT_RETURNED once the result is in its frame start
+	uint64_t (*call)(VM *vm, const FunctionRecord *func, Value *reg,
+					 const RegisterInstruction *inst) noexcept;
+
+	bool (*truthy)(const Value &v) noexcept;
+};
+
+// Native code of one function of one VM. Small integer and double
+// arithmetic, comparisons, jumps, loads and moves are done inline, the rest
+// of each instruction through the helpers. Instructions it can't compile
+// deoptimize when reached.
+class JitFunction {
+public:
+	using Entry = JitResult (*)(VM *vm, Value *reg) noexcept;
+
+	// nullptr without a backend, for functions without a register form, or
+	// when out of executable memory. The code embeds the addresses of the
+	// function's globals and literals, so it is only valid for func's VM.
+	static std::unique_ptr<JitFunction>
+	compile(const FunctionRecord &func, const JitHelpers &helpers) noexcept;
+
+	JitFunction(const JitFunction &) = delete;
+	JitFunction &operator=(const JitFunction &) = delete;
+	~JitFunction();
+
+	// reg is the frame pushed for the call, arguments in place
+	JitResult run(VM &vm, Value *reg) const noexcept {
+		return entry(&vm, reg);
+	}
+
+	size_t code_size() const noexcept {
+		return size;
+	}
+
+private:
+	JitFunction(void *memory, size_t mapped, size_t size) noexcept;
+
+	void *memory;
+	size_t mapped, size; // bytes of pages and of code in them
+	Entry entry;
+};
+
+} // namespace cypheri
+
+#endif // CYPHERI_JIT_HPP
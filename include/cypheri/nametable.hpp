@@ -1,35 +1,191 @@
 #ifndef CYPHERI_NAMETABLE_HPP
 #define CYPHERI_NAMETABLE_HPP
 
+#include "cypheri/arena.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
-#include <unordered_map>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 namespace cypheri {
 
 using NameIdType = uint32_t;
 
+struct NameTableStats {
+	size_t names;
+	size_t string_bytes; // characters interned, without padding
+	size_t table_slots;	 // capacity of the hash tables
+	size_t memory_bytes; // arena blocks, hash tables and id index together
+};
+
+// Interns names into arenas, so the string_views handed out stay valid for
+// the lifetime of the table. Names are spread over SHARD_COUNT shards by
+// hash, each an open-addressing table of cached hashes and ids with linear
+// probing.
+//
+// A concurrent table may be shared by any number of threads tokenizing at
+// the same time, and the ids it hands out are valid for all of them. Looking
+// up a name that already exists never blocks, inserting one locks its shard
+// only. A table that is not concurrent skips the locking.
 class NameTable {
 public:
 	static constexpr NameIdType INVALID_ID = -1;
 
+	explicit NameTable(bool concurrent = false);
+	NameTable(const NameTable &) = delete;
+	NameTable &operator=(const NameTable &) = delete;
+
 	NameIdType get_id(std::string_view name) const;
 	NameIdType get_id_or_insert(std::string_view name);
+
+	// Only for ids this thread got from the table, or learnt about through
+	// some other synchronization
 	std::string_view get_name(NameIdType id) const;
 	size_t size() const;
+	bool is_concurrent() const;
+
+	// Make room for count names in total without rehashing
+	void reserve(size_t count);
+
+	NameTableStats stats() const;
 
 private:
-	struct Item {
-		std::unique_ptr<char[]> name;
-		size_t count;
+	static constexpr int SHARD_BITS = 4;
+	static constexpr size_t SHARD_COUNT = size_t{1} << SHARD_BITS;
+
+	// Segment k of the id index holds 2^(k + FIRST_SEGMENT_BITS) names, so
+	// that entries never move while the index grows.
+	static constexpr int FIRST_SEGMENT_BITS = 10;
+	static constexpr size_t SEGMENT_COUNT = 32 - FIRST_SEGMENT_BITS + 1;
+
+	// A slot is hash << 32 | (id + 1), zero if empty. Slots are written
+	// once, readers load them without holding the shard's lock.
+	struct SlotArray {
+		size_t mask;
+		std::unique_ptr<std::atomic<uint64_t>[]> slots;
 	};
-	std::vector<Item> names;
-	std::unordered_map<std::string_view, NameIdType> name_to_id;
+
+	struct Shard {
+		mutable std::mutex mutex;
+		std::atomic<const SlotArray *> table;
+
+		// The current table and the ones it replaced, which readers may
+		// still be probing, all freed with the NameTable
+		std::vector<std::unique_ptr<SlotArray>> arrays;
+		size_t count = 0;
+		Arena strings;
+		size_t string_bytes = 0;
+	};
+
+	bool concurrent;
+	std::array<Shard, SHARD_COUNT> shards;
+	std::array<std::atomic<std::string_view *>, SEGMENT_COUNT> segments{};
+	std::vector<std::unique_ptr<std::string_view[]>> segment_storage;
+	std::mutex segment_mutex;
+	std::atomic<NameIdType> next_id = 0;
+
+	static uint32_t hash(std::string_view name);
+	NameIdType find(const SlotArray *table, std::string_view name,
+					uint32_t h) const;
+	void grow(Shard &shard, size_t capacity);
+	std::string_view *segment_for(NameIdType id);
 };
 
-template <typename T> using SpraseNameArray = std::unordered_map<NameIdType, T>;
+// Map from names to values, for names of one NameTable. Values are stored
+// densely in insertion order, each name's position is found through an array
+// indexed by its id, so lookups never hash. Erasing moves the last value
+// into the gap, which invalidates references to it.
+template <typename T> class SpraseNameArray {
+public:
+	using value_type = std::pair<NameIdType, T>;
+	using iterator = typename std::vector<value_type>::iterator;
+	using const_iterator = typename std::vector<value_type>::const_iterator;
+
+	T &operator[](NameIdType name) {
+		if (auto *value = find(name)) {
+			return *value;
+		}
+
+		if (name >= index.size()) {
+			index.resize(std::max<size_t>(name + 1, index.size() * 2), 0);
+		}
+		values.emplace_back(std::piecewise_construct,
+							std::forward_as_tuple(name),
+							std::forward_as_tuple());
+		index[name] = static_cast<uint32_t>(values.size());
+		return values.back().second;
+	}
+
+	T *find(NameIdType name) noexcept {
+		if (name >= index.size() || index[name] == 0) {
+			return nullptr;
+		}
+		return &values[index[name] - 1].second;
+	}
+
+	const T *find(NameIdType name) const noexcept {
+		return const_cast<SpraseNameArray *>(this)->find(name);
+	}
+
+	bool contains(NameIdType name) const noexcept {
+		return find(name) != nullptr;
+	}
+
+	bool erase(NameIdType name) noexcept {
+		if (!contains(name)) {
+			return false;
+		}
+
+		uint32_t pos = index[name] - 1;
+		if (pos + 1 != values.size()) {
+			values[pos] = std::move(values.back());
+			index[values[pos].first] = pos + 1;
+		}
+		values.pop_back();
+		index[name] = 0;
+		return true;
+	}
+
+	void clear() noexcept {
+		values.clear();
+		index.clear();
+	}
+
+	size_t size() const noexcept {
+		return values.size();
+	}
+
+	bool empty() const noexcept {
+		return values.empty();
+	}
+
+	iterator begin() noexcept {
+		return values.begin();
+	}
+
+	iterator end() noexcept {
+		return values.end();
+	}
+
+	const_iterator begin() const noexcept {
+		return values.begin();
+	}
+
+	const_iterator end() const noexcept {
+		return values.end();
+	}
+
+private:
+	std::vector<value_type> values;
+	std::vector<uint32_t> index; // position in values plus one, 0 if absent
+};
 
 } // namespace cypheri
 
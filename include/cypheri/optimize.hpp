@@ -0,0 +1,16 @@
+#ifndef CYPHERI_OPTIMIZE_HPP
+#define CYPHERI_OPTIMIZE_HPP
+
+#include "cypheri/bytecode.hpp"
+#include <cstddef>
+
+namespace cypheri {
+
+// Rewrite short instruction sequences into cheaper equivalents and drop
+// unreachable code, remapping jump targets. Runs to a fixed point and
+// returns the number of instructions removed.
+size_t peephole_optimize(BytecodeFunction &func) noexcept;
+
+} // namespace cypheri
+
+#endif // CYPHERI_OPTIMIZE_HPP
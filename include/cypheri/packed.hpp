@@ -0,0 +1,89 @@
+#ifndef CYPHERI_PACKED_HPP
+#define CYPHERI_PACKED_HPP
+
+#include "cypheri/bytecode.hpp"
+#include "cypheri/nametable.hpp"
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+namespace cypheri {
+
+// Compact encoding of BytecodeInstruction: one 32-bit word with the
+// instruction type in the low 8 bits and an inline operand in the high 24.
+// Operands that don't fit (LIN doubles, wide LII integers) are stored in a
+// per-function constant pool and referenced by index.
+using PackedInstruction = uint32_t;
+
+constexpr int PACKED_OPERAND_BITS = 24;
+constexpr uint32_t PACKED_OPERAND_MAX = (1u << PACKED_OPERAND_BITS) - 1;
+constexpr int32_t PACKED_SOPERAND_MIN = -(1 << (PACKED_OPERAND_BITS - 1));
+constexpr int32_t PACKED_SOPERAND_MAX = (1 << (PACKED_OPERAND_BITS - 1)) - 1;
+
+constexpr PackedInstruction pack_instruction(InstructionType type,
+											 uint32_t operand = 0) noexcept {
+	return static_cast<uint32_t>(type) | (operand << 8);
+}
+
+constexpr InstructionType packed_type(PackedInstruction inst) noexcept {
+	return static_cast<InstructionType>(inst & 0xff);
+}
+
+constexpr uint32_t packed_operand(PackedInstruction inst) noexcept {
+	return inst >> 8;
+}
+
+// Sign-extended operand, for LII
+constexpr int32_t packed_soperand(PackedInstruction inst) noexcept {
+	return static_cast<int32_t>(inst) >> 8;
+}
+
+// Global names in LDGLOBAL and STGLOBAL are linked to the VM's global slot
+// indices on load, CALLGLOBAL holds its slot from the start.
+//
+// Operands of the superinstructions. ADDLL and CALLGLOBAL keep two fields
+// inline, LTLI_JZ refers to a constant pool entry holding its jump target
+// (bits 0-31), local (bits 32-47) and signed 16-bit immediate (bits 48-63).
+constexpr int ADDLL_LOCAL_BITS = 12;
+constexpr int CALLGLOBAL_SLOT_BITS = 16;
+
+// Operand of an arithmetic instruction the stack interpreter stopped trying
+// to quicken: no variant fits the operands it saw first, or the guard of
+// the variant it had quickened to failed. Lowered ones have 0.
+constexpr uint32_t PACKED_GENERIC_SITE = 1;
+
+class PackedFunction {
+public:
+	NameIdType name;
+	uint32_t local_count = 0, arg_count = 0;
+
+	std::vector<PackedInstruction> code;
+
+	// Raw 64-bit literals: integers for LIIW, IEEE 754 bits for LIN
+	std::vector<uint64_t> constants;
+
+	// Property names of the GET and SET instructions in order, their
+	// operand is a site index into this, so that every site can have an
+	// inline cache of its own
+	std::vector<NameIdType> property_names;
+
+	// Remapped to packed instructions, a fused one belongs to the run of
+	// its first instruction
+	LineTable lines;
+};
+
+// Lower a function into the packed encoding, fusing common sequences into
+// superinstructions unless told not to (jump targets are remapped then).
+// LDGLOBAL; CALL is only fused given global_slot, the slot each global name
+// will be linked to, since the fused call holds the slot and it has to fit.
+// Returns std::nullopt if some operand can't be represented in 24 bits
+// (over 16M instructions, locals, names or string literals).
+std::optional<PackedFunction>
+lower_to_packed(const BytecodeFunction &func, bool superinstructions = true,
+				const std::function<uint32_t(NameIdType)> &global_slot =
+					{}) noexcept;
+
+} // namespace cypheri
+
+#endif // CYPHERI_PACKED_HPP
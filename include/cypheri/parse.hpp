@@ -4,14 +4,71 @@
 #include "cypheri/bytecode.hpp"
 #include "cypheri/errors.hpp"
 #include "cypheri/token.hpp"
+#include <optional>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
 namespace cypheri {
 
-std::variant<BytecodeModule, SyntaxError> parse(TokenizeResult &&tk_res,
-												NameTable &name_table) noexcept;
+struct ParseStats {
+	size_t peephole_removed = 0; // instructions removed by the optimizer
+};
+
+// Bytes of a top-level function, from its Function keyword up to the next
+// token, so the whitespace after it belongs to it as well
+struct FunctionSpan {
+	NameIdType name;
+	size_t begin, end;
+	uint32_t line; // of the Function keyword
+};
+
+struct SourceLayout {
+	std::vector<FunctionSpan> functions; // in source order
+	size_t source_size = 0;
+};
+
+struct ParseOptions {
+	// Evaluate operators on literals at compile time and drop identity
+	// operations such as x * 1, turn off to emit expressions as written.
+	bool fold_constants = true;
+
+	// 0 keeps instructions as emitted, 1 runs the peephole optimizer
+	int opt_level = 1;
+
+	// Filled in when set
+	ParseStats *stats = nullptr;
+	SourceLayout *layout = nullptr;
+};
+
+// Pulls tokens from the stream as it goes, so the source is tokenized and
+// parsed in a single pass.
+std::variant<BytecodeModule, SyntaxError>
+parse(TokenStream &tokens, NameTable &name_table,
+	  ParseOptions options = {}) noexcept;
+
+std::variant<BytecodeModule, SyntaxError>
+parse(TokenizeResult &&tk_res, NameTable &name_table,
+	  ParseOptions options = {}) noexcept;
+
+// Replacing bytes [begin, begin + removed) of the previous source with
+// inserted new ones
+struct SourceEdit {
+	size_t begin, removed, inserted;
+};
+
+// Re-tokenize and re-parse only the functions the edit touches, and patch
+// them into mod. mod and layout must come from parsing the previous source
+// with ParseOptions::layout set, both are kept up to date. Other functions
+// keep their bytecode and string literal indices, new literals are appended
+// to str_lits. Functions sharing a name with a touched one are re-parsed as
+// well, so that the last definition wins. On error mod and layout are left
+// unchanged.
+std::optional<SyntaxError> reparse(BytecodeModule &mod, SourceLayout &layout,
+								   std::string_view source, SourceEdit edit,
+								   NameTable &name_table,
+								   ParseOptions options = {}) noexcept;
 
 } // namespace cypheri
 
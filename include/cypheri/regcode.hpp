@@ -0,0 +1,71 @@
+#ifndef CYPHERI_REGCODE_HPP
+#define CYPHERI_REGCODE_HPP
+
+#include "cypheri/bytecode.hpp"
+#include "cypheri/nametable.hpp"
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace cypheri {
+
+// Three-address form of the stack ISA. Locals are registers 0..local_count-1,
+// operand stack slot d lives in register local_count + d, and one scratch
+// register sits on top of those. Instruction types are shared with the stack
+// ISA, with register operands instead of implicit stack slots:
+//
+//   binary ops            a = b op c
+//   NEG, NOT, BNOT, MOV   a = op b
+//   LII, LIBOOL           a = k (signed 32-bit / boolean)
+//   LIIW, LIN             a = constants[k]
+//   LINULL                a = NULL
+//   LISTR, LDGLOBAL       a = string literal k / global named k
+//   STGLOBAL              global named k = a
+//
+// The VM links the global names to its global slot indices on load.
+//   JMP                   goto k
+//   JZ, JNZ               if (!a) / if (a) goto k
+//   CALL                  a = (a + b)(a, ..., a + b - 1), frame starts at a
+//   RET                   return a
+class RegisterInstruction {
+public:
+	RegisterInstruction(InstructionType type, uint16_t a = 0,
+						uint32_t k = 0) noexcept;
+	RegisterInstruction(InstructionType type, uint16_t a, uint16_t b,
+						uint16_t c) noexcept;
+
+	InstructionType type;
+	uint16_t a;
+	uint32_t k; // b in the low half and c in the high half
+
+	uint16_t b() const noexcept {
+		return k & 0xffff;
+	}
+
+	uint16_t c() const noexcept {
+		return k >> 16;
+	}
+};
+
+class RegisterFunction {
+public:
+	NameIdType name;
+	size_t local_count = 0, arg_count = 0;
+	size_t register_count = 0; // frame size, including the scratch register
+	std::vector<RegisterInstruction> instructions;
+
+	// Raw 64-bit literals: integers for LIIW, IEEE 754 bits for LIN
+	std::vector<uint64_t> constants;
+
+	LineTable lines; // remapped to register instructions
+};
+
+// Lower a stack function into the register form. Returns std::nullopt for
+// malformed functions, instructions the register form doesn't cover yet, or
+// frames that need more than 65536 registers.
+std::optional<RegisterFunction>
+lower_to_registers(const BytecodeFunction &func) noexcept;
+
+} // namespace cypheri
+
+#endif // CYPHERI_REGCODE_HPP
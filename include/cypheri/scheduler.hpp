@@ -0,0 +1,60 @@
+#ifndef CYPHERI_SCHEDULER_HPP
+#define CYPHERI_SCHEDULER_HPP
+
+#include "cypheri/errors.hpp"
+#include "cypheri/image.hpp"
+#include "cypheri/nametable.hpp"
+#include "cypheri/value.hpp"
+#include "cypheri/vm.hpp"
+#include <functional>
+#include <memory>
+#include <span>
+#include <variant>
+#include <vector>
+
+namespace cypheri {
+
+// A call to a global function of the image, run as a coroutine. Arguments
+// are handed to whichever isolate picks the actor up, so they must not refer
+// to the memory of a VM: NULL, booleans, numbers (integers inline only) and
+// string literals of the image are fine.
+struct Actor {
+	NameIdType entry;
+	std::vector<Value> args;
+};
+
+struct SchedulerOptions {
+	// 0 uses one thread per hardware thread
+	size_t threads = 0;
+
+	VMOptions vm;
+
+	// Called on every isolate before it runs anything, e.g. to define
+	// natives. The image is loaded already.
+	std::function<void(VM &vm)> setup;
+
+	// Called on the isolate's thread when an actor returns or fails
+	std::function<void(size_t actor, VM &vm,
+					   const std::variant<Value, RuntimeError> &result)>
+		on_exit;
+};
+
+struct SchedulerStats {
+	size_t isolates = 0;
+	size_t resumes = 0;
+};
+
+// Run every actor to completion on a pool of isolates, one VM per thread,
+// all sharing the image. Actors not started yet are dealt round-robin and
+// stolen by isolates that run out of them. A started actor belongs to the
+// isolate that started it, since its objects live on that isolate's heap,
+// and each YIELD gives the other actors there a turn. The name table must
+// be concurrent to use more than one thread, otherwise everything runs on
+// the caller's.
+SchedulerStats run_actors(std::shared_ptr<const CodeImage> image,
+						  NameTable &name_table, std::span<const Actor> actors,
+						  const SchedulerOptions &options = {}) noexcept;
+
+} // namespace cypheri
+
+#endif // CYPHERI_SCHEDULER_HPP
@@ -1,6 +1,7 @@
 #ifndef CYPHERI_TOKEN_HPP
 #define CYPHERI_TOKEN_HPP
 
+#include "cypheri/arena.hpp"
 #include "cypheri/errors.hpp"
 #include "cypheri/nametable.hpp"
 #include <cstdint>
@@ -9,6 +10,7 @@
 #include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace cypheri {
@@ -80,6 +82,7 @@ class Token {
 public:
 	TokenType type;
 	SourceLocation loc;
+	uint32_t offset = 0; // in bytes from the start of the source
 	union {
 		uint64_t integer;
 		double num;
@@ -104,6 +107,112 @@ struct TokenizeResult {
 									 const char *msg) noexcept;
 };
 
+// Line and column are computed lazily, location() counts the newlines since
+// its previous call in bulk instead of consume() tracking every character.
+class SourceStream {
+public:
+	SourceStream(std::string_view source, size_t begin = 0) noexcept
+		: source(source), pos(begin) {}
+
+	char peek() const noexcept {
+		return source[pos];
+	}
+
+	char consume() noexcept {
+		return source[pos++];
+	}
+
+	bool match(char expected) noexcept {
+		if (peek() == expected) {
+			consume();
+			return true;
+		}
+		return false;
+	}
+
+	bool eof() const noexcept {
+		return pos >= source.size();
+	}
+
+	SourceLocation location() noexcept;
+
+	size_t offset() const noexcept {
+		return pos;
+	}
+
+	void skip_whitespace() noexcept;
+	std::string_view consumeIdentifier() noexcept;
+	// A view of the source if the literal has no escape sequences, otherwise
+	// it is unescaped into buf
+	std::string_view consumeString(std::string &buf) noexcept;
+
+private:
+	std::string_view source;
+	size_t pos = 0;
+
+	// newlines before line_pos are accounted for in line and line_start
+	size_t line_pos = 0, line_start = 0;
+	uint32_t line = 1;
+};
+
+// Tokenizes on demand, keeping the next few tokens in a small ring buffer so
+// that the parser can look ahead without the whole token vector in memory.
+// Once the source is exhausted every further token is (eof), after a lexical
+// error it is (error) and error() holds the reason.
+class TokenStream {
+public:
+	static constexpr size_t LOOKAHEAD = 4; // must be a power of two
+
+	// Starting at byte begin, locations and offsets still count from the
+	// start of source
+	TokenStream(std::string_view source, NameTable &name_table,
+				size_t begin = 0) noexcept;
+
+	// Replays tokens that were already produced by tokenize()
+	explicit TokenStream(TokenizeResult &&tk_res) noexcept;
+
+	// offset must be less than LOOKAHEAD
+	const Token &peek(size_t offset = 0) noexcept {
+		if (offset >= count) {
+			fill(offset);
+		}
+		return ring[(head + offset) & (LOOKAHEAD - 1)];
+	}
+
+	Token consume() noexcept;
+
+	std::optional<SyntaxError> &error() noexcept;
+
+	// Indexed by the str_idx of (string) tokens, identical literals share
+	// one index. Views of the source or of storage owned by the stream.
+	const std::vector<std::string_view> &str_literals() noexcept;
+
+private:
+	SourceStream stream;
+	NameTable *name_table;
+	std::optional<SyntaxError> err;
+	std::vector<std::string_view> strs;
+	std::unordered_map<std::string_view, size_t> str_index;
+	Arena str_arena;		// literals with escape sequences
+	std::string string_buf; // unescaping scratch space
+
+	std::vector<Token> ring;
+	size_t head = 0, count = 0;
+	size_t token_begin = 0; // offset of the token being scanned
+
+	// only for the TokenizeResult constructor
+	std::vector<Token> replay;
+	size_t replay_pos = 0;
+	std::vector<std::string> replay_strs;
+
+	void fill(size_t offset) noexcept;
+	Token next() noexcept;
+	Token scan() noexcept;
+	Token fail(SourceLocation loc, const char *msg) noexcept;
+	size_t add_literal(std::string_view str) noexcept;
+};
+
+// Convenience wrapper draining a TokenStream into a vector
 TokenizeResult tokenize(std::string_view source,
 						NameTable &name_table) noexcept;
 
@@ -0,0 +1,261 @@
+#ifndef CYPHERI_VALUE_HPP
+#define CYPHERI_VALUE_HPP
+
+#include "cypheri/bytecode.hpp"
+#include <bit>
+#include <cstdint>
+#include <format>
+#include <string>
+
+namespace cypheri {
+
+// Owned by the VM, see vm.hpp
+struct FunctionRecord;
+struct NativeRecord;
+
+// Allocated from a Heap, see heap.hpp
+class Heap;
+struct BoxedInt;
+struct Array;
+struct Object;
+
+enum class ValueType : uint8_t {
+	NIL,	  // NULL
+	BOOL,	  // Boolean
+	INT,	  // 64-bit Integer
+	NUMBER,	  // Double Precision Number
+	STRING,	  // String
+	FUNCTION, // Bytecode Function
+	NATIVE,	  // Host Function
+	ARRAY,	  // Array
+	OBJECT,	  // Object
+};
+
+// A NaN-boxed 64-bit word. Doubles are stored as they are, with every NaN
+// turned into the positive quiet one, which leaves the negative quiet NaNs
+// (top 16 bits 0xfff8 to 0xffff) free to encode everything else: a tag in
+// the top 16 bits and a 48-bit payload. Integers that fit in 48 bits are
+// stored inline, larger ones are boxed on a Heap. Pointers must fit in 48
+// bits, as they do in user space on x86-64 and AArch64.
+class Value {
+public:
+	constexpr Value() noexcept : bits(NIL_BITS) {}
+
+	static constexpr Value from_bool(bool b) noexcept {
+		return Value(b ? TRUE_BITS : FALSE_BITS);
+	}
+
+	static constexpr bool fits_small_int(int64_t i) noexcept {
+		return i >= -(int64_t{1} << 47) && i < (int64_t{1} << 47);
+	}
+
+	// Only for integers that fit_small_int
+	static constexpr Value from_small_int(int64_t i) noexcept {
+		return Value(tagged(INT_TAG, static_cast<uint64_t>(i) & PAYLOAD_MASK));
+	}
+
+	static Value from_int(int64_t i, Heap &heap) noexcept {
+		return fits_small_int(i) ? from_small_int(i) : box_int(i, heap);
+	}
+
+	static constexpr Value from_number(double num) noexcept {
+		return Value(num != num ? CANONICAL_NAN : std::bit_cast<uint64_t>(num));
+	}
+
+	static Value from_string(const std::string *str) noexcept {
+		return from_pointer(STRING_TAG, str);
+	}
+
+	static Value from_function(const FunctionRecord *func) noexcept {
+		return from_pointer(FUNCTION_TAG, func);
+	}
+
+	static Value from_native(const NativeRecord *native) noexcept {
+		return from_pointer(NATIVE_TAG, native);
+	}
+
+	static Value from_array(Array *arr) noexcept {
+		return from_pointer(ARRAY_TAG, arr);
+	}
+
+	static Value from_object(Object *obj) noexcept {
+		return from_pointer(OBJECT_TAG, obj);
+	}
+
+	constexpr ValueType type() const noexcept {
+		switch (tag()) {
+		case MISC_TAG:
+			return bits == NIL_BITS ? ValueType::NIL : ValueType::BOOL;
+		case INT_TAG:
+		case BOXED_INT_TAG:
+			return ValueType::INT;
+		case STRING_TAG:
+			return ValueType::STRING;
+		case FUNCTION_TAG:
+			return ValueType::FUNCTION;
+		case NATIVE_TAG:
+			return ValueType::NATIVE;
+		case ARRAY_TAG:
+			return ValueType::ARRAY;
+		case OBJECT_TAG:
+			return ValueType::OBJECT;
+		default:
+			return ValueType::NUMBER;
+		}
+	}
+
+	constexpr bool is_nil() const noexcept {
+		return bits == NIL_BITS;
+	}
+
+	constexpr bool is_bool() const noexcept {
+		return (bits | 1) == TRUE_BITS;
+	}
+
+	constexpr bool is_number() const noexcept {
+		return bits < MISC_BITS;
+	}
+
+	// Inline integers only, the fast path of integer arithmetic
+	constexpr bool is_small_int() const noexcept {
+		return tag() == INT_TAG;
+	}
+
+	constexpr bool as_bool() const noexcept {
+		return bits == TRUE_BITS;
+	}
+
+	constexpr int64_t small_int() const noexcept {
+		return static_cast<int64_t>(bits << 16) >> 16;
+	}
+
+	int64_t as_int() const noexcept;
+
+	constexpr double as_number() const noexcept {
+		return std::bit_cast<double>(bits);
+	}
+
+	const std::string *as_string() const noexcept {
+		return pointer<const std::string>();
+	}
+
+	const FunctionRecord *as_function() const noexcept {
+		return pointer<const FunctionRecord>();
+	}
+
+	const NativeRecord *as_native() const noexcept {
+		return pointer<const NativeRecord>();
+	}
+
+	Array *as_array() const noexcept {
+		return pointer<Array>();
+	}
+
+	Object *as_object() const noexcept {
+		return pointer<Object>();
+	}
+
+	// The encoded word, equal for values that are identical
+	constexpr uint64_t raw_bits() const noexcept {
+		return bits;
+	}
+
+private:
+	static constexpr uint64_t PAYLOAD_MASK = (uint64_t{1} << 48) - 1;
+	static constexpr uint64_t CANONICAL_NAN = 0x7ff8'0000'0000'0000;
+
+	static constexpr uint16_t MISC_TAG = 0xfff8; // NULL, FALSE and TRUE
+	static constexpr uint16_t INT_TAG = 0xfff9;
+	static constexpr uint16_t BOXED_INT_TAG = 0xfffa;
+	static constexpr uint16_t STRING_TAG = 0xfffb;
+	static constexpr uint16_t FUNCTION_TAG = 0xfffc;
+	static constexpr uint16_t NATIVE_TAG = 0xfffd;
+	static constexpr uint16_t ARRAY_TAG = 0xfffe;
+	static constexpr uint16_t OBJECT_TAG = 0xffff;
+
+	static constexpr uint64_t MISC_BITS = uint64_t{MISC_TAG} << 48;
+	static constexpr uint64_t NIL_BITS = MISC_BITS;
+	static constexpr uint64_t FALSE_BITS = MISC_BITS | 2;
+	static constexpr uint64_t TRUE_BITS = MISC_BITS | 3;
+
+	static constexpr uint64_t tagged(uint16_t tag, uint64_t payload) noexcept {
+		return uint64_t{tag} << 48 | payload;
+	}
+
+	uint64_t bits;
+
+	constexpr explicit Value(uint64_t bits) noexcept : bits(bits) {}
+
+	constexpr uint16_t tag() const noexcept {
+		return static_cast<uint16_t>(bits >> 48);
+	}
+
+	static Value from_pointer(uint16_t tag, const void *ptr) noexcept {
+		return Value(tagged(tag, reinterpret_cast<uintptr_t>(ptr)));
+	}
+
+	template <typename T> T *pointer() const noexcept {
+		return reinterpret_cast<T *>(
+			static_cast<uintptr_t>(bits & PAYLOAD_MASK));
+	}
+
+	static Value box_int(int64_t i, Heap &heap) noexcept;
+};
+
+static_assert(sizeof(Value) == 8, "values are NaN-boxed into 64 bits");
+
+// Integer arithmetic wraps around, do it on unsigned values to avoid UB
+constexpr int64_t wrapping_add(int64_t a, int64_t b) noexcept {
+	return static_cast<int64_t>(static_cast<uint64_t>(a) +
+								static_cast<uint64_t>(b));
+}
+
+constexpr int64_t wrapping_sub(int64_t a, int64_t b) noexcept {
+	return static_cast<int64_t>(static_cast<uint64_t>(a) -
+								static_cast<uint64_t>(b));
+}
+
+constexpr int64_t wrapping_mul(int64_t a, int64_t b) noexcept {
+	return static_cast<int64_t>(static_cast<uint64_t>(a) *
+								static_cast<uint64_t>(b));
+}
+
+const char *value_type_name(ValueType type) noexcept;
+
+// NULL, FALSE, 0 and 0.0 are false, everything else is true
+bool is_truthy(const Value &v) noexcept;
+
+bool values_equal(const Value &a, const Value &b) noexcept;
+
+// Evaluate a binary arithmetic, bitwise, comparison or logical instruction.
+// String concatenation is not handled here since it has to allocate, callers
+// deal with it before falling back to this function. Integers too large to
+// be stored inline are boxed on heap. Returns nullptr on success, or a
+// static error message.
+const char *binary_op(InstructionType op, const Value &a, const Value &b,
+					  Value &out, Heap &heap) noexcept;
+
+// Same as binary_op, for NEG, NOT and BNOT.
+const char *unary_op(InstructionType op, const Value &a, Value &out,
+					 Heap &heap) noexcept;
+
+// Appends the printed form of v, nested arrays are cut off after a few
+// levels so that cycles terminate
+void format_value(std::string &out, const Value &v, int depth = 0) noexcept;
+
+} // namespace cypheri
+
+template <> struct std::formatter<cypheri::Value> {
+	template <typename ParseContext> constexpr auto parse(ParseContext &ctx) {
+		return ctx.begin();
+	}
+
+	template <typename FormatContext>
+	auto format(const cypheri::Value &v, FormatContext &ctx) const {
+		std::string str;
+		cypheri::format_value(str, v);
+		return std::copy(str.begin(), str.end(), ctx.out());
+	}
+};
+
+#endif // CYPHERI_VALUE_HPP
@@ -0,0 +1,395 @@
+#ifndef CYPHERI_VM_HPP
+#define CYPHERI_VM_HPP
+
+#include "cypheri/bytecode.hpp"
+#include "cypheri/errors.hpp"
+#include "cypheri/heap.hpp"
+#include "cypheri/image.hpp"
+#include "cypheri/jit.hpp"
+#include "cypheri/nametable.hpp"
+#include "cypheri/packed.hpp"
+#include "cypheri/regcode.hpp"
+#include "cypheri/value.hpp"
+#include <array>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+// Threaded dispatch with the labels-as-values extension, the interpreter
+// falls back to a plain switch on other compilers.
+#ifndef CYPHERI_VM_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define CYPHERI_VM_COMPUTED_GOTO 1
+#else
+#define CYPHERI_VM_COMPUTED_GOTO 0
+#endif
+#endif
+
+// Count instructions executed per opcode, time every call and take samples
+// of where the interpreters are, see opcode_profile(). Costs a few counter
+// updates per instruction and a clock read per call, so it is off by
+// default, and compiled out entirely then.
+#ifndef CYPHERI_VM_PROFILE
+#define CYPHERI_VM_PROFILE 0
+#endif
+
+// Count the opcode pairs executed by the stack interpreter, to pick
+// superinstructions from a real workload. Costs an increment per
+// instruction, so it is off by default unless profiling.
+#ifndef CYPHERI_VM_PAIR_PROFILE
+#define CYPHERI_VM_PAIR_PROFILE CYPHERI_VM_PROFILE
+#endif
+
+namespace cypheri {
+
+class VM;
+
+using NativeFunction = std::function<std::variant<Value, RuntimeError>(
+	VM &vm, std::span<const Value> args)>;
+
+struct NativeRecord {
+	NameIdType name;
+	NativeFunction fn;
+};
+
+// Inline cache of a GET or SET site: the shapes seen there and the slot of
+// the property in each. A site that has seen more shapes than it has ways is
+// megamorphic, shapes past those take the slow path every time.
+struct PropertyCache {
+	static constexpr size_t WAYS = 4;
+
+	struct Entry {
+		const Shape *shape = nullptr; // unused entries are at the end
+		const Shape *next;			  // SET only, the shape after the store
+		uint32_t slot;				  // Heap::NO_SLOT for missing properties
+	};
+
+	std::array<Entry, WAYS> entries{};
+	bool megamorphic = false;
+	uint64_t hits = 0, misses = 0;
+};
+
+struct PropertySiteStats {
+	NameIdType func, property;
+	size_t pc; // of the GET or SET instruction in the packed code
+	size_t shapes;
+	bool megamorphic;
+	uint64_t hits, misses;
+};
+
+// A global of a VM. Every image loaded links its global slots to these, a
+// global stays undefined until something sets it.
+struct GlobalCell {
+	Value value;
+	NameIdType name;
+	bool defined;
+};
+
+// Time spent in a function, only counted with CYPHERI_VM_PROFILE. Inclusive
+// time counts from the outermost active call, so recursion isn't counted
+// twice, exclusive time leaves out the functions it called but not natives.
+struct FunctionTimes {
+	uint64_t calls = 0;
+	uint64_t inclusive_ns = 0, exclusive_ns = 0;
+	uint32_t active = 0; // calls that haven't returned yet
+};
+
+// A function of a loaded image, with the state one VM keeps for it
+struct FunctionRecord {
+	const ImageFunction *code; // shared with other VMs running the image
+	const BytecodeModule *module;
+	GlobalCell *const *globals; // by the image's global slot
+
+	// One per code->packed.property_names, updated as the function runs
+	mutable std::vector<PropertyCache> property_caches;
+
+	// The packed code this VM runs, a copy of code->packed.code in which
+	// the stack interpreter quickens arithmetic instructions to the operand
+	// types it sees at each one
+	mutable std::vector<PackedInstruction> quickened;
+
+	mutable FunctionTimes times;
+
+	// VMOptions::jit only: calls so far, counted up to the threshold, and
+	// the native code once the function reached it, owned by the VM
+	mutable uint32_t hotness = 0;
+	mutable const JitFunction *jit = nullptr;
+};
+
+struct VMOptions {
+	// Operand stack size shared by all frames, in values
+	size_t stack_size = 1 << 16;
+	size_t max_call_depth = 1 << 12;
+
+	// Run functions in the register form instead of the stack ISA where
+	// possible, the two kinds of functions can call each other freely.
+	// Coroutines always run the stack ISA. This and superinstructions only
+	// apply to load(mod), images keep the options they were built with.
+	bool register_isa = false;
+
+	// Fuse common instruction sequences in the packed encoding, turn off
+	// when collecting an opcode pair profile.
+	bool superinstructions = true;
+
+	// Operand stack size of each coroutine, in values. Kept small since
+	// scripts may run many of them at once.
+	size_t coroutine_stack_size = 1 << 9;
+
+	// Record where the interpreter is every this many instructions, 0 for
+	// never. Only with CYPHERI_VM_PROFILE.
+	uint32_t sample_interval = 0;
+
+	// Compile functions to native code on their jit_threshold-th call, where
+	// CYPHERI_VM_JIT has a backend. The compiler works from the register
+	// form, so load(mod) builds it for this as well and functions run in
+	// its interpreter until they are hot. Compiled code is neither counted
+	// nor sampled by the profiler, and coroutines never run it.
+	bool jit = false;
+	uint32_t jit_threshold = 1000;
+};
+
+struct OpcodeCount {
+	InstructionType type;
+	uint64_t count;
+};
+
+struct OpcodePairCount {
+	InstructionType first, second;
+	uint64_t count;
+};
+
+struct FunctionProfile {
+	NameIdType func;
+	FunctionTimes times;
+};
+
+// The instruction about to run when a sample was taken. pc indexes the code
+// that ran, the packed encoding or the register form.
+struct ProfileSample {
+	NameIdType func;
+	uint32_t pc;
+	bool registers;
+	std::optional<SourceLocation> loc; // from the function's line table
+};
+
+struct JitStats {
+	size_t functions = 0; // compiled so far
+	size_t code_bytes = 0;
+	uint64_t deopts = 0; // calls that went back to the interpreter midway
+};
+
+struct CallFrame {
+	const FunctionRecord *func;
+
+	// saved while calling another function
+	union {
+		const PackedInstruction *pc;
+		const RegisterInstruction *reg_pc;
+	};
+
+	Value *base; // first local
+};
+
+// When a frame was pushed and how long its calls took, in ns. Kept next to
+// the frames instead of in them, only CYPHERI_VM_PROFILE needs it.
+struct FrameTime {
+	uint64_t start, callees;
+};
+
+enum class CoroutineStatus : uint8_t {
+	SUSPENDED, // not started yet, or stopped at a YIELD
+	RUNNING,
+	DONE,	// returned
+	FAILED, // stopped by a runtime error
+};
+
+// A call that can suspend itself with YIELD and be resumed by the host. Its
+// frames and operand stack live in a segment of its own instead of on the C
+// stack, so resuming and suspending only swap a few pointers. Owned by the
+// VM, which recycles them together with their segments.
+class Coroutine {
+public:
+	CoroutineStatus status() const noexcept {
+		return state;
+	}
+
+private:
+	friend class VM;
+
+	CoroutineStatus state;
+	Value callee;
+	size_t argc;
+	Value *sp; // end of the operand stack while suspended at a YIELD
+	std::unique_ptr<Value[]> stack;
+	std::vector<CallFrame> frames;
+	Coroutine *next_free = nullptr;
+
+	// CYPHERI_VM_PROFILE only
+	std::vector<FrameTime> frame_times;
+	uint64_t suspended_at = 0;
+};
+
+class VM {
+public:
+	VM(NameTable &name_table, VMOptions options = {}) noexcept;
+
+	// Build a code image of the module and load it. The module must outlive
+	// the VM, string literals are referenced in place.
+	std::optional<RuntimeError> load(const BytecodeModule &mod) noexcept;
+
+	// Define the image's functions as globals in this VM, linking its
+	// global slots to the VM's globals. The image is shared, not copied.
+	void load(std::shared_ptr<const CodeImage> image) noexcept;
+
+	void define_native(std::string_view name, NativeFunction fn) noexcept;
+	void set_global(NameIdType name, Value value) noexcept;
+	std::optional<Value> get_global(NameIdType name) const noexcept;
+
+	std::variant<Value, RuntimeError>
+	call(NameIdType name, std::span<const Value> args = {}) noexcept;
+	std::variant<Value, RuntimeError>
+	call(Value callee, std::span<const Value> args = {}) noexcept;
+
+	// Strings created at runtime live as long as the VM
+	Value make_string(std::string str) noexcept;
+
+	// Arrays, objects and boxed integers, also living as long as the VM
+	Heap &heap() noexcept;
+
+	NameTable &names() const noexcept;
+
+	// Instructions executed so far by opcode, in both interpreters, most
+	// frequent first. Superinstructions count once, quickened instructions
+	// under their own type. Always empty unless built with
+	// CYPHERI_VM_PROFILE, like the two below.
+	std::vector<OpcodeCount> opcode_profile() const noexcept;
+
+	// Functions that have been called, most exclusive time first
+	std::vector<FunctionProfile> function_profile() const noexcept;
+
+	// Samples taken since the last call, oldest first
+	std::vector<ProfileSample> take_profile_samples() noexcept;
+
+	// Opcode pairs executed so far, most frequent first. Always empty
+	// unless built with CYPHERI_VM_PAIR_PROFILE.
+	std::vector<OpcodePairCount> opcode_pair_profile() const noexcept;
+
+	// Inline cache counters of every GET and SET site that has run, most
+	// missed first
+	std::vector<PropertySiteStats> property_cache_stats() const noexcept;
+
+	JitStats jit_stats() const noexcept;
+
+	// Set up a call to callee as a coroutine without running it. Any number
+	// of coroutines can be suspended at once, the host decides when each one
+	// runs by calling resume(), e.g. from its own event loop.
+	std::variant<Coroutine *, RuntimeError>
+	spawn(Value callee, std::span<const Value> args = {}) noexcept;
+
+	// Run co until it yields or returns, and give back the value it yielded
+	// or returned. sent becomes the value of the YIELD it continues from,
+	// the first resume ignores it. Only suspended coroutines can be resumed,
+	// also from inside another one.
+	std::variant<Value, RuntimeError> resume(Coroutine &co,
+											 Value sent = {}) noexcept;
+
+	// Give co back to the pool, whatever its status unless it is running.
+	// The pointer must not be used afterwards.
+	void release(Coroutine &co) noexcept;
+
+private:
+	NameTable *name_table;
+	VMOptions options;
+	std::unique_ptr<Value[]> stack;
+	Value *stack_end;
+	Value *stack_top; // first free slot, reentrant calls start from here
+	std::vector<CallFrame> frames;
+	std::deque<FunctionRecord> functions;
+	std::deque<NativeRecord> natives;
+	std::deque<std::string> strings;
+	Heap objects;
+
+	std::deque<GlobalCell> globals;
+	SpraseNameArray<GlobalCell *> global_cells;
+
+	// Loaded images, with the cell of each of their global slots
+	struct LoadedImage {
+		std::shared_ptr<const CodeImage> image;
+		std::vector<GlobalCell *> links;
+	};
+	std::deque<LoadedImage> images;
+
+	std::vector<uint64_t> pair_counts; // indexed by first * count + second
+
+	// CYPHERI_VM_PROFILE only
+	std::vector<uint64_t> op_counts;
+	std::vector<FrameTime> frame_times; // one per frame
+	std::vector<ProfileSample> samples;
+	uint32_t sample_countdown = 0;
+
+	std::deque<Coroutine> coroutines;
+	Coroutine *free_coroutines = nullptr;
+	Coroutine *running = nullptr; // innermost coroutine being resumed
+
+	std::vector<std::unique_ptr<JitFunction>> jit_code;
+	JitStats jit_counts;
+	std::optional<RuntimeError> jit_error; // behind the last JIT_FAILED
+
+	GlobalCell &global_cell(NameIdType name) noexcept;
+
+	bool push_frame(const FunctionRecord *func, Value *args, size_t argc,
+					size_t frame_size, std::string &error) noexcept;
+	void profile_return() noexcept;
+	void sample(const FunctionRecord *func, size_t pc,
+				bool registers) noexcept;
+	std::variant<Value, RuntimeError> execute(Value *args, size_t argc,
+											  Value callee) noexcept;
+	std::variant<Value, RuntimeError> run(size_t entry_depth,
+										  Value *sp) noexcept;
+	// A call to a bytecode function in the interpreter it runs in: failing
+	// to push its frame leaves the error to locate at the call, errors
+	// from running it come back located where they were raised
+	bool push_call(const FunctionRecord *func, Value *args, size_t argc,
+				   std::string &error) noexcept;
+	std::variant<Value, RuntimeError>
+	run_call(const FunctionRecord *func) noexcept;
+	std::variant<Value, RuntimeError>
+	run_registers(size_t entry_depth) noexcept;
+
+	const JitFunction *tier_up(const FunctionRecord *func) noexcept;
+	std::variant<Value, RuntimeError> run_jit(size_t entry_depth) noexcept;
+	std::variant<Value, RuntimeError>
+	finish_jit(JitResult res, size_t entry_depth, Value *saved_top) noexcept;
+
+	// JitHelpers of this VM
+	static bool jit_slow(VM *vm, const FunctionRecord *func, Value *reg,
+						 const RegisterInstruction *inst) noexcept;
+	static uint64_t jit_call(VM *vm, const FunctionRecord *func, Value *reg,
+							 const RegisterInstruction *inst) noexcept;
+
+	Value get_property(PropertyCache &cache, NameIdType name,
+					   const Object *obj) noexcept;
+	void set_property(PropertyCache &cache, NameIdType name, Object *obj,
+					  Value value) noexcept;
+
+	// GETDNY and SETDNY: arrays are indexed by integers, writing one past the
+	// end appends, objects by property names given as strings
+	bool get_dynamic(const Value &obj, const Value &key, Value &out,
+					 std::string &error) noexcept;
+	bool set_dynamic(const Value &obj, const Value &key, const Value &value,
+					 std::string &error) noexcept;
+
+	// lines belong to the code pc indexes, packed or register
+	RuntimeError make_error(const std::string &message, NameIdType func,
+							const LineTable &lines, size_t pc) const noexcept;
+};
+
+} // namespace cypheri
+
+#endif // CYPHERI_VM_HPP
@@ -0,0 +1,56 @@
+#ifndef CYPHERI_WORKQUEUE_HPP
+#define CYPHERI_WORKQUEUE_HPP
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace cypheri {
+
+// Every worker owns a deque of task indices, taking work from its back and
+// stealing from the front of the others' once it runs dry. Tasks never
+// spawn more tasks, so a worker finding every deque empty is done.
+class WorkStealingQueues {
+public:
+	explicit WorkStealingQueues(size_t workers) noexcept : queues(workers) {}
+
+	void push(size_t worker, size_t task) noexcept {
+		queues[worker].tasks.push_back(task);
+	}
+
+	std::optional<size_t> pop(size_t worker) noexcept {
+		{
+			auto &own = queues[worker];
+			std::lock_guard lock(own.mutex);
+			if (!own.tasks.empty()) {
+				size_t task = own.tasks.back();
+				own.tasks.pop_back();
+				return task;
+			}
+		}
+
+		for (size_t i = 1; i < queues.size(); i++) {
+			auto &victim = queues[(worker + i) % queues.size()];
+			std::lock_guard lock(victim.mutex);
+			if (!victim.tasks.empty()) {
+				size_t task = victim.tasks.front();
+				victim.tasks.pop_front();
+				return task;
+			}
+		}
+		return std::nullopt;
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+	};
+	std::vector<Queue> queues;
+};
+
+} // namespace cypheri
+
+#endif // CYPHERI_WORKQUEUE_HPP
@@ -0,0 +1,50 @@
+#include "cypheri/arena.hpp"
+#include <algorithm>
+
+namespace cypheri {
+
+Arena::Arena(size_t block_size) noexcept : block_size(block_size) {}
+
+void *Arena::allocate_slow(size_t size, size_t align) noexcept {
+	// move on to the next block that is large enough, blocks kept from
+	// before a reset are tried first
+	while (true) {
+		if (current < blocks.size()) {
+			used_before += offset;
+			current++;
+			offset = 0;
+		}
+		if (current == blocks.size()) {
+			// oversized requests get a block of their own
+			size_t bytes = std::max(block_size, size + align);
+			blocks.push_back({std::make_unique<std::byte[]>(bytes), bytes});
+		}
+
+		auto &block = blocks[current];
+		size_t start = (offset + align - 1) & ~(align - 1);
+		if (start + size <= block.size) {
+			offset = start + size;
+			return block.data.get() + start;
+		}
+	}
+}
+
+void Arena::reset() noexcept {
+	current = 0;
+	offset = 0;
+	used_before = 0;
+}
+
+size_t Arena::used() const noexcept {
+	return used_before + offset;
+}
+
+size_t Arena::capacity() const noexcept {
+	size_t bytes = 0;
+	for (const auto &block : blocks) {
+		bytes += block.size;
+	}
+	return bytes;
+}
+
+} // namespace cypheri
@@ -2,6 +2,133 @@
 
 namespace cypheri {
 
+namespace {
+
+void put_varint(std::vector<uint8_t> &out, uint64_t val) noexcept {
+	while (val >= 0x80) {
+		out.push_back(static_cast<uint8_t>(val | 0x80));
+		val >>= 7;
+	}
+	out.push_back(static_cast<uint8_t>(val));
+}
+
+// false at the end of the input or for an overlong encoding
+bool get_varint(std::span<const uint8_t> in, size_t &pos,
+				uint64_t &val) noexcept {
+	val = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (pos >= in.size()) {
+			return false;
+		}
+		uint8_t byte = in[pos++];
+		val |= uint64_t{byte & 0x7fu} << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t zigzag(int64_t val) noexcept {
+	return static_cast<uint64_t>(val) << 1 ^ static_cast<uint64_t>(val >> 63);
+}
+
+int64_t unzigzag(uint64_t val) noexcept {
+	return static_cast<int64_t>(val >> 1) ^ -static_cast<int64_t>(val & 1);
+}
+
+// Decode the run following entry, which starts at pos, into entry
+bool next_entry(std::span<const uint8_t> in, size_t &pos,
+				LineEntry &entry) noexcept {
+	uint64_t pc, line, column;
+	if (!get_varint(in, pos, pc) || !get_varint(in, pos, line) ||
+		!get_varint(in, pos, column)) {
+		return false;
+	}
+	entry.pc += pc;
+	entry.loc.line = static_cast<uint32_t>(entry.loc.line + unzigzag(line));
+	entry.loc.column =
+		static_cast<uint32_t>(entry.loc.column + unzigzag(column));
+	return true;
+}
+
+} // namespace
+
+void LineTable::add(size_t pc, SourceLocation loc) noexcept {
+	if (runs > 0 && pc == last.pc) {
+		data.resize(last_offset);
+		last = before_last;
+		runs--;
+	}
+	if (runs > 0 && loc.line == last.loc.line &&
+		loc.column == last.loc.column) {
+		return;
+	}
+
+	before_last = last;
+	last_offset = data.size();
+	put_varint(data, pc - last.pc);
+	put_varint(data, zigzag(int64_t{loc.line} - last.loc.line));
+	put_varint(data, zigzag(int64_t{loc.column} - last.loc.column));
+	last = {pc, loc};
+	runs++;
+}
+
+std::optional<SourceLocation> LineTable::find(size_t pc) const noexcept {
+	std::optional<SourceLocation> res;
+	LineEntry entry{0, {0, 0}};
+	size_t pos = 0;
+	while (pos < data.size() && next_entry(data, pos, entry) &&
+		   entry.pc <= pc) {
+		res = entry.loc;
+	}
+	return res;
+}
+
+std::vector<LineEntry> LineTable::entries() const noexcept {
+	std::vector<LineEntry> res;
+	LineEntry entry{0, {0, 0}};
+	size_t pos = 0;
+	while (pos < data.size() && next_entry(data, pos, entry)) {
+		res.push_back(entry);
+	}
+	return res;
+}
+
+LineTable LineTable::remapped(std::span<const size_t> remap) const noexcept {
+	LineTable res;
+	for (const auto &entry : entries()) {
+		if (entry.pc < remap.size()) {
+			res.add(remap[entry.pc], entry.loc);
+		}
+	}
+	return res;
+}
+
+void LineTable::shift_lines(int64_t delta) noexcept {
+	LineTable res;
+	for (auto entry : entries()) {
+		entry.loc.line = static_cast<uint32_t>(entry.loc.line + delta);
+		res.add(entry.pc, entry.loc);
+	}
+	*this = std::move(res);
+}
+
+std::optional<LineTable>
+LineTable::from_bytes(std::span<const uint8_t> bytes) noexcept {
+	LineTable res;
+	LineEntry entry{0, {0, 0}};
+	size_t pos = 0;
+	while (pos < bytes.size()) {
+		size_t pc = entry.pc;
+		if (!next_entry(bytes, pos, entry) || entry.pc < pc) {
+			return std::nullopt;
+		}
+		res.add(entry.pc, entry.loc);
+	}
+	return res;
+}
+
 BytecodeInstruction::BytecodeInstruction(InstructionType type, int n) noexcept
 	: type(type), n(n) {}
 
@@ -28,4 +155,138 @@ size_t &BytecodeInstruction::idx() noexcept {
 	return i_lit;
 }
 
+std::optional<StackEffect>
+stack_effect(const BytecodeInstruction &inst) noexcept {
+	using enum InstructionType;
+	switch (inst.type) {
+	case NOP:
+	case JMP:
+	case RETNULL:
+		return StackEffect{0, 0};
+	case ADD:
+	case SUB:
+	case MUL:
+	case DIV:
+	case MOD:
+	case POW:
+	case IDIV:
+	case BXOR:
+	case BAND:
+	case BOR:
+	case SHL:
+	case SHR:
+	case EQ:
+	case NE:
+	case LT:
+	case LE:
+	case GT:
+	case GE:
+	case AND:
+	case OR:
+		return StackEffect{2, 1};
+	case NEG:
+	case BNOT:
+	case NOT:
+		return StackEffect{1, 1};
+	case YIELD:
+		// the yielded value is replaced by the one the coroutine is
+		// resumed with
+		return StackEffect{1, 1};
+	case LII:
+	case LIN:
+	case LIIW:
+	case LINULL:
+	case LIBOOL:
+	case LISTR:
+	case LDGLOBAL:
+	case LDLOCAL:
+	case LIOBJ:
+		return StackEffect{0, 1};
+	case LIARR:
+		return StackEffect{inst.n, 1};
+	case GET:
+		return StackEffect{1, 1};
+	case SET:
+	case GETDNY:
+		return StackEffect{2, 1};
+	case SETDNY:
+		return StackEffect{3, 1};
+	case STGLOBAL:
+	case STLOCAL:
+	case JZ:
+	case JNZ:
+	case RET:
+		return StackEffect{1, 0};
+	case POPN:
+		return StackEffect{inst.n, 0};
+	case SWP:
+		return StackEffect{2, 2};
+	case ROT3:
+		return StackEffect{3, 3};
+	case DUP:
+		return StackEffect{1, 2};
+	case CALL:
+		// arguments and the callee itself
+		return StackEffect{inst.n + 1, 1};
+	default:
+		return std::nullopt;
+	}
+}
+
+std::optional<std::vector<int>>
+compute_stack_depths(const BytecodeFunction &func) noexcept {
+	const auto &code = func.instructions;
+	std::vector<int> depths(code.size(), -1);
+	std::vector<size_t> worklist;
+
+	auto visit = [&](size_t target, int depth) {
+		if (target >= code.size()) {
+			return false;
+		}
+		if (depths[target] == -1) {
+			depths[target] = depth;
+			worklist.push_back(target);
+			return true;
+		}
+		return depths[target] == depth;
+	};
+
+	if (!visit(0, 0)) {
+		return std::nullopt;
+	}
+
+	while (!worklist.empty()) {
+		size_t i = worklist.back();
+		worklist.pop_back();
+
+		auto effect = stack_effect(code[i]);
+		if (!effect || effect->pops < 0 || depths[i] < effect->pops) {
+			return std::nullopt;
+		}
+		int next = depths[i] - effect->pops + effect->pushes;
+
+		bool ok;
+		switch (code[i].type) {
+		case InstructionType::JMP:
+			ok = visit(code[i].idx(), next);
+			break;
+		case InstructionType::JZ:
+		case InstructionType::JNZ:
+			ok = visit(code[i].idx(), next) && visit(i + 1, next);
+			break;
+		case InstructionType::RET:
+		case InstructionType::RETNULL:
+			ok = true;
+			break;
+		default:
+			ok = visit(i + 1, next);
+			break;
+		}
+		if (!ok) {
+			return std::nullopt;
+		}
+	}
+	return depths;
+}
+
 } // namespace cypheri
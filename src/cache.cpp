@@ -0,0 +1,432 @@
+#include "cypheri/cache.hpp"
+#include <bit>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CYPHERI_CACHE_MMAP 1
+#else
+#define CYPHERI_CACHE_MMAP 0
+#endif
+
+namespace cypheri {
+
+namespace {
+
+// Files are written in native byte order, byte_order tells them apart
+constexpr char CACHE_MAGIC[8] = {'C', 'Y', 'P', 'H', 'E', 'R', 'B', 'C'};
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// All sections start at a multiple of 8
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t instruction_count; // INSTRUCTION_COUNT of the writer
+	uint32_t reserved;
+	uint64_t source_hash;
+	uint64_t file_size;
+	uint32_t name_count, function_count, str_lit_count, global_count;
+	uint64_t names, functions, str_lits, globals; // section offsets
+};
+
+struct FileString {
+	uint64_t offset, size;
+};
+
+struct FileFunction {
+	uint32_t name, local_count, arg_count, reserved;
+	uint64_t code, code_count;
+	uint64_t lines, lines_size; // LineTable::bytes()
+};
+
+static_assert(std::is_trivially_copyable_v<BytecodeInstruction> &&
+				  std::is_standard_layout_v<BytecodeInstruction> &&
+				  sizeof(BytecodeInstruction) == 16 &&
+				  alignof(BytecodeInstruction) == 8,
+			  "the cache stores BytecodeInstruction as it is in memory");
+
+bool has_name_operand(InstructionType type) noexcept {
+	return type == InstructionType::LDGLOBAL ||
+		   type == InstructionType::STGLOBAL ||
+		   type == InstructionType::GET || type == InstructionType::SET;
+}
+
+class FileWriter {
+public:
+	template <typename T> uint64_t append(const T &value) noexcept {
+		return append_bytes(&value, sizeof(T));
+	}
+
+	uint64_t append_bytes(const void *src, size_t n) noexcept {
+		uint64_t offset = buf.size();
+		auto *p = static_cast<const std::byte *>(src);
+		buf.insert(buf.end(), p, p + n);
+		return offset;
+	}
+
+	uint64_t align() noexcept {
+		buf.resize((buf.size() + 7) & ~size_t{7});
+		return buf.size();
+	}
+
+	template <typename T> T *at(uint64_t offset) noexcept {
+		return reinterpret_cast<T *>(buf.data() + offset);
+	}
+
+	std::vector<std::byte> buf;
+};
+
+// Name slice of a module, in order of first use
+class NameSlice {
+public:
+	uint32_t index(NameIdType id) noexcept {
+		auto [it, inserted] =
+			indices.emplace(id, static_cast<uint32_t>(ids.size()));
+		if (inserted) {
+			ids.push_back(id);
+		}
+		return it->second;
+	}
+
+	std::vector<NameIdType> ids;
+
+private:
+	std::unordered_map<NameIdType, uint32_t> indices;
+};
+
+void write_strings(FileWriter &out, uint64_t table,
+				   const std::vector<std::string_view> &strs) noexcept {
+	for (size_t i = 0; i < strs.size(); i++) {
+		uint64_t offset = out.append_bytes(strs[i].data(), strs[i].size());
+		*out.at<FileString>(table + i * sizeof(FileString)) =
+			FileString{offset, strs[i].size()};
+	}
+}
+
+} // namespace
+
+// Not cryptographic, 8 bytes per step
+uint64_t hash_source(std::string_view source) noexcept {
+	constexpr uint64_t K = 0x9e3779b97f4a7c15;
+	uint64_t h = source.size() * K;
+	size_t i = 0;
+	for (; i + 8 <= source.size(); i += 8) {
+		uint64_t w;
+		std::memcpy(&w, source.data() + i, 8);
+		h = std::rotl((h ^ w) * K, 29);
+	}
+	uint64_t tail = 0;
+	std::memcpy(&tail, source.data() + i, source.size() - i);
+	h = (h ^ tail) * K;
+	return h ^ (h >> 32);
+}
+
+bool write_bytecode_cache(const std::string &path, const BytecodeModule &mod,
+						  const NameTable &name_table,
+						  uint64_t source_hash) noexcept {
+	NameSlice slice;
+	std::vector<FileFunction> funcs;
+	for (const auto &[name, func] : mod.functions) {
+		funcs.push_back(FileFunction{
+			.name = slice.index(name),
+			.local_count = static_cast<uint32_t>(func.local_count),
+			.arg_count = static_cast<uint32_t>(func.arg_count),
+		});
+	}
+	std::vector<uint32_t> globals;
+	for (auto name : mod.global_names) {
+		globals.push_back(slice.index(name));
+	}
+
+	FileWriter out;
+	out.append(FileHeader{});
+
+	// code first, it collects the rest of the name slice
+	size_t k = 0;
+	for (const auto &[name, func] : mod.functions) {
+		funcs[k].code = out.align();
+		funcs[k].code_count = func.instructions.size();
+		for (const auto &inst : func.instructions) {
+			// built bytewise, so that padding is written as zeros
+			std::byte rec[sizeof(BytecodeInstruction)] = {};
+			uint64_t operand = inst.i_lit;
+			if (has_name_operand(inst.type)) {
+				operand = slice.index(static_cast<NameIdType>(inst.idx()));
+			}
+			std::memcpy(rec + offsetof(BytecodeInstruction, type), &inst.type,
+						sizeof(inst.type));
+			std::memcpy(rec + offsetof(BytecodeInstruction, i_lit), &operand,
+						sizeof(operand));
+			out.append(rec);
+		}
+		auto lines = func.lines.bytes();
+		funcs[k].lines = out.align();
+		funcs[k].lines_size = lines.size();
+		out.append_bytes(lines.data(), lines.size());
+		k++;
+	}
+
+	FileHeader header{};
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_FORMAT_VERSION;
+	header.byte_order = BYTE_ORDER_MARK;
+	header.instruction_count = INSTRUCTION_COUNT;
+	header.source_hash = source_hash;
+	header.name_count = static_cast<uint32_t>(slice.ids.size());
+	header.function_count = static_cast<uint32_t>(funcs.size());
+	header.str_lit_count = static_cast<uint32_t>(mod.str_lits.size());
+	header.global_count = static_cast<uint32_t>(globals.size());
+
+	header.functions = out.align();
+	out.append_bytes(funcs.data(), funcs.size() * sizeof(FileFunction));
+	header.globals = out.align();
+	out.append_bytes(globals.data(), globals.size() * sizeof(uint32_t));
+
+	std::vector<std::string_view> strs;
+	for (auto id : slice.ids) {
+		strs.push_back(name_table.get_name(id));
+	}
+	header.names = out.align();
+	out.buf.resize(out.buf.size() + strs.size() * sizeof(FileString));
+	write_strings(out, header.names, strs);
+
+	strs.assign(mod.str_lits.begin(), mod.str_lits.end());
+	header.str_lits = out.align();
+	out.buf.resize(out.buf.size() + strs.size() * sizeof(FileString));
+	write_strings(out, header.str_lits, strs);
+
+	header.file_size = out.align();
+	*out.at<FileHeader>(0) = header;
+
+	std::string tmp = path + ".tmp";
+	{
+		std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char *>(out.buf.data()),
+				   static_cast<std::streamsize>(out.buf.size()));
+		if (!file) {
+			std::remove(tmp.c_str());
+			return false;
+		}
+	}
+	return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+std::optional<MappedBytecode>
+MappedBytecode::open(const std::string &path, uint64_t source_hash) noexcept {
+	MappedBytecode res;
+#if CYPHERI_CACHE_MMAP
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return std::nullopt;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < 1) {
+		::close(fd);
+		return std::nullopt;
+	}
+	void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		return std::nullopt;
+	}
+	res.data = static_cast<const std::byte *>(p);
+	res.size = st.st_size;
+	res.mapped = true;
+#else
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file) {
+		return std::nullopt;
+	}
+	res.size = static_cast<size_t>(file.tellg());
+	auto *buf = new std::byte[res.size]; // aligned for any type
+	res.data = buf;
+	file.seekg(0);
+	file.read(reinterpret_cast<char *>(buf),
+			  static_cast<std::streamsize>(res.size));
+	if (!file) {
+		return std::nullopt;
+	}
+#endif
+
+	if (!res.validate(source_hash)) {
+		return std::nullopt;
+	}
+	return res;
+}
+
+bool MappedBytecode::validate(uint64_t source_hash) const noexcept {
+	if (size < sizeof(FileHeader)) {
+		return false;
+	}
+	const auto &h = *at<FileHeader>(0);
+	if (std::memcmp(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+		h.version != CACHE_FORMAT_VERSION ||
+		h.byte_order != BYTE_ORDER_MARK ||
+		h.instruction_count != INSTRUCTION_COUNT ||
+		h.source_hash != source_hash || h.file_size != size) {
+		return false;
+	}
+
+	auto section = [&](uint64_t offset, uint64_t count, size_t item) {
+		return offset % 8 == 0 && offset <= size &&
+			   count <= (size - offset) / item;
+	};
+	auto strings = [&](uint64_t table, uint32_t count) {
+		if (!section(table, count, sizeof(FileString))) {
+			return false;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			auto s = at<FileString>(table)[i];
+			if (s.offset > size || s.size > size - s.offset) {
+				return false;
+			}
+		}
+		return true;
+	};
+	if (!strings(h.names, h.name_count) ||
+		!strings(h.str_lits, h.str_lit_count) ||
+		!section(h.functions, h.function_count, sizeof(FileFunction)) ||
+		!section(h.globals, h.global_count, sizeof(uint32_t))) {
+		return false;
+	}
+
+	for (auto name : global_names()) {
+		if (name >= h.name_count) {
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < h.function_count; i++) {
+		const auto &f = at<FileFunction>(h.functions)[i];
+		if (f.name >= h.name_count ||
+			!section(f.code, f.code_count, sizeof(BytecodeInstruction)) ||
+			!section(f.lines, f.lines_size, 1) ||
+			!LineTable::from_bytes(function(i).lines)) {
+			return false;
+		}
+		for (const auto &inst : function(i).code) {
+			if (static_cast<int>(inst.type) >= INSTRUCTION_COUNT ||
+				(has_name_operand(inst.type) && inst.idx() >= h.name_count)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+MappedBytecode::MappedBytecode(MappedBytecode &&other) noexcept
+	: data(std::exchange(other.data, nullptr)),
+	  size(std::exchange(other.size, 0)), mapped(other.mapped) {}
+
+MappedBytecode &MappedBytecode::operator=(MappedBytecode &&other) noexcept {
+	if (this != &other) {
+		release();
+		data = std::exchange(other.data, nullptr);
+		size = std::exchange(other.size, 0);
+		mapped = other.mapped;
+	}
+	return *this;
+}
+
+MappedBytecode::~MappedBytecode() {
+	release();
+}
+
+void MappedBytecode::release() noexcept {
+	if (!data) {
+		return;
+	}
+#if CYPHERI_CACHE_MMAP
+	if (mapped) {
+		munmap(const_cast<std::byte *>(data), size);
+		data = nullptr;
+		return;
+	}
+#endif
+	delete[] data;
+	data = nullptr;
+}
+
+size_t MappedBytecode::name_count() const noexcept {
+	return at<FileHeader>(0)->name_count;
+}
+
+std::string_view MappedBytecode::name(uint32_t idx) const noexcept {
+	auto s = at<FileString>(at<FileHeader>(0)->names)[idx];
+	return {at<char>(s.offset), s.size};
+}
+
+size_t MappedBytecode::function_count() const noexcept {
+	return at<FileHeader>(0)->function_count;
+}
+
+CachedFunction MappedBytecode::function(size_t idx) const noexcept {
+	const auto &f = at<FileFunction>(at<FileHeader>(0)->functions)[idx];
+	return CachedFunction{
+		.name = f.name,
+		.local_count = f.local_count,
+		.arg_count = f.arg_count,
+		.code = {at<BytecodeInstruction>(f.code), f.code_count},
+		.lines = {at<uint8_t>(f.lines), f.lines_size},
+	};
+}
+
+size_t MappedBytecode::str_lit_count() const noexcept {
+	return at<FileHeader>(0)->str_lit_count;
+}
+
+std::string_view MappedBytecode::str_lit(size_t idx) const noexcept {
+	auto s = at<FileString>(at<FileHeader>(0)->str_lits)[idx];
+	return {at<char>(s.offset), s.size};
+}
+
+std::span<const uint32_t> MappedBytecode::global_names() const noexcept {
+	const auto &h = *at<FileHeader>(0);
+	return {at<uint32_t>(h.globals), h.global_count};
+}
+
+BytecodeModule MappedBytecode::to_module(NameTable &name_table) const noexcept {
+	std::vector<NameIdType> ids(name_count());
+	for (uint32_t i = 0; i < ids.size(); i++) {
+		ids[i] = name_table.get_id_or_insert(name(i));
+	}
+
+	BytecodeModule mod;
+	for (size_t i = 0; i < function_count(); i++) {
+		auto cached = function(i);
+		BytecodeFunction func;
+		func.name = ids[cached.name];
+		func.local_count = cached.local_count;
+		func.arg_count = cached.arg_count;
+		func.instructions.assign(cached.code.begin(), cached.code.end());
+		// checked when the file was opened
+		func.lines = *LineTable::from_bytes(cached.lines);
+		for (auto &inst : func.instructions) {
+			if (has_name_operand(inst.type)) {
+				inst.idx() = ids[inst.idx()];
+			}
+		}
+		// copy name, or it will be use-after-move
+		auto name = func.name;
+		mod.functions[name] = std::move(func);
+	}
+	for (size_t i = 0; i < str_lit_count(); i++) {
+		mod.str_lits.emplace_back(str_lit(i));
+	}
+	for (auto name : global_names()) {
+		mod.global_names.push_back(ids[name]);
+	}
+	return mod;
+}
+
+} // namespace cypheri
@@ -0,0 +1,108 @@
+#include "cypheri/compile.hpp"
+#include "cypheri/token.hpp"
+#include "cypheri/workqueue.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <thread>
+
+namespace cypheri {
+
+namespace {
+
+std::optional<std::string> read_file(const std::string &path) noexcept {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		return std::nullopt;
+	}
+	std::string source((std::istreambuf_iterator<char>(in)),
+					   std::istreambuf_iterator<char>());
+	if (in.bad()) {
+		return std::nullopt;
+	}
+	return source;
+}
+
+CompiledFile compile_file(const std::string &path, NameTable &name_table,
+						  ParseOptions options) noexcept {
+	auto source = read_file(path);
+	if (!source) {
+		return CompiledFile{
+			.path = path,
+			.result = SyntaxError("cannot read " + path, {0, 0}),
+		};
+	}
+
+	ParseStats stats;
+	options.stats = &stats;
+	TokenStream tokens(*source, name_table);
+	auto result = parse(tokens, name_table, options);
+	return CompiledFile{
+		.path = path,
+		.result = std::move(result),
+		.stats = stats,
+	};
+}
+
+} // namespace
+
+std::vector<CompiledFile> compile_many(std::span<const std::string> paths,
+									   NameTable &name_table,
+									   CompileOptions options) noexcept {
+	std::vector<std::optional<CompiledFile>> results(paths.size());
+
+	size_t threads = options.threads;
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if (!name_table.is_concurrent()) {
+		threads = 1;
+	}
+	threads = std::min(threads, paths.size());
+
+	if (threads <= 1) {
+		for (size_t i = 0; i < paths.size(); i++) {
+			results[i] = compile_file(paths[i], name_table, options.parse);
+		}
+	} else {
+		// Deal the largest files out first, so that a big one picked up
+		// last doesn't keep a single thread busy at the end.
+		std::vector<std::pair<uintmax_t, size_t>> order;
+		for (size_t i = 0; i < paths.size(); i++) {
+			std::error_code ec;
+			auto size = std::filesystem::file_size(paths[i], ec);
+			order.emplace_back(ec ? 0 : size, i);
+		}
+		std::sort(order.begin(), order.end(), std::greater<>());
+
+		// each worker pops from the back of its deque, push smallest first
+		WorkStealingQueues queues(threads);
+		for (size_t k = order.size(); k-- > 0;) {
+			queues.push(k % threads, order[k].second);
+		}
+
+		auto work = [&](size_t worker) {
+			while (auto task = queues.pop(worker)) {
+				results[*task] =
+					compile_file(paths[*task], name_table, options.parse);
+			}
+		};
+
+		std::vector<std::jthread> pool;
+		for (size_t w = 1; w < threads; w++) {
+			pool.emplace_back(work, w);
+		}
+		work(0);
+	}
+
+	std::vector<CompiledFile> res;
+	res.reserve(paths.size());
+	for (auto &r : results) {
+		res.push_back(std::move(*r));
+	}
+	return res;
+}
+
+} // namespace cypheri
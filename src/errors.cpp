@@ -4,4 +4,7 @@ namespace cypheri {
 
 SyntaxError::SyntaxError(const std::string &message, SourceLocation location) noexcept : message(message), location(location) {}
 
+RuntimeError::RuntimeError(const std::string &message) noexcept
+	: message(message) {}
+
 } // namespace cypheri
@@ -0,0 +1,171 @@
+#include "cypheri/heap.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <new>
+
+namespace cypheri {
+
+namespace {
+
+// Index of the smallest class holding size bytes
+int size_class(size_t size, int min_bits) noexcept {
+	size_t rounded = std::bit_ceil(std::max(size, size_t{1} << min_bits));
+	return std::countr_zero(rounded) - min_bits;
+}
+
+} // namespace
+
+Heap::~Heap() {
+	while (large) {
+		LargeHeader *next = large->next;
+		::operator delete(large);
+		large = next;
+	}
+}
+
+void *Heap::allocate(size_t size) noexcept {
+	if (size > MAX_CLASS_SIZE) {
+		void *mem = ::operator new(sizeof(LargeHeader) + size);
+		auto *header = new (mem) LargeHeader{nullptr, large, size};
+		if (large) {
+			large->prev = header;
+		}
+		large = header;
+		large_bytes += size;
+		live_bytes += size;
+		return header + 1;
+	}
+
+	int cls = size_class(size, MIN_CLASS_BITS);
+	size_t cls_size = size_t{1} << (cls + MIN_CLASS_BITS);
+	live_bytes += cls_size;
+	if (FreeCell *cell = free_lists[cls]) {
+		free_lists[cls] = cell->next;
+		return cell;
+	}
+	return pool.allocate(cls_size, alignof(std::max_align_t));
+}
+
+void Heap::deallocate(void *ptr, size_t size) noexcept {
+	if (!ptr) {
+		return;
+	}
+
+	if (size > MAX_CLASS_SIZE) {
+		auto *header = static_cast<LargeHeader *>(ptr) - 1;
+		if (header->prev) {
+			header->prev->next = header->next;
+		} else {
+			large = header->next;
+		}
+		if (header->next) {
+			header->next->prev = header->prev;
+		}
+		large_bytes -= header->size;
+		live_bytes -= header->size;
+		::operator delete(header);
+		return;
+	}
+
+	int cls = size_class(size, MIN_CLASS_BITS);
+	live_bytes -= size_t{1} << (cls + MIN_CLASS_BITS);
+	auto *cell = static_cast<FreeCell *>(ptr);
+	cell->next = free_lists[cls];
+	free_lists[cls] = cell;
+}
+
+template <typename T> T *Heap::allocate_array(size_t count) noexcept {
+	if (count == 0) {
+		return nullptr;
+	}
+	return static_cast<T *>(allocate(sizeof(T) * count));
+}
+
+// Double the capacity of an element array, moving the first size elements
+template <typename T>
+T *Heap::grow(T *items, uint32_t size, uint32_t &capacity) noexcept {
+	uint32_t new_capacity = std::max<uint32_t>(4, capacity * 2);
+	auto *res = allocate_array<T>(new_capacity);
+	if (size > 0) {
+		std::memcpy(static_cast<void *>(res), items, sizeof(T) * size);
+	}
+	deallocate(items, sizeof(T) * capacity);
+	capacity = new_capacity;
+	return res;
+}
+
+BoxedInt *Heap::make_int(int64_t value) noexcept {
+	return new (allocate(sizeof(BoxedInt))) BoxedInt{value};
+}
+
+Array *Heap::make_array(std::span<const Value> items) noexcept {
+	auto size = static_cast<uint32_t>(items.size());
+	auto *arr = new (allocate(sizeof(Array)))
+		Array{size, size, allocate_array<Value>(size)};
+	std::copy(items.begin(), items.end(), arr->items);
+	return arr;
+}
+
+Object *Heap::make_object(size_t capacity) noexcept {
+	auto cap = static_cast<uint32_t>(capacity);
+	return new (allocate(sizeof(Object)))
+		Object{&empty_shape, cap, allocate_array<Value>(cap)};
+}
+
+void Heap::push(Array *arr, Value value) noexcept {
+	if (arr->size == arr->capacity) {
+		arr->items = grow(arr->items, arr->size, arr->capacity);
+	}
+	arr->items[arr->size++] = value;
+}
+
+uint32_t Heap::find_slot(const Shape *shape, NameIdType name) noexcept {
+	for (; shape->parent; shape = shape->parent) {
+		if (shape->name == name) {
+			return shape->size - 1;
+		}
+	}
+	return NO_SLOT;
+}
+
+const Shape *Heap::transition(const Shape *shape, NameIdType name) noexcept {
+	for (auto [child_name, child] : shape->transitions) {
+		if (child_name == name) {
+			return child;
+		}
+	}
+	Shape *child = &shapes.emplace_back(shape, name, shape->size + 1);
+	shape->transitions.emplace_back(name, child);
+	return child;
+}
+
+Value Heap::get(const Object *obj, NameIdType name) noexcept {
+	uint32_t slot = find_slot(obj->shape, name);
+	return slot == NO_SLOT ? Value() : obj->slots[slot];
+}
+
+void Heap::set(Object *obj, NameIdType name, Value value) noexcept {
+	uint32_t slot = find_slot(obj->shape, name);
+	if (slot != NO_SLOT) {
+		obj->slots[slot] = value;
+	} else {
+		add_property(obj, transition(obj->shape, name), value);
+	}
+}
+
+void Heap::add_property(Object *obj, const Shape *next,
+						Value value) noexcept {
+	uint32_t slot = next->size - 1;
+	if (slot == obj->capacity) {
+		obj->slots = grow(obj->slots, slot, obj->capacity);
+	}
+	obj->slots[slot] = value;
+	obj->shape = next;
+}
+
+HeapStats Heap::stats() const noexcept {
+	return {live_bytes, pool.capacity(), large_bytes, shapes.size() + 1};
+}
+
+} // namespace cypheri
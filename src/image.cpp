@@ -0,0 +1,168 @@
+#include "cypheri/image.hpp"
+#include <algorithm>
+#include <format>
+#include <string_view>
+
+namespace cypheri {
+
+namespace {
+
+bool is_supported(InstructionType type) noexcept {
+	using enum InstructionType;
+	switch (type) {
+	case INVALID:
+	case LIIW: // only meaningful in the packed encoding
+	case MOV:  // only meaningful in the register form
+	case ADDLL:
+	case LTLI_JZ:
+	case CALLGLOBAL:
+	case ADD_NN: // quickened ones only exist in a VM's copy of the code
+	case SUB_NN:
+	case MUL_NN:
+	case DIV_NN:
+	case DIV_II:
+	case LT_NN:
+	case LE_NN:
+	case GT_NN:
+	case GE_NN:
+	case CONCAT:
+	case LILAMBDA:
+	case NEWOBJ:
+		return false;
+	default:
+		return true;
+	}
+}
+
+} // namespace
+
+std::variant<std::shared_ptr<const CodeImage>, RuntimeError>
+CodeImage::build(const BytecodeModule &mod, const NameTable &name_table,
+				 ImageOptions options) noexcept {
+	auto image = std::make_shared<CodeImage>();
+	image->mod = &mod;
+
+	// Functions and the module's globals get their slots first, so that
+	// they are next to each other. Lowering asks for the slots of the calls
+	// it fuses.
+	for (const auto &[name, func] : mod.functions) {
+		image->global_slot(name);
+	}
+	for (NameIdType name : mod.global_names) {
+		image->global_slot(name);
+	}
+	auto global_slot = [&](NameIdType name) {
+		return image->global_slot(name);
+	};
+
+	for (const auto &[name, func] : mod.functions) {
+		auto fail = [&](std::string_view why) {
+			return RuntimeError(std::format("function {}: {}",
+											name_table.get_name(name), why));
+		};
+
+		if (func.arg_count > func.local_count) {
+			return fail("more arguments than locals");
+		}
+
+		for (const auto &inst : func.instructions) {
+			if (!is_supported(inst.type)) {
+				return fail(std::format("unsupported instruction {}",
+										inst.type));
+			}
+
+			switch (inst.type) {
+			case InstructionType::LDLOCAL:
+			case InstructionType::STLOCAL:
+				if (inst.idx() >= func.local_count) {
+					return fail("local variable index out of range");
+				}
+				break;
+			case InstructionType::LISTR:
+				if (inst.idx() >= mod.str_lits.size()) {
+					return fail("string literal index out of range");
+				}
+				break;
+			default:
+				break;
+			}
+		}
+
+		auto depths = compute_stack_depths(func);
+		if (!depths) {
+			return fail("malformed bytecode");
+		}
+		int max_depth = *std::max_element(depths->begin(), depths->end());
+
+		auto packed =
+			lower_to_packed(func, options.superinstructions, global_slot);
+		if (!packed) {
+			return fail("too large for the packed encoding");
+		}
+		image->funcs.push_back(
+			{std::move(*packed), func.local_count + max_depth, std::nullopt});
+		if (options.register_isa) {
+			image->funcs.back().registers = lower_to_registers(func);
+		}
+	}
+
+	for (auto &func : image->funcs) {
+		if (!image->link_globals(func)) {
+			return RuntimeError(
+				std::format("function {}: too many globals to link",
+							name_table.get_name(func.packed.name)));
+		}
+	}
+	return image;
+}
+
+const BytecodeModule &CodeImage::module() const noexcept {
+	return *mod;
+}
+
+std::span<const ImageFunction> CodeImage::functions() const noexcept {
+	return funcs;
+}
+
+std::span<const NameIdType> CodeImage::global_names() const noexcept {
+	return globals;
+}
+
+uint32_t CodeImage::global_slot(NameIdType name) noexcept {
+	if (const uint32_t *slot = global_slots.find(name)) {
+		return *slot;
+	}
+	auto slot = static_cast<uint32_t>(globals.size());
+	globals.push_back(name);
+	global_slots[name] = slot;
+	return slot;
+}
+
+// Rewrite global names in operands to slot indices, in both the packed and
+// the register form. CALLGLOBAL got its slot when lowering.
+bool CodeImage::link_globals(ImageFunction &func) noexcept {
+	for (auto &inst : func.packed.code) {
+		auto type = packed_type(inst);
+		if (type != InstructionType::LDGLOBAL &&
+			type != InstructionType::STGLOBAL) {
+			continue;
+		}
+		uint32_t slot = global_slot(packed_operand(inst));
+		if (slot > PACKED_OPERAND_MAX) {
+			return false;
+		}
+		inst = pack_instruction(type, slot);
+	}
+
+	if (func.registers) {
+		for (auto &inst : func.registers->instructions) {
+			if (inst.type == InstructionType::LDGLOBAL ||
+				inst.type == InstructionType::STGLOBAL) {
+				inst.k = global_slot(inst.k);
+			}
+		}
+	}
+	return true;
+}
+
+} // namespace cypheri
@@ -0,0 +1,832 @@
+#include "cypheri/jit.hpp"
+#include "cypheri/vm.hpp"
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if CYPHERI_VM_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace cypheri {
+
+#if CYPHERI_VM_JIT
+
+namespace {
+
+enum Reg : uint8_t {
+	RAX,
+	RCX,
+	RDX,
+	RBX,
+	RSP,
+	RBP,
+	RSI,
+	RDI,
+	R8,
+	R9,
+	R10,
+	R11,
+	R12,
+	R13,
+	R14,
+	R15,
+};
+
+// Kept for the whole run of compiled code, all callee-saved. RAX, RCX and
+// RDX are scratch, RDI..RCX carry the arguments of helper calls.
+constexpr Reg FRAME = RBX; // registers of the function's frame
+constexpr Reg VM_PTR = R12;
+constexpr Reg INT_TAG = R13; // small integer tag, zero payload
+constexpr Reg FALSE_BITS = R14;
+constexpr Reg TRUE_BITS = R15;
+
+constexpr uint64_t INT_TAG_BITS = Value::from_small_int(0).raw_bits();
+constexpr uint32_t INT_TAG_HIGH = INT_TAG_BITS >> 48;
+// Doubles have top 16 bits below those of every other kind of value
+constexpr uint32_t NUMBER_LIMIT = Value().raw_bits() >> 48;
+
+enum class Cond : uint8_t {
+	O = 0x0,
+	AE = 0x3,
+	E = 0x4,
+	NE = 0x5,
+	P = 0xa,
+	L = 0xc,
+	GE = 0xd,
+	LE = 0xe,
+	G = 0xf,
+};
+
+enum class Alu : uint8_t {
+	ADD = 0x01,
+	OR = 0x09,
+	AND = 0x21,
+	SUB = 0x29,
+	XOR = 0x31,
+	CMP = 0x39,
+};
+
+enum class Shift : uint8_t {
+	SHL = 4,
+	SHR = 5,
+	SAR = 7,
+};
+
+// Scalar double operations on XMM registers
+enum class Sse : uint8_t {
+	ADD = 0x58,
+	MUL = 0x59,
+	SUB = 0x5c,
+	DIV = 0x5e,
+};
+
+// Just the x86-64 encodings the compiler uses. Memory operands are a base
+// register plus displacement, the base is never RSP or R12, which would
+// need a SIB byte.
+class Assembler {
+public:
+	using Label = size_t;
+
+	std::vector<uint8_t> code;
+
+	Label label() {
+		labels.push_back(UNBOUND);
+		return labels.size() - 1;
+	}
+
+	void bind(Label label) {
+		labels[label] = code.size();
+	}
+
+	// Patch every jump, false if one targets a label never bound
+	bool finish() {
+		for (auto [at, label] : fixups) {
+			if (labels[label] == UNBOUND) {
+				return false;
+			}
+			auto rel = static_cast<int32_t>(labels[label] - (at + 4));
+			std::memcpy(code.data() + at, &rel, sizeof(rel));
+		}
+		return true;
+	}
+
+	void jmp(Label label) {
+		byte(0xe9);
+		fixup(label);
+	}
+
+	void jcc(Cond cc, Label label) {
+		byte(0x0f);
+		byte(0x80 | static_cast<uint8_t>(cc));
+		fixup(label);
+	}
+
+	void load(Reg dst, Reg base, int32_t disp) {
+		rex(true, dst, base);
+		byte(0x8b);
+		mem(dst, base, disp);
+	}
+
+	void store(Reg base, int32_t disp, Reg src) {
+		rex(true, src, base);
+		byte(0x89);
+		mem(src, base, disp);
+	}
+
+	void store_byte(Reg base, int32_t disp, uint8_t imm) {
+		rex(false, 0, base);
+		byte(0xc6);
+		mem(0, base, disp);
+		byte(imm);
+	}
+
+	void cmp_byte(Reg base, int32_t disp, uint8_t imm) {
+		rex(false, 0, base);
+		byte(0x80);
+		mem(7, base, disp);
+		byte(imm);
+	}
+
+	void lea(Reg dst, Reg base, int32_t disp) {
+		rex(true, dst, base);
+		byte(0x8d);
+		mem(dst, base, disp);
+	}
+
+	void mov(Reg dst, Reg src) {
+		alu(static_cast<Alu>(0x89), dst, src);
+	}
+
+	void mov(Reg dst, uint64_t imm) {
+		// the 32-bit form zero-extends
+		bool wide = imm > UINT32_MAX;
+		rex(wide, 0, dst);
+		byte(0xb8 | (dst & 7));
+		if (wide) {
+			u64(imm);
+		} else {
+			u32(static_cast<uint32_t>(imm));
+		}
+	}
+
+	void alu(Alu op, Reg dst, Reg src) {
+		rex(true, src, dst);
+		byte(static_cast<uint8_t>(op));
+		byte(0xc0 | (src & 7) << 3 | (dst & 7));
+	}
+
+	void imul(Reg dst, Reg src) {
+		rex(true, dst, src);
+		byte(0x0f);
+		byte(0xaf);
+		byte(0xc0 | (dst & 7) << 3 | (src & 7));
+	}
+
+	void shift(Shift op, Reg reg, uint8_t count) {
+		rex(true, 0, reg);
+		byte(0xc1);
+		byte(0xc0 | static_cast<uint8_t>(op) << 3 | (reg & 7));
+		byte(count);
+	}
+
+	void cmp32(Reg reg, uint32_t imm) {
+		rex(false, 0, reg);
+		byte(0x81);
+		byte(0xc0 | 7 << 3 | (reg & 7));
+		u32(imm);
+	}
+
+	// AL = cc, zero-extended into RAX
+	void setcc_rax(Cond cc) {
+		byte(0x0f);
+		byte(0x90 | static_cast<uint8_t>(cc));
+		byte(0xc0);
+		byte(0x0f);
+		byte(0xb6);
+		byte(0xc0);
+	}
+
+	void test_al() {
+		byte(0x84);
+		byte(0xc0);
+	}
+
+	void test(Reg reg) {
+		rex(true, reg, reg);
+		byte(0x85);
+		byte(0xc0 | (reg & 7) << 3 | (reg & 7));
+	}
+
+	void movq_to_xmm(uint8_t xmm, Reg src) {
+		byte(0x66);
+		rex(true, xmm, src);
+		byte(0x0f);
+		byte(0x6e);
+		byte(0xc0 | xmm << 3 | (src & 7));
+	}
+
+	void movq_from_xmm(Reg dst, uint8_t xmm) {
+		byte(0x66);
+		rex(true, xmm, dst);
+		byte(0x0f);
+		byte(0x7e);
+		byte(0xc0 | xmm << 3 | (dst & 7));
+	}
+
+	void sse(Sse op, uint8_t dst, uint8_t src) {
+		byte(0xf2);
+		byte(0x0f);
+		byte(static_cast<uint8_t>(op));
+		byte(0xc0 | dst << 3 | src);
+	}
+
+	void cvtsi2sd(uint8_t dst, Reg src) {
+		byte(0xf2);
+		rex(true, dst, src);
+		byte(0x0f);
+		byte(0x2a);
+		byte(0xc0 | dst << 3 | (src & 7));
+	}
+
+	void ucomisd(uint8_t a, uint8_t b) {
+		byte(0x66);
+		byte(0x0f);
+		byte(0x2e);
+		byte(0xc0 | a << 3 | b);
+	}
+
+	void call(Reg target) {
+		rex(false, 0, target);
+		byte(0xff);
+		byte(0xd0 | (target & 7));
+	}
+
+	void push(Reg reg) {
+		rex(false, 0, reg);
+		byte(0x50 | (reg & 7));
+	}
+
+	void pop(Reg reg) {
+		rex(false, 0, reg);
+		byte(0x58 | (reg & 7));
+	}
+
+	void ret() {
+		byte(0xc3);
+	}
+
+	void ud2() {
+		byte(0x0f);
+		byte(0x0b);
+	}
+
+private:
+	static constexpr size_t UNBOUND = SIZE_MAX;
+
+	std::vector<size_t> labels;		// offset of each, once bound
+	std::vector<std::pair<size_t, Label>> fixups; // rel32 at first
+
+	void byte(uint8_t b) {
+		code.push_back(b);
+	}
+
+	void u32(uint32_t v) {
+		for (int i = 0; i < 4; i++) {
+			byte(static_cast<uint8_t>(v >> i * 8));
+		}
+	}
+
+	void u64(uint64_t v) {
+		u32(static_cast<uint32_t>(v));
+		u32(static_cast<uint32_t>(v >> 32));
+	}
+
+	void fixup(Label label) {
+		fixups.emplace_back(code.size(), label);
+		u32(0);
+	}
+
+	// reg extends ModRM.reg, rm extends ModRM.rm, left out when not needed
+	void rex(bool wide, uint8_t reg, uint8_t rm) {
+		uint8_t prefix = 0x40 | wide << 3 | (reg >> 3) << 2 | (rm >> 3);
+		if (prefix != 0x40) {
+			byte(prefix);
+		}
+	}
+
+	void mem(uint8_t reg, Reg base, int32_t disp) {
+		if (disp >= -128 && disp < 128) {
+			byte(0x40 | (reg & 7) << 3 | (base & 7));
+			byte(static_cast<uint8_t>(disp));
+		} else {
+			byte(0x80 | (reg & 7) << 3 | (base & 7));
+			u32(static_cast<uint32_t>(disp));
+		}
+	}
+};
+
+using Label = Assembler::Label;
+
+// One pass over the register form. Each instruction's fast path goes
+// inline, slow paths and deoptimization exits after the body, so that the
+// common case falls through.
+class Compiler {
+public:
+	Compiler(const FunctionRecord &func, const JitHelpers &helpers) noexcept
+		: func(func), code(*func.code->registers), helpers(helpers) {}
+
+	bool run() noexcept;
+
+	const std::vector<uint8_t> &machine_code() const noexcept {
+		return as.code;
+	}
+
+private:
+	// Code placed after the body
+	struct Stub {
+		enum Kind : uint8_t {
+			SLOW,	// call the slow helper, deoptimize if it fails
+			DOUBLE, // arithmetic on two doubles, the slow path otherwise
+			DEOPT,
+		};
+
+		Kind kind;
+		size_t inst;
+		Label label;
+	};
+
+	const FunctionRecord &func;
+	const RegisterFunction &code;
+	const JitHelpers &helpers;
+	Assembler as;
+
+	std::vector<Label> starts; // of each instruction, and of the end
+	std::vector<Stub> stubs;
+	std::vector<Label> slow_stubs, deopt_stubs; // by instruction, lazily
+	Label exit, exit_status;
+
+	static int32_t slot(uint16_t reg) noexcept {
+		return static_cast<int32_t>(reg) * static_cast<int32_t>(sizeof(Value));
+	}
+
+	Label stub(Stub::Kind kind, size_t i) noexcept {
+		Label label = as.label();
+		stubs.push_back({kind, i, label});
+		return label;
+	}
+
+	Label slow(size_t i) noexcept {
+		if (slow_stubs[i] == NO_STUB) {
+			slow_stubs[i] = stub(Stub::SLOW, i);
+		}
+		return slow_stubs[i];
+	}
+
+	Label deopt(size_t i) noexcept {
+		if (deopt_stubs[i] == NO_STUB) {
+			deopt_stubs[i] = stub(Stub::DEOPT, i);
+		}
+		return deopt_stubs[i];
+	}
+
+	static constexpr Label NO_STUB = SIZE_MAX;
+
+	void emit(size_t i) noexcept;
+	void emit_stub(const Stub &stub) noexcept;
+
+	void constant(uint16_t dst, Value value) noexcept;
+	void call_helper(uint64_t helper, size_t i) noexcept;
+
+	// RDX = top 16 bits of reg, then compare them to high
+	void check_tag(Reg reg, uint32_t high) noexcept;
+
+	void arithmetic(size_t i) noexcept;
+	void bitwise(size_t i) noexcept;
+	void compare(size_t i) noexcept;
+	void branch(size_t i) noexcept;
+	void double_arithmetic(size_t i) noexcept;
+	void store_double(size_t i) noexcept;
+};
+
+bool Compiler::run() noexcept {
+	const auto &insts = code.instructions;
+	for (const auto &inst : insts) {
+		if ((inst.type == InstructionType::JMP ||
+			 inst.type == InstructionType::JZ ||
+			 inst.type == InstructionType::JNZ) &&
+			inst.k > insts.size()) {
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i <= insts.size(); i++) {
+		starts.push_back(as.label());
+	}
+	slow_stubs.assign(insts.size(), NO_STUB);
+	deopt_stubs.assign(insts.size(), NO_STUB);
+	exit = as.label();
+	exit_status = as.label();
+
+	// Five pushes leave the stack 16-byte aligned for helper calls
+	for (Reg reg : {RBX, R12, R13, R14, R15}) {
+		as.push(reg);
+	}
+	as.mov(VM_PTR, RDI);
+	as.mov(FRAME, RSI);
+	as.mov(INT_TAG, INT_TAG_BITS);
+	as.mov(FALSE_BITS, Value::from_bool(false).raw_bits());
+	as.mov(TRUE_BITS, Value::from_bool(true).raw_bits());
+
+	for (size_t i = 0; i < insts.size(); i++) {
+		as.bind(starts[i]);
+		emit(i);
+	}
+	// lowered code never falls off its end
+	as.bind(starts[insts.size()]);
+	as.ud2();
+
+	// stubs may add more stubs as they go
+	for (size_t i = 0; i < stubs.size(); i++) {
+		Stub next = stubs[i];
+		emit_stub(next);
+	}
+
+	as.bind(exit_status);
+	as.mov(RDX, RAX);
+	as.bind(exit);
+	for (Reg reg : {R15, R14, R13, R12, RBX}) {
+		as.pop(reg);
+	}
+	as.ret();
+	return as.finish();
+}
+
+void Compiler::emit(size_t i) noexcept {
+	const auto &inst = code.instructions[i];
+	using enum InstructionType;
+	switch (inst.type) {
+	case NOP:
+		break;
+	case ADD:
+	case SUB:
+	case MUL:
+	case DIV:
+		arithmetic(i);
+		break;
+	case BXOR:
+	case BAND:
+	case BOR:
+		bitwise(i);
+		break;
+	case EQ:
+	case NE:
+	case LT:
+	case LE:
+	case GT:
+	case GE:
+		compare(i);
+		break;
+	case MOD:
+	case POW:
+	case IDIV:
+	case NEG:
+	case BNOT:
+	case SHL:
+	case SHR:
+	case AND:
+	case OR:
+	case NOT:
+		call_helper(reinterpret_cast<uint64_t>(helpers.slow), i);
+		as.test_al();
+		as.jcc(Cond::E, deopt(i));
+		break;
+	case MOV:
+		as.load(RAX, FRAME, slot(inst.b()));
+		as.store(FRAME, slot(inst.a), RAX);
+		break;
+	case LII:
+		constant(inst.a, Value::from_small_int(static_cast<int32_t>(inst.k)));
+		break;
+	case LIN:
+		constant(inst.a, Value::from_number(
+							 std::bit_cast<double>(code.constants[inst.k])));
+		break;
+	case LIIW: {
+		auto val = static_cast<int64_t>(code.constants[inst.k]);
+		if (Value::fits_small_int(val)) {
+			constant(inst.a, Value::from_small_int(val));
+		} else {
+			// boxed afresh every time, like the interpreter does
+			call_helper(reinterpret_cast<uint64_t>(helpers.slow), i);
+		}
+		break;
+	}
+	case LINULL:
+		constant(inst.a, Value());
+		break;
+	case LIBOOL:
+		constant(inst.a, Value::from_bool(inst.k != 0));
+		break;
+	case LISTR:
+		constant(inst.a, Value::from_string(&func.module->str_lits[inst.k]));
+		break;
+	case LDGLOBAL:
+		// cells stay where they are for the life of the VM
+		as.mov(RCX, reinterpret_cast<uint64_t>(func.globals[inst.k]));
+		as.cmp_byte(RCX, offsetof(GlobalCell, defined), 0);
+		as.jcc(Cond::E, deopt(i));
+		as.load(RAX, RCX, offsetof(GlobalCell, value));
+		as.store(FRAME, slot(inst.a), RAX);
+		break;
+	case STGLOBAL:
+		as.load(RAX, FRAME, slot(inst.a));
+		as.mov(RCX, reinterpret_cast<uint64_t>(func.globals[inst.k]));
+		as.store(RCX, offsetof(GlobalCell, value), RAX);
+		as.store_byte(RCX, offsetof(GlobalCell, defined), 1);
+		break;
+	case JMP:
+		as.jmp(starts[inst.k]);
+		break;
+	case JZ:
+	case JNZ:
+		branch(i);
+		break;
+	case CALL:
+		call_helper(reinterpret_cast<uint64_t>(helpers.call), i);
+		as.test(RAX);
+		as.jcc(Cond::NE, exit_status);
+		break;
+	case RET:
+		as.load(RAX, FRAME, slot(inst.a));
+		as.mov(RDX, JIT_RETURNED);
+		as.jmp(exit);
+		break;
+	case RETNULL:
+		as.mov(RAX, Value().raw_bits());
+		as.mov(RDX, JIT_RETURNED);
+		as.jmp(exit);
+		break;
+	default:
+		as.jmp(deopt(i));
+		break;
+	}
+}
+
+void Compiler::emit_stub(const Stub &stub) noexcept {
+	as.bind(stub.label);
+	switch (stub.kind) {
+	case Stub::SLOW:
+		call_helper(reinterpret_cast<uint64_t>(helpers.slow), stub.inst);
+		as.test_al();
+		as.jcc(Cond::E, deopt(stub.inst));
+		as.jmp(starts[stub.inst + 1]);
+		break;
+	case Stub::DOUBLE:
+		double_arithmetic(stub.inst);
+		break;
+	case Stub::DEOPT:
+		as.mov(RDX, stub.inst + 1);
+		as.jmp(exit);
+		break;
+	}
+}
+
+void Compiler::constant(uint16_t dst, Value value) noexcept {
+	as.mov(RAX, value.raw_bits());
+	as.store(FRAME, slot(dst), RAX);
+}
+
+void Compiler::call_helper(uint64_t helper, size_t i) noexcept {
+	as.mov(RDI, VM_PTR);
+	as.mov(RSI, reinterpret_cast<uint64_t>(&func));
+	as.mov(RDX, FRAME);
+	as.mov(RCX, reinterpret_cast<uint64_t>(&code.instructions[i]));
+	as.mov(RAX, helper);
+	as.call(RAX);
+}
+
+void Compiler::check_tag(Reg reg, uint32_t high) noexcept {
+	as.mov(RDX, reg);
+	as.shift(Shift::SHR, RDX, 48);
+	as.cmp32(RDX, high);
+}
+
+// Small integers are added, subtracted and multiplied shifted up by 16 bits,
+// so that the overflow flag tells when the result doesn't fit inline, and
+// divided as doubles. Anything else that isn't two doubles takes the slow
+// path.
+void Compiler::arithmetic(size_t i) noexcept {
+	const auto &inst = code.instructions[i];
+	as.load(RAX, FRAME, slot(inst.b()));
+	as.load(RCX, FRAME, slot(inst.c()));
+	check_tag(RAX, INT_TAG_HIGH);
+	as.jcc(Cond::NE, stub(Stub::DOUBLE, i));
+	check_tag(RCX, INT_TAG_HIGH);
+	as.jcc(Cond::NE, slow(i));
+	if (inst.type == InstructionType::DIV) {
+		for (Reg reg : {RAX, RCX}) {
+			as.shift(Shift::SHL, reg, 16);
+			as.shift(Shift::SAR, reg, 16);
+		}
+		as.cvtsi2sd(0, RAX);
+		as.cvtsi2sd(1, RCX);
+		as.sse(Sse::DIV, 0, 1);
+		store_double(i);
+		return;
+	}
+
+	as.shift(Shift::SHL, RAX, 16);
+	as.shift(Shift::SHL, RCX, 16);
+	switch (inst.type) {
+	case InstructionType::ADD:
+		as.alu(Alu::ADD, RAX, RCX);
+		break;
+	case InstructionType::SUB:
+		as.alu(Alu::SUB, RAX, RCX);
+		break;
+	default: // MUL, only one side shifted
+		as.shift(Shift::SAR, RAX, 16);
+		as.imul(RAX, RCX);
+		break;
+	}
+	as.jcc(Cond::O, slow(i));
+	as.shift(Shift::SHR, RAX, 16);
+	as.alu(Alu::OR, RAX, INT_TAG);
+	as.store(FRAME, slot(inst.a), RAX);
+}
+
+// Operands still in RAX and RCX
+void Compiler::double_arithmetic(size_t i) noexcept {
+	const auto &inst = code.instructions[i];
+	check_tag(RAX, NUMBER_LIMIT);
+	as.jcc(Cond::AE, slow(i));
+	check_tag(RCX, NUMBER_LIMIT);
+	as.jcc(Cond::AE, slow(i));
+	as.movq_to_xmm(0, RAX);
+	as.movq_to_xmm(1, RCX);
+	switch (inst.type) {
+	case InstructionType::ADD:
+		as.sse(Sse::ADD, 0, 1);
+		break;
+	case InstructionType::SUB:
+		as.sse(Sse::SUB, 0, 1);
+		break;
+	case InstructionType::MUL:
+		as.sse(Sse::MUL, 0, 1);
+		break;
+	default:
+		as.sse(Sse::DIV, 0, 1);
+		break;
+	}
+	store_double(i);
+	as.jmp(starts[i + 1]);
+}
+
+// Result in XMM0, NaN goes through the slow path to be canonicalized
+void Compiler::store_double(size_t i) noexcept {
+	as.ucomisd(0, 0);
+	as.jcc(Cond::P, slow(i));
+	as.movq_from_xmm(RAX, 0);
+	as.store(FRAME, slot(code.instructions[i].a), RAX);
+}
+
+// Tagged small integers share their tag, so the raw bits can be combined,
+// only XOR has to put the tag back
+void Compiler::bitwise(size_t i) noexcept {
+	const auto &inst = code.instructions[i];
+	as.load(RAX, FRAME, slot(inst.b()));
+	as.load(RCX, FRAME, slot(inst.c()));
+	check_tag(RAX, INT_TAG_HIGH);
+	as.jcc(Cond::NE, slow(i));
+	check_tag(RCX, INT_TAG_HIGH);
+	as.jcc(Cond::NE, slow(i));
+	switch (inst.type) {
+	case InstructionType::BAND:
+		as.alu(Alu::AND, RAX, RCX);
+		break;
+	case InstructionType::BOR:
+		as.alu(Alu::OR, RAX, RCX);
+		break;
+	default:
+		as.alu(Alu::XOR, RAX, RCX);
+		as.alu(Alu::OR, RAX, INT_TAG);
+		break;
+	}
+	as.store(FRAME, slot(inst.a), RAX);
+}
+
+void Compiler::compare(size_t i) noexcept {
+	const auto &inst = code.instructions[i];
+	as.load(RAX, FRAME, slot(inst.b()));
+	as.load(RCX, FRAME, slot(inst.c()));
+	check_tag(RAX, INT_TAG_HIGH);
+	as.jcc(Cond::NE, slow(i));
+	check_tag(RCX, INT_TAG_HIGH);
+	as.jcc(Cond::NE, slow(i));
+
+	Cond cc;
+	switch (inst.type) {
+	case InstructionType::EQ:
+		cc = Cond::E;
+		break;
+	case InstructionType::NE:
+		cc = Cond::NE;
+		break;
+	case InstructionType::LT:
+		cc = Cond::L;
+		break;
+	case InstructionType::LE:
+		cc = Cond::LE;
+		break;
+	case InstructionType::GT:
+		cc = Cond::G;
+		break;
+	default:
+		cc = Cond::GE;
+		break;
+	}
+	// drop the tags, order is kept shifted up
+	as.shift(Shift::SHL, RAX, 16);
+	as.shift(Shift::SHL, RCX, 16);
+	as.alu(Alu::CMP, RAX, RCX);
+	as.setcc_rax(cc);
+	as.alu(Alu::OR, RAX, FALSE_BITS);
+	as.store(FRAME, slot(inst.a), RAX);
+}
+
+// Booleans are tested inline, other values by the truthy helper
+void Compiler::branch(size_t i) noexcept {
+	const auto &inst = code.instructions[i];
+	Label next = starts[i + 1], target = starts[inst.k];
+	bool jz = inst.type == InstructionType::JZ;
+	Label if_true = jz ? next : target, if_false = jz ? target : next;
+
+	as.load(RAX, FRAME, slot(inst.a));
+	as.alu(Alu::CMP, RAX, TRUE_BITS);
+	as.jcc(Cond::E, if_true);
+	as.alu(Alu::CMP, RAX, FALSE_BITS);
+	as.jcc(Cond::E, if_false);
+	as.lea(RDI, FRAME, slot(inst.a));
+	as.mov(RAX, reinterpret_cast<uint64_t>(helpers.truthy));
+	as.call(RAX);
+	as.test_al();
+	as.jcc(Cond::NE, if_true);
+	if (if_false != next) {
+		as.jmp(if_false);
+	}
+}
+
+} // namespace
+
+#endif
+
+std::unique_ptr<JitFunction>
+JitFunction::compile(const FunctionRecord &func,
+					 const JitHelpers &helpers) noexcept {
+#if CYPHERI_VM_JIT
+	if (!func.code->registers) {
+		return nullptr;
+	}
+	Compiler compiler(func, helpers);
+	if (!compiler.run()) {
+		return nullptr;
+	}
+
+	// written first and made executable after, never both at once
+	const auto &bytes = compiler.machine_code();
+	auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t mapped = (bytes.size() + page - 1) / page * page;
+	void *memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		return nullptr;
+	}
+	std::memcpy(memory, bytes.data(), bytes.size());
+	if (mprotect(memory, mapped, PROT_READ | PROT_EXEC) != 0) {
+		munmap(memory, mapped);
+		return nullptr;
+	}
+	return std::unique_ptr<JitFunction>(
+		new JitFunction(memory, mapped, bytes.size()));
+#else
+	(void)func;
+	(void)helpers;
+	return nullptr;
+#endif
+}
+
+JitFunction::JitFunction(void *memory, size_t mapped, size_t size) noexcept
+	: memory(memory), mapped(mapped), size(size),
+	  entry(reinterpret_cast<Entry>(memory)) {}
+
+JitFunction::~JitFunction() {
+#if CYPHERI_VM_JIT
+	munmap(memory, mapped);
+#endif
+}
+
+} // namespace cypheri
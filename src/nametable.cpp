@@ -1,38 +1,220 @@
 #include "cypheri/nametable.hpp"
 #include <algorithm>
+#include <bit>
 #include <cassert>
+#include <cstring>
 #include <exception>
 
 namespace cypheri {
 
-NameIdType NameTable::get_id(std::string_view name) const {
-	auto it = name_to_id.find(name);
-	if (it != name_to_id.end()) {
-		return it->second;
+namespace {
+
+constexpr size_t MIN_SLOTS = 64;
+
+// Slots for count names, keeping a table at most half full
+size_t slots_for(size_t count) {
+	return std::max(MIN_SLOTS, std::bit_ceil(count * 2));
+}
+
+struct IndexPosition {
+	size_t segment, offset;
+};
+
+IndexPosition index_position(NameIdType id, int first_bits) {
+	uint64_t x = uint64_t{id} + (uint64_t{1} << first_bits);
+	int segment = std::bit_width(x) - 1 - first_bits;
+	return {static_cast<size_t>(segment),
+			static_cast<size_t>(x - (uint64_t{1} << (segment + first_bits)))};
+}
+
+uint32_t slot_hash(uint64_t slot) {
+	return static_cast<uint32_t>(slot >> 32);
+}
+
+NameIdType slot_id(uint64_t slot) {
+	return static_cast<NameIdType>(slot) - 1;
+}
+
+} // namespace
+
+NameTable::NameTable(bool concurrent) : concurrent(concurrent) {
+	for (auto &shard : shards) {
+		grow(shard, MIN_SLOTS);
 	}
-	return NameTable::INVALID_ID;
+}
+
+// FNV-1a
+uint32_t NameTable::hash(std::string_view name) {
+	uint32_t h = 2166136261u;
+	for (char c : name) {
+		h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+	}
+	return h;
+}
+
+// The shard is picked by the top bits of the hash and the slot by the low
+// bits, so that names in one shard don't crowd into the same slots.
+NameIdType NameTable::find(const SlotArray *table, std::string_view name,
+						   uint32_t h) const {
+	for (size_t i = h & table->mask;; i = (i + 1) & table->mask) {
+		uint64_t slot = table->slots[i].load(std::memory_order_acquire);
+		if (slot == 0) {
+			return INVALID_ID;
+		}
+		if (slot_hash(slot) == h && get_name(slot_id(slot)) == name) {
+			return slot_id(slot);
+		}
+	}
+}
+
+// Called with the shard locked. Readers still probing the old table simply
+// miss names inserted from now on and retry under the lock.
+void NameTable::grow(Shard &shard, size_t capacity) {
+	auto array = std::make_unique<SlotArray>();
+	array->mask = capacity - 1;
+	array->slots = std::make_unique<std::atomic<uint64_t>[]>(capacity);
+
+	if (auto old = shard.table.load(std::memory_order_relaxed)) {
+		for (size_t i = 0; i <= old->mask; i++) {
+			uint64_t slot = old->slots[i].load(std::memory_order_relaxed);
+			if (slot == 0) {
+				continue;
+			}
+			size_t j = slot_hash(slot) & array->mask;
+			while (array->slots[j].load(std::memory_order_relaxed) != 0) {
+				j = (j + 1) & array->mask;
+			}
+			array->slots[j].store(slot, std::memory_order_relaxed);
+		}
+	}
+
+	shard.table.store(array.get(), std::memory_order_release);
+	shard.arrays.push_back(std::move(array));
+}
+
+NameIdType NameTable::get_id(std::string_view name) const {
+	uint32_t h = hash(name);
+	const auto &shard = shards[h >> (32 - SHARD_BITS)];
+	return find(shard.table.load(std::memory_order_acquire), name, h);
 }
 
 NameIdType NameTable::get_id_or_insert(std::string_view name) {
-	auto it = name_to_id.find(name);
-	if (it != name_to_id.end()) {
-		return it->second;
+	uint32_t h = hash(name);
+	auto &shard = shards[h >> (32 - SHARD_BITS)];
+	NameIdType id = find(shard.table.load(std::memory_order_acquire), name, h);
+	if (id != INVALID_ID) {
+		return id;
+	}
+
+	std::unique_lock lock(shard.mutex, std::defer_lock);
+	if (concurrent) {
+		lock.lock();
+		// another thread may have inserted it meanwhile
+		id = find(shard.table.load(std::memory_order_relaxed), name, h);
+		if (id != INVALID_ID) {
+			return id;
+		}
 	}
 
-	std::unique_ptr<char[]> name_clone = std::make_unique<char[]>(name.size());
-	std::copy(name.begin(), name.end(), name_clone.get());
-	std::string_view name_view{name_clone.get(), name.size()};
-	names.push_back({std::move(name_clone), name.size()});
-	return (name_to_id[name_view] = names.size() - 1);
+	if ((shard.count + 1) * 2 > shard.table.load()->mask + 1) {
+		grow(shard, (shard.table.load()->mask + 1) * 2);
+	}
+
+	char *data = static_cast<char *>(shard.strings.allocate(name.size(), 1));
+	std::memcpy(data, name.data(), name.size());
+	shard.string_bytes += name.size();
+
+	id = next_id.fetch_add(1, std::memory_order_relaxed);
+	auto pos = index_position(id, FIRST_SEGMENT_BITS);
+	segment_for(id)[pos.offset] = std::string_view(data, name.size());
+
+	// publishing the slot makes the name above visible to readers
+	const SlotArray *table = shard.table.load(std::memory_order_relaxed);
+	size_t i = h & table->mask;
+	while (table->slots[i].load(std::memory_order_relaxed) != 0) {
+		i = (i + 1) & table->mask;
+	}
+	table->slots[i].store(uint64_t{h} << 32 | (uint64_t{id} + 1),
+						  std::memory_order_release);
+	shard.count++;
+	return id;
+}
+
+std::string_view *NameTable::segment_for(NameIdType id) {
+	auto pos = index_position(id, FIRST_SEGMENT_BITS);
+	auto *segment = segments[pos.segment].load(std::memory_order_acquire);
+	if (segment) {
+		return segment;
+	}
+
+	std::unique_lock lock(segment_mutex, std::defer_lock);
+	if (concurrent) {
+		lock.lock();
+	}
+	segment = segments[pos.segment].load(std::memory_order_relaxed);
+	if (!segment) {
+		size_t size = size_t{1} << (pos.segment + FIRST_SEGMENT_BITS);
+		segment_storage.push_back(std::make_unique<std::string_view[]>(size));
+		segment = segment_storage.back().get();
+		segments[pos.segment].store(segment, std::memory_order_release);
+	}
+	return segment;
 }
 
 std::string_view NameTable::get_name(NameIdType id) const {
-	assert(id >= 0 && id < names.size());
-	return {names[id].name.get(), names[id].count};
+	assert(id < size());
+	auto pos = index_position(id, FIRST_SEGMENT_BITS);
+	return segments[pos.segment].load(std::memory_order_acquire)[pos.offset];
 }
 
 size_t NameTable::size() const {
-	return names.size();
+	return next_id.load(std::memory_order_relaxed);
+}
+
+bool NameTable::is_concurrent() const {
+	return concurrent;
+}
+
+void NameTable::reserve(size_t count) {
+	if (count > 0) {
+		segment_for(static_cast<NameIdType>(count - 1));
+	}
+
+	// with a little slack, names never spread over the shards evenly
+	size_t per_shard = count / SHARD_COUNT + count / (SHARD_COUNT * 8) + 1;
+	for (auto &shard : shards) {
+		std::unique_lock lock(shard.mutex, std::defer_lock);
+		if (concurrent) {
+			lock.lock();
+		}
+		if (slots_for(per_shard) > shard.table.load()->mask + 1) {
+			grow(shard, slots_for(per_shard));
+		}
+	}
+}
+
+NameTableStats NameTable::stats() const {
+	NameTableStats res{.names = size()};
+	for (const auto &shard : shards) {
+		std::unique_lock lock(shard.mutex, std::defer_lock);
+		if (concurrent) {
+			lock.lock();
+		}
+		res.string_bytes += shard.string_bytes;
+		res.table_slots += shard.table.load()->mask + 1;
+		res.memory_bytes += shard.strings.capacity();
+		for (const auto &array : shard.arrays) {
+			res.memory_bytes += (array->mask + 1) * sizeof(uint64_t);
+		}
+	}
+	for (const auto &segment : segments) {
+		if (segment.load()) {
+			size_t i = &segment - segments.data();
+			res.memory_bytes += (size_t{1} << (i + FIRST_SEGMENT_BITS)) *
+								sizeof(std::string_view);
+		}
+	}
+	return res;
 }
 
 } // namespace cypheri
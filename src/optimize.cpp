@@ -0,0 +1,224 @@
+#include "cypheri/optimize.hpp"
+
+namespace cypheri {
+
+namespace {
+
+bool is_jump(InstructionType type) noexcept {
+	return type == InstructionType::JMP || type == InstructionType::JZ ||
+		   type == InstructionType::JNZ;
+}
+
+// Truthiness of a literal load, std::nullopt for everything else
+std::optional<bool> literal_truthiness(const BytecodeInstruction &inst) noexcept {
+	switch (inst.type) {
+	case InstructionType::LII:
+	case InstructionType::LIBOOL:
+		return inst.i_lit != 0;
+	case InstructionType::LIN:
+		return inst.f_lit != 0;
+	case InstructionType::LINULL:
+		return false;
+	case InstructionType::LISTR:
+		return true;
+	default:
+		return std::nullopt;
+	}
+}
+
+bool has_no_side_effect(const BytecodeInstruction &inst) noexcept {
+	switch (inst.type) {
+	case InstructionType::LII:
+	case InstructionType::LIN:
+	case InstructionType::LINULL:
+	case InstructionType::LIBOOL:
+	case InstructionType::LISTR:
+	case InstructionType::LDLOCAL:
+	case InstructionType::DUP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+class PeepholeOptimizer {
+public:
+	PeepholeOptimizer(BytecodeFunction &func) noexcept
+		: func(func), code(func.instructions) {}
+
+	size_t run() noexcept;
+
+private:
+	BytecodeFunction &func;
+	std::vector<BytecodeInstruction> &code;
+	std::vector<bool> is_target;
+
+	void find_targets() noexcept;
+	bool thread_jumps() noexcept;
+	bool rewrite_windows() noexcept;
+	bool remove_unreachable() noexcept;
+	size_t remove_nops() noexcept;
+
+	// The pair starting at i can be rewritten as a unit, no jump lands in
+	// the middle of it
+	bool pair_at(size_t i) const noexcept {
+		return i + 1 < code.size() && !is_target[i + 1];
+	}
+
+	void kill(size_t i) noexcept {
+		code[i] = BytecodeInstruction(InstructionType::NOP);
+	}
+};
+
+void PeepholeOptimizer::find_targets() noexcept {
+	is_target.assign(code.size() + 1, false);
+	for (const auto &inst : code) {
+		if (is_jump(inst.type) && inst.idx() <= code.size()) {
+			is_target[inst.idx()] = true;
+		}
+	}
+}
+
+// Jumps landing on an unconditional jump go straight to its target, and
+// jumps to the next instruction are dropped.
+bool PeepholeOptimizer::thread_jumps() noexcept {
+	bool changed = false;
+	for (size_t i = 0; i < code.size(); i++) {
+		if (!is_jump(code[i].type)) {
+			continue;
+		}
+
+		size_t target = code[i].idx();
+		// bounded, so that a cycle of jumps doesn't hang us
+		for (size_t hops = 0; hops < code.size() && target < code.size() &&
+							  code[target].type == InstructionType::JMP &&
+							  code[target].idx() != target;
+			 hops++) {
+			target = code[target].idx();
+		}
+		if (target != code[i].idx()) {
+			code[i].idx() = target;
+			changed = true;
+		}
+
+		if (code[i].type == InstructionType::JMP && target == i + 1) {
+			kill(i);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool PeepholeOptimizer::rewrite_windows() noexcept {
+	using enum InstructionType;
+
+	bool changed = false;
+	for (size_t i = 0; i + 1 < code.size(); i++) {
+		if (!pair_at(i)) {
+			continue;
+		}
+		auto &a = code[i], &b = code[i + 1];
+
+		if (b.type == JZ || b.type == JNZ) {
+			if (a.type == NOT) {
+				// NOT; JZ L -> JNZ L
+				b.type = b.type == JZ ? JNZ : JZ;
+				kill(i);
+				changed = true;
+			} else if (auto cond = literal_truthiness(a)) {
+				// the branch is decided at compile time
+				if (*cond == (b.type == JNZ)) {
+					b.type = JMP;
+				} else {
+					kill(i + 1);
+				}
+				kill(i);
+				changed = true;
+			}
+		} else if (a.type == STLOCAL && b.type == LDLOCAL &&
+				   a.idx() == b.idx()) {
+			// STLOCAL n; LDLOCAL n -> DUP; STLOCAL n
+			b = a;
+			a = BytecodeInstruction(DUP);
+			changed = true;
+		} else if (a.type == LDLOCAL && b.type == STLOCAL &&
+				   a.idx() == b.idx()) {
+			// x = x
+			kill(i);
+			kill(i + 1);
+			changed = true;
+		} else if (b.type == POPN && b.n >= 1 && has_no_side_effect(a)) {
+			// value computed only to be discarded
+			kill(i);
+			if (--b.n == 0) {
+				kill(i + 1);
+			}
+			changed = true;
+		} else if (a.type == POPN && a.n == 0) {
+			kill(i);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool PeepholeOptimizer::remove_unreachable() noexcept {
+	auto depths = compute_stack_depths(func);
+	if (!depths) {
+		// not something we understand, leave it alone
+		return false;
+	}
+
+	bool changed = false;
+	for (size_t i = 0; i < code.size(); i++) {
+		if ((*depths)[i] == -1 && code[i].type != InstructionType::NOP) {
+			kill(i);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+size_t PeepholeOptimizer::remove_nops() noexcept {
+	// new index of each instruction, a removed one maps to its successor
+	std::vector<size_t> remap(code.size() + 1);
+	size_t kept = 0;
+	for (size_t i = 0; i < code.size(); i++) {
+		remap[i] = kept;
+		if (code[i].type != InstructionType::NOP) {
+			code[kept++] = code[i];
+		}
+	}
+	remap[code.size()] = kept;
+
+	size_t removed = code.size() - kept;
+	code.erase(code.begin() + kept, code.end());
+	func.lines = func.lines.remapped(remap);
+	for (auto &inst : code) {
+		if (is_jump(inst.type) && inst.idx() < remap.size()) {
+			inst.idx() = remap[inst.idx()];
+		}
+	}
+	return removed;
+}
+
+size_t PeepholeOptimizer::run() noexcept {
+	size_t removed = 0;
+	bool changed = true;
+	while (changed) {
+		find_targets();
+		changed = thread_jumps();
+		changed |= rewrite_windows();
+		changed |= remove_unreachable();
+		removed += remove_nops();
+	}
+	return removed;
+}
+
+} // namespace
+
+size_t peephole_optimize(BytecodeFunction &func) noexcept {
+	return PeepholeOptimizer(func).run();
+}
+
+} // namespace cypheri
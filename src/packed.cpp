@@ -0,0 +1,236 @@
+#include "cypheri/packed.hpp"
+#include <bit>
+#include <limits>
+#include <unordered_map>
+
+namespace cypheri {
+
+namespace {
+
+struct Fusion {
+	InstructionType type;
+	size_t length; // number of bytecode instructions replaced
+};
+
+bool is_jump(InstructionType type) noexcept {
+	return type == InstructionType::JMP || type == InstructionType::JZ ||
+		   type == InstructionType::JNZ;
+}
+
+bool fits_int16(uint64_t lit) noexcept {
+	auto val = static_cast<int64_t>(lit);
+	return val >= std::numeric_limits<int16_t>::min() &&
+		   val <= std::numeric_limits<int16_t>::max();
+}
+
+// Superinstruction starting at code[i], if any. Jumps may only land on the
+// first instruction of the sequence.
+std::optional<Fusion>
+match_fusion(const std::vector<BytecodeInstruction> &code,
+			 const std::vector<bool> &is_target, size_t i,
+			 const std::function<uint32_t(NameIdType)> &global_slot) noexcept {
+	using enum InstructionType;
+
+	auto matches = [&](std::initializer_list<InstructionType> types) {
+		if (i + types.size() > code.size()) {
+			return false;
+		}
+		size_t j = i;
+		for (auto type : types) {
+			if (code[j].type != type || (j != i && is_target[j])) {
+				return false;
+			}
+			j++;
+		}
+		return true;
+	};
+
+	if (matches({LDLOCAL, LDLOCAL, ADD}) &&
+		code[i].idx() < (1u << ADDLL_LOCAL_BITS) &&
+		code[i + 1].idx() < (1u << ADDLL_LOCAL_BITS)) {
+		return Fusion{ADDLL, 3};
+	}
+	if (matches({LDLOCAL, LII, LT, JZ}) &&
+		code[i].idx() <= std::numeric_limits<uint16_t>::max() &&
+		fits_int16(code[i + 1].i_lit)) {
+		return Fusion{LTLI_JZ, 4};
+	}
+	if (global_slot && matches({LDGLOBAL, CALL}) &&
+		global_slot(code[i].idx()) < (1u << CALLGLOBAL_SLOT_BITS) &&
+		code[i + 1].n >= 0 &&
+		code[i + 1].n < (1 << (PACKED_OPERAND_BITS - CALLGLOBAL_SLOT_BITS))) {
+		return Fusion{CALLGLOBAL, 2};
+	}
+	return std::nullopt;
+}
+
+} // namespace
+
+std::optional<PackedFunction> lower_to_packed(
+	const BytecodeFunction &func, bool superinstructions,
+	const std::function<uint32_t(NameIdType)> &global_slot) noexcept {
+	if (func.local_count > PACKED_OPERAND_MAX) {
+		return std::nullopt;
+	}
+
+	const auto &insts = func.instructions;
+	std::vector<bool> is_target(insts.size() + 1, false);
+	for (const auto &inst : insts) {
+		if (is_jump(inst.type) && inst.idx() <= insts.size()) {
+			is_target[inst.idx()] = true;
+		}
+	}
+
+	// Decide the fusions first, so that jumps can be remapped while emitting
+	std::vector<std::optional<Fusion>> fusions(insts.size());
+	std::vector<size_t> starts(insts.size() + 1);
+	size_t packed_size = 0;
+	for (size_t i = 0; i < insts.size();) {
+		if (superinstructions) {
+			fusions[i] = match_fusion(insts, is_target, i, global_slot);
+		}
+		size_t length = fusions[i] ? fusions[i]->length : 1;
+		for (size_t j = i; j < i + length; j++) {
+			starts[j] = packed_size;
+		}
+		packed_size++;
+		i += length;
+	}
+	starts[insts.size()] = packed_size;
+
+	auto target = [&](size_t idx) {
+		return idx < starts.size() ? starts[idx] : PACKED_OPERAND_MAX + 1;
+	};
+
+	PackedFunction res;
+	res.name = func.name;
+	res.local_count = func.local_count;
+	res.arg_count = func.arg_count;
+	res.code.reserve(packed_size);
+
+	// identical literals share a constant pool slot
+	std::unordered_map<uint64_t, uint32_t> int_slots, num_slots, fused_slots;
+	auto add_constant = [&](std::unordered_map<uint64_t, uint32_t> &slots,
+							uint64_t bits) {
+		auto [it, inserted] = slots.try_emplace(bits, res.constants.size());
+		if (inserted) {
+			res.constants.push_back(bits);
+		}
+		return it->second;
+	};
+
+	for (size_t i = 0; i < insts.size();) {
+		const auto &inst = insts[i];
+		uint64_t operand = 0;
+
+		if (auto fusion = fusions[i]) {
+			switch (fusion->type) {
+			case InstructionType::ADDLL:
+				operand = inst.idx() | insts[i + 1].idx() << ADDLL_LOCAL_BITS;
+				break;
+			case InstructionType::LTLI_JZ: {
+				uint64_t jump = target(insts[i + 3].idx());
+				if (jump > PACKED_OPERAND_MAX) {
+					return std::nullopt;
+				}
+				operand = add_constant(
+					fused_slots, jump | inst.idx() << 32 |
+									 (insts[i + 1].i_lit & 0xffff) << 48);
+				break;
+			}
+			default: // CALLGLOBAL, already linked
+				operand = global_slot(inst.idx()) |
+						  static_cast<uint64_t>(insts[i + 1].n)
+							  << CALLGLOBAL_SLOT_BITS;
+				break;
+			}
+			res.code.push_back(
+				pack_instruction(fusion->type, static_cast<uint32_t>(operand)));
+			i += fusion->length;
+			continue;
+		}
+
+		switch (inst.type) {
+		case InstructionType::LII: {
+			auto val = static_cast<int64_t>(inst.i_lit);
+			if (val >= PACKED_SOPERAND_MIN && val <= PACKED_SOPERAND_MAX) {
+				operand = static_cast<uint32_t>(val) & PACKED_OPERAND_MAX;
+			} else {
+				res.code.push_back(
+					pack_instruction(InstructionType::LIIW,
+									 add_constant(int_slots, inst.i_lit)));
+				i++;
+				continue;
+			}
+			break;
+		}
+		case InstructionType::LIN:
+			operand =
+				add_constant(num_slots, std::bit_cast<uint64_t>(inst.f_lit));
+			break;
+		case InstructionType::LIIW:
+		case InstructionType::ADDLL:
+		case InstructionType::LTLI_JZ:
+		case InstructionType::CALLGLOBAL:
+		case InstructionType::ADD_NN:
+		case InstructionType::SUB_NN:
+		case InstructionType::MUL_NN:
+		case InstructionType::DIV_NN:
+		case InstructionType::DIV_II:
+		case InstructionType::LT_NN:
+		case InstructionType::LE_NN:
+		case InstructionType::GT_NN:
+		case InstructionType::GE_NN:
+		case InstructionType::CONCAT:
+			// not produced by the parser, the constant pool is ours and the
+			// interpreter quickens its own copy
+			return std::nullopt;
+		case InstructionType::LIBOOL:
+			operand = inst.i_lit != 0;
+			break;
+		case InstructionType::POPN:
+		case InstructionType::CALL:
+		case InstructionType::LIARR:
+		case InstructionType::LIOBJ:
+			if (inst.n < 0) {
+				return std::nullopt;
+			}
+			operand = inst.n;
+			break;
+		case InstructionType::JMP:
+		case InstructionType::JZ:
+		case InstructionType::JNZ:
+			operand = target(inst.idx());
+			break;
+		case InstructionType::LISTR:
+		case InstructionType::LDGLOBAL:
+		case InstructionType::STGLOBAL:
+		case InstructionType::LDLOCAL:
+		case InstructionType::STLOCAL:
+			operand = inst.idx();
+			break;
+		case InstructionType::GET:
+		case InstructionType::SET:
+			operand = res.property_names.size();
+			res.property_names.push_back(static_cast<NameIdType>(inst.idx()));
+			break;
+		default:
+			break;
+		}
+
+		if (operand > PACKED_OPERAND_MAX) {
+			return std::nullopt;
+		}
+		res.code.push_back(
+			pack_instruction(inst.type, static_cast<uint32_t>(operand)));
+		i++;
+	}
+
+	if (res.constants.size() > PACKED_OPERAND_MAX) {
+		return std::nullopt;
+	}
+	res.lines = func.lines.remapped(starts);
+	return res;
+}
+
+} // namespace cypheri
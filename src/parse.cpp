@@ -1,58 +1,89 @@
 #include "cypheri/parse.hpp"
+#include "cypheri/heap.hpp"
+#include "cypheri/optimize.hpp"
+#include "cypheri/value.hpp"
 
+#include <algorithm>
 #include <array>
+#include <bit>
 #include <cassert>
 #include <format>
 #include <limits>
-#include <memory>
-#include <stack>
+#include <span>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace cypheri {
 
 namespace {
 
+// Locals visible at the current point of a function, indexed by name id.
+// Declaring a local records the binding it shadows in an undo log, leaving
+// a scope replays the log back to where the scope started and frees the
+// slots of its locals for the next sibling scope. The arrays keep their
+// capacity across functions, so reset() costs only the names bound.
 class ScopedLocalNameTable {
 public:
 	static constexpr size_t INVALID_ID = std::numeric_limits<size_t>::max();
 
 	size_t get(NameIdType name) const noexcept {
-		auto it = local_names.find(name);
-		if (it == local_names.end()) {
+		if (name >= locals.size()) {
 			return INVALID_ID;
 		}
-
-		return it->second.top();
+		return locals[name];
 	}
 
 	size_t add(NameIdType name) noexcept {
-		auto &stk = local_names[name];
-		stk.push(next_id);
+		if (name >= locals.size()) {
+			locals.resize(std::max<size_t>(name + 1, locals.size() * 2),
+						  INVALID_ID);
+		}
+		undo_log.push_back({name, locals[name]});
+		locals[name] = next_id;
 		return next_id++;
 	}
 
 	void enter_scope() noexcept {
-		scopes.emplace();
+		scopes.push_back({undo_log.size(), next_id});
 	}
 
 	void leave_scope() noexcept {
-		for (auto name : scopes.top()) {
-			auto &stk = local_names[name];
-			stk.pop();
-			if (stk.empty()) {
-				local_names.erase(name);
-			}
-		}
-		scopes.pop();
+		unwind(scopes.back().log_size);
+		next_id = scopes.back().next_id;
+		scopes.pop_back();
 	}
 
 	size_t size() const noexcept {
 		return next_id;
 	}
 
+	void reset() noexcept {
+		unwind(0);
+		scopes.clear();
+		next_id = 0;
+	}
+
 private:
+	struct Shadowed {
+		NameIdType name;
+		size_t id;
+	};
+
+	struct Scope {
+		size_t log_size, next_id; // when the scope was entered
+	};
+
 	size_t next_id = 0;
-	std::stack<std::vector<NameIdType>> scopes;
-	SpraseNameArray<std::stack<size_t>> local_names;
+	std::vector<size_t> locals; // INVALID_ID for names not in scope
+	std::vector<Shadowed> undo_log;
+	std::vector<Scope> scopes;
+
+	void unwind(size_t log_size) noexcept {
+		while (undo_log.size() > log_size) {
+			locals[undo_log.back().name] = undo_log.back().id;
+			undo_log.pop_back();
+		}
+	}
 };
 
 enum class LvalaueType {
@@ -61,148 +92,402 @@ enum class LvalaueType {
 	COMPOUND, // Compound lvalue
 };
 
-struct ExprTreeNode {
-	virtual ~ExprTreeNode() = default;
-	virtual void emit(BytecodeFunction &func) const = 0;
-	virtual LvalaueType lvalue_type() const noexcept {
-		return LvalaueType::NONE;
-	}
-
-	virtual void emit_store(BytecodeFunction &func) const {}
+using ExprId = uint32_t;
+constexpr ExprId INVALID_EXPR = std::numeric_limits<ExprId>::max();
+
+enum class ExprTag : uint8_t {
+	LIT_NULL,
+	LIT_BOOL, // a: value
+	LIT_INT,  // a, b: low and high half of the value
+	LIT_NUM,  // a, b: low and high half of the IEEE 754 bits
+	LIT_STR,  // a: string literal index
+	LOCAL,	  // a: local index
+	GLOBAL,	  // a: name
+	UNARY,	  // a: operand
+	BINARY,	  // a, b: operands
+	CALL,	  // a: callee, b: offset of argc and arguments in call_args
 };
 
-using ExprTreeNodePtr = std::unique_ptr<ExprTreeNode>;
+// Expression nodes of the current statement, one array per field. Nodes are
+// appended after their children, so an expression occupies the contiguous
+// range from the first node created while parsing it up to its root, and a
+// forward walk over that range sees every child before its parent.
+class ExprPool {
+public:
+	std::vector<ExprTag> tags;
+	std::vector<InstructionType> ops; // UNARY and BINARY only
+	std::vector<uint32_t> a, b;
+	std::vector<ExprId> call_args;
 
-struct ExprTreeSimpleLeaf : ExprTreeNode {
-	ExprTreeSimpleLeaf(InstructionType type) : type(type) {}
+	ExprId size() const noexcept {
+		return static_cast<ExprId>(tags.size());
+	}
 
-	void emit(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(type);
+	void clear() noexcept {
+		tags.clear();
+		ops.clear();
+		a.clear();
+		b.clear();
+		call_args.clear();
 	}
 
-	InstructionType type;
-};
+	ExprId add(ExprTag tag, uint32_t x = 0, uint32_t y = 0,
+			   InstructionType op = InstructionType::NOP) noexcept {
+		tags.push_back(tag);
+		ops.push_back(op);
+		a.push_back(x);
+		b.push_back(y);
+		return size() - 1;
+	}
 
-struct ExprTreeLitInt : ExprTreeNode {
-	ExprTreeLitInt(uint64_t val) : val(val) {}
+	ExprId add_int(uint64_t val) noexcept {
+		return add(ExprTag::LIT_INT, static_cast<uint32_t>(val),
+				   static_cast<uint32_t>(val >> 32));
+	}
 
-	void emit(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(InstructionType::LII, val);
+	ExprId add_num(double val) noexcept {
+		auto bits = std::bit_cast<uint64_t>(val);
+		return add(ExprTag::LIT_NUM, static_cast<uint32_t>(bits),
+				   static_cast<uint32_t>(bits >> 32));
 	}
 
-	uint64_t val;
-};
+	ExprId add_call(ExprId callee, std::span<const ExprId> args) noexcept {
+		auto offset = static_cast<uint32_t>(call_args.size());
+		call_args.push_back(static_cast<ExprId>(args.size()));
+		call_args.insert(call_args.end(), args.begin(), args.end());
+		return add(ExprTag::CALL, callee, offset);
+	}
 
-struct ExprTreeLitNum : ExprTreeNode {
-	ExprTreeLitNum(double val) : val(val) {}
+	uint64_t bits(ExprId id) const noexcept {
+		return a[id] | static_cast<uint64_t>(b[id]) << 32;
+	}
 
-	void emit(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(InstructionType::LIN, val);
+	std::span<const ExprId> args(ExprId id) const noexcept {
+		return {call_args.data() + b[id] + 1, call_args[b[id]]};
 	}
 
-	double val;
-};
+	// Value of a literal node
+	std::optional<Value> constant(ExprId id) const noexcept;
 
-struct ExprTreeLitStr : ExprTreeNode {
-	ExprTreeLitStr(size_t str_id) : str_id(str_id) {}
+	// Overwrite a node with a literal, returns false for values without one
+	bool set_constant(ExprId id, const Value &val) noexcept;
 
-	void emit(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(InstructionType::LISTR, str_id);
+	// Make a node a copy of another one, which must not be its parent
+	void replace(ExprId id, ExprId with) noexcept {
+		tags[id] = tags[with];
+		ops[id] = ops[with];
+		a[id] = a[with];
+		b[id] = b[with];
 	}
 
-	size_t str_id;
-};
+	LvalaueType lvalue_type(ExprId id) const noexcept;
+	void emit(ExprId id, BytecodeFunction &func) const noexcept;
+	void emit_store(ExprId id, BytecodeFunction &func) const noexcept;
 
-struct ExprTreeLitBool : ExprTreeNode {
-	ExprTreeLitBool(bool val) : val(val) {}
+	// Emit code that jumps if the truthiness of the expression is jump_if
+	// and falls through otherwise, leaving the operand stack as it was. &&,
+	// || and ! become jumps, the indices of jumps still to be patched with
+	// the target are appended to jumps.
+	void emit_branch(ExprId id, bool jump_if, BytecodeFunction &func,
+					 std::vector<size_t> &jumps) const noexcept;
 
-	void emit(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(InstructionType::LIBOOL, val);
-	}
+	// Fold constant subexpressions of the expression in [first, root] and
+	// drop identity operations such as x * 1.
+	void fold(ExprId first, ExprId root) noexcept;
 
-	bool val;
+private:
+	// What fold knows about each node: its type whenever evaluating it
+	// succeeds, and whether that is an integer or a number
+	struct TypeFact {
+		std::optional<ValueType> type;
+		bool numeric;
+	};
+	std::vector<TypeFact> facts; // scratch space for fold
+
+	// Boxes integer literals and fold results that don't fit inline in a
+	// Value, only read back into the nodes
+	mutable Heap heap;
+
+	TypeFact infer(ExprId id) const noexcept;
 };
 
-struct ExprTreeLocal : ExprTreeNode {
-	ExprTreeLocal(size_t local_id) : local_id(local_id) {}
+std::optional<Value> ExprPool::constant(ExprId id) const noexcept {
+	switch (tags[id]) {
+	case ExprTag::LIT_NULL:
+		return Value();
+	case ExprTag::LIT_BOOL:
+		return Value::from_bool(a[id] != 0);
+	case ExprTag::LIT_INT:
+		return Value::from_int(static_cast<int64_t>(bits(id)), heap);
+	case ExprTag::LIT_NUM:
+		return Value::from_number(std::bit_cast<double>(bits(id)));
+	default:
+		return std::nullopt;
+	}
+}
 
-	void emit(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(InstructionType::LDLOCAL, local_id);
+bool ExprPool::set_constant(ExprId id, const Value &val) noexcept {
+	uint64_t payload = 0;
+	switch (val.type()) {
+	case ValueType::NIL:
+		tags[id] = ExprTag::LIT_NULL;
+		break;
+	case ValueType::BOOL:
+		tags[id] = ExprTag::LIT_BOOL;
+		payload = val.as_bool();
+		break;
+	case ValueType::INT:
+		tags[id] = ExprTag::LIT_INT;
+		payload = static_cast<uint64_t>(val.as_int());
+		break;
+	case ValueType::NUMBER:
+		tags[id] = ExprTag::LIT_NUM;
+		payload = std::bit_cast<uint64_t>(val.as_number());
+		break;
+	default:
+		return false;
 	}
+	a[id] = static_cast<uint32_t>(payload);
+	b[id] = static_cast<uint32_t>(payload >> 32);
+	return true;
+}
 
-	LvalaueType lvalue_type() const noexcept override {
+LvalaueType ExprPool::lvalue_type(ExprId id) const noexcept {
+	switch (tags[id]) {
+	case ExprTag::LOCAL:
+	case ExprTag::GLOBAL:
 		return LvalaueType::SIMPLE;
+	default:
+		return LvalaueType::NONE;
 	}
+}
 
-	void emit_store(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(InstructionType::STLOCAL, local_id);
+void ExprPool::emit(ExprId id, BytecodeFunction &func) const noexcept {
+	auto &code = func.instructions;
+	switch (tags[id]) {
+	case ExprTag::LIT_NULL:
+		code.emplace_back(InstructionType::LINULL);
+		break;
+	case ExprTag::LIT_BOOL:
+		code.emplace_back(InstructionType::LIBOOL, a[id] != 0);
+		break;
+	case ExprTag::LIT_INT:
+		code.emplace_back(InstructionType::LII, bits(id));
+		break;
+	case ExprTag::LIT_NUM:
+		code.emplace_back(InstructionType::LIN, std::bit_cast<double>(bits(id)));
+		break;
+	case ExprTag::LIT_STR:
+		code.emplace_back(InstructionType::LISTR, uint64_t{a[id]});
+		break;
+	case ExprTag::LOCAL:
+		code.emplace_back(InstructionType::LDLOCAL, uint64_t{a[id]});
+		break;
+	case ExprTag::GLOBAL:
+		code.emplace_back(InstructionType::LDGLOBAL, NameIdType{a[id]});
+		break;
+	case ExprTag::UNARY:
+		emit(a[id], func);
+		code.emplace_back(ops[id]);
+		break;
+	case ExprTag::BINARY:
+		if (ops[id] == InstructionType::AND || ops[id] == InstructionType::OR) {
+			// short-circuit, materializing only the final boolean
+			bool is_or = ops[id] == InstructionType::OR;
+			std::vector<size_t> jumps;
+			emit_branch(id, is_or, func, jumps);
+			code.emplace_back(InstructionType::LIBOOL, !is_or);
+			code.emplace_back(InstructionType::JMP);
+			size_t end_jump = code.size() - 1;
+			for (auto jump : jumps) {
+				code[jump].idx() = code.size();
+			}
+			code.emplace_back(InstructionType::LIBOOL, is_or);
+			code[end_jump].idx() = code.size();
+			break;
+		}
+		emit(a[id], func);
+		emit(b[id], func);
+		code.emplace_back(ops[id]);
+		break;
+	case ExprTag::CALL: {
+		auto call_args = args(id);
+		for (auto arg : call_args) {
+			emit(arg, func);
+		}
+		emit(a[id], func);
+		code.emplace_back(InstructionType::CALL,
+						  static_cast<int>(call_args.size()));
+		break;
 	}
-
-	size_t local_id;
-};
-
-struct ExprTreeGlobal : ExprTreeNode {
-	ExprTreeGlobal(NameIdType name) : name(name) {}
-
-	void emit(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(InstructionType::LDGLOBAL, name);
 	}
+}
 
-	LvalaueType lvalue_type() const noexcept override {
-		return LvalaueType::SIMPLE;
+void ExprPool::emit_branch(ExprId id, bool jump_if, BytecodeFunction &func,
+						   std::vector<size_t> &jumps) const noexcept {
+	auto &code = func.instructions;
+	if (tags[id] == ExprTag::UNARY && ops[id] == InstructionType::NOT) {
+		emit_branch(a[id], !jump_if, func, jumps);
+		return;
 	}
 
-	void emit_store(BytecodeFunction &func) const override {
-		func.instructions.emplace_back(InstructionType::STGLOBAL, name);
+	if (tags[id] == ExprTag::BINARY && (ops[id] == InstructionType::AND ||
+										ops[id] == InstructionType::OR)) {
+		// x && y is false as soon as x is, x || y true as soon as x is
+		bool decided_by = ops[id] == InstructionType::OR;
+		if (jump_if == decided_by) {
+			emit_branch(a[id], jump_if, func, jumps);
+			emit_branch(b[id], jump_if, func, jumps);
+		} else {
+			std::vector<size_t> skip;
+			emit_branch(a[id], decided_by, func, skip);
+			emit_branch(b[id], jump_if, func, jumps);
+			for (auto jump : skip) {
+				code[jump].idx() = code.size();
+			}
+		}
+		return;
 	}
 
-	NameIdType name;
-};
+	emit(id, func);
+	code.emplace_back(jump_if ? InstructionType::JNZ : InstructionType::JZ);
+	jumps.push_back(code.size() - 1);
+}
+
+void ExprPool::emit_store(ExprId id, BytecodeFunction &func) const noexcept {
+	switch (tags[id]) {
+	case ExprTag::LOCAL:
+		func.instructions.emplace_back(InstructionType::STLOCAL,
+									   uint64_t{a[id]});
+		break;
+	case ExprTag::GLOBAL:
+		func.instructions.emplace_back(InstructionType::STGLOBAL,
+									   NameIdType{a[id]});
+		break;
+	default:
+		break;
+	}
+}
 
-struct ExprTreeUnOp : ExprTreeNode {
-	ExprTreeUnOp(ExprTreeNodePtr expr, InstructionType type)
-		: expr(std::move(expr)), type(type) {}
+ExprPool::TypeFact ExprPool::infer(ExprId id) const noexcept {
+	using enum InstructionType;
 
-	void emit(BytecodeFunction &func) const override {
-		expr->emit(func);
-		func.instructions.emplace_back(type);
+	auto is_numeric_type = [](std::optional<ValueType> type) {
+		return type == ValueType::INT || type == ValueType::NUMBER;
+	};
+	if (auto val = constant(id)) {
+		return {val->type(), is_numeric_type(val->type())};
 	}
 
-	ExprTreeNodePtr expr;
-	InstructionType type;
-};
+	if (tags[id] == ExprTag::UNARY) {
+		switch (ops[id]) {
+		case NOT:
+			return {ValueType::BOOL, false};
+		case NEG:
+			return {facts[a[id]].type, true};
+		case YIELD: // whatever the coroutine is resumed with
+			return {std::nullopt, false};
+		default: // BNOT fails on everything else
+			return {ValueType::INT, true};
+		}
+	}
+	if (tags[id] != ExprTag::BINARY) {
+		return {std::nullopt, false};
+	}
 
-// Not for assignment, always left associative
-struct ExprTreeBinOp : ExprTreeNode {
-	ExprTreeBinOp(ExprTreeNodePtr lhs, ExprTreeNodePtr rhs,
-				  InstructionType type)
-		: lhs(std::move(lhs)), rhs(std::move(rhs)), type(type) {}
+	const auto &x = facts[a[id]], &y = facts[b[id]];
+	switch (ops[id]) {
+	case EQ:
+	case NE:
+	case LT:
+	case LE:
+	case GT:
+	case GE:
+	case AND:
+	case OR:
+		return {ValueType::BOOL, false};
+	case BXOR:
+	case BAND:
+	case BOR:
+	case SHL:
+	case SHR:
+		return {ValueType::INT, true};
+	case DIV:
+		return {ValueType::NUMBER, true};
+	default:
+		break;
+	}
 
-	void emit(BytecodeFunction &func) const override {
-		lhs->emit(func);
-		rhs->emit(func);
-		func.instructions.emplace_back(type);
+	// ADD may concatenate strings, the rest only succeeds on numbers
+	bool numeric = ops[id] != ADD || (x.numeric && y.numeric);
+	if (ops[id] != POW && x.type == ValueType::INT &&
+		y.type == ValueType::INT) {
+		// POW depends on the sign of the exponent
+		return {ValueType::INT, true};
+	}
+	if ((x.type == ValueType::NUMBER && y.numeric) ||
+		(y.type == ValueType::NUMBER && x.numeric)) {
+		return {ValueType::NUMBER, true};
 	}
+	return {std::nullopt, numeric};
+}
 
-	ExprTreeNodePtr lhs, rhs;
-	InstructionType type;
-};
+void ExprPool::fold(ExprId first, ExprId root) noexcept {
+	facts.resize(size());
 
-struct ExprTreeCall : ExprTreeNode {
-	ExprTreeCall(ExprTreeNodePtr func, std::vector<ExprTreeNodePtr> &&args)
-		: func(std::move(func)), args(std::move(args)) {}
+	auto is_int = [this](ExprId id, int64_t i) {
+		auto val = constant(id);
+		return val && val->type() == ValueType::INT && val->as_int() == i;
+	};
 
-	void emit(BytecodeFunction &bcfunc) const override {
-		for (auto &arg : args) {
-			arg->emit(bcfunc);
+	for (ExprId id = first; id <= root; id++) {
+		Value res;
+		if (tags[id] == ExprTag::UNARY) {
+			if (auto val = constant(a[id]);
+				val && !unary_op(ops[id], *val, res, heap)) {
+				set_constant(id, res);
+			}
+		} else if (tags[id] == ExprTag::BINARY) {
+			auto x = constant(a[id]), y = constant(b[id]);
+			if (x && y) {
+				// operations that fail are left for the runtime to report
+				if (!binary_op(ops[id], *x, *y, res, heap)) {
+					set_constant(id, res);
+				}
+			} else {
+				// Identities, only where the result is exactly the other
+				// operand: x + 0 would turn -0.0 into 0.0 and concatenate
+				// strings.
+				ExprId lhs = a[id], rhs = b[id];
+				switch (ops[id]) {
+				case InstructionType::MUL:
+					if (is_int(rhs, 1) && facts[lhs].numeric) {
+						replace(id, lhs);
+					} else if (is_int(lhs, 1) && facts[rhs].numeric) {
+						replace(id, rhs);
+					}
+					break;
+				case InstructionType::ADD:
+					if (is_int(rhs, 0) && facts[lhs].type == ValueType::INT) {
+						replace(id, lhs);
+					} else if (is_int(lhs, 0) &&
+							   facts[rhs].type == ValueType::INT) {
+						replace(id, rhs);
+					}
+					break;
+				case InstructionType::SUB:
+					if (is_int(rhs, 0) && facts[lhs].numeric) {
+						replace(id, lhs);
+					}
+					break;
+				default:
+					break;
+				}
+			}
 		}
-		func->emit(bcfunc);
-		bcfunc.instructions.emplace_back(InstructionType::CALL, args.size());
+		facts[id] = infer(id);
 	}
-
-	ExprTreeNodePtr func;
-	std::vector<ExprTreeNodePtr> args;
-};
+}
 
 consteval std::array<int, TOKEN_COUNT> make_op_precedence_table() noexcept {
 	std::array<int, TOKEN_COUNT> tb;
@@ -275,6 +560,7 @@ make_op_to_instr_table() noexcept {
 	tb[TK("&&")] = InstructionType::AND;
 	tb[TK("||")] = InstructionType::OR;
 	tb[TK("!")] = InstructionType::NOT;
+	tb[TK("_Yield")] = InstructionType::YIELD;
 	return tb;
 }
 
@@ -301,7 +587,7 @@ constexpr std::array<bool, TOKEN_COUNT> OP_IS_ASSIGNMENT_TABLE =
 
 class Parser {
 public:
-	Parser(TokenizeResult &&tk_res, NameTable *nt) noexcept;
+	Parser(TokenStream &tokens, NameTable *nt, ParseOptions options) noexcept;
 
 	bool has_error() const noexcept;
 	std::optional<SyntaxError> consume_error() noexcept;
@@ -309,18 +595,21 @@ public:
 	std::optional<BytecodeModule> parse() noexcept;
 
 private:
-	std::vector<Token> tokens;
-	size_t pos = 0;
+	TokenStream *tokens;
 	std::optional<SyntaxError> error;
-	std::vector<std::string> str_lits;
 	NameTable *name_table;
+	ParseOptions options;
 	ScopedLocalNameTable local_names;
 
-	bool eof() const noexcept;
-	const Token &peek(size_t offset = 0) const noexcept;
-	Token &consume() noexcept;
+	// Expressions of the current statement
+	ExprPool exprs;
+	std::vector<ExprId> value_stack; // for parse_value_list
+
+	bool eof() noexcept;
+	const Token &peek(size_t offset = 0) noexcept;
+	Token consume() noexcept;
 	bool match(TokenType type) noexcept;
-	Token &expect(TokenType type) noexcept;
+	Token expect(TokenType type) noexcept;
 
 	std::optional<BytecodeFunction> parse_function() noexcept;
 	bool parse_block(BytecodeFunction &func, bool if_block = false) noexcept;
@@ -328,34 +617,37 @@ private:
 	bool parse_declare(BytecodeFunction &func) noexcept;
 
 	bool parse_if_else(BytecodeFunction &func) noexcept;
-	bool parse_if_cond(BytecodeFunction &func, std::vector<size_t> &then_jmps,
-					   std::vector<size_t> &else_jmps) noexcept;
 
 	bool parse_assign(BytecodeFunction &func) noexcept;
 	bool parse_expr(BytecodeFunction &func, int precedence = 0) noexcept;
-
-	ExprTreeNodePtr parse_expr_et(int precedence = 0) noexcept;
-	ExprTreeNodePtr parse_expr_bin(int precedence = 0) noexcept;
-	ExprTreeNodePtr parse_expr_un() noexcept;
-	ExprTreeNodePtr parse_expr_primary() noexcept;
-	bool parse_value_list(std::vector<ExprTreeNodePtr> &values,
+	bool parse_cond_expr(BytecodeFunction &func,
+						 std::vector<size_t> &false_jumps) noexcept;
+	void fold(ExprId first, ExprId root) noexcept;
+
+	ExprId parse_expr_et(int precedence = 0) noexcept;
+	ExprId parse_expr_bin(int precedence = 0) noexcept;
+	ExprId parse_expr_un() noexcept;
+	ExprId parse_expr_primary() noexcept;
+	bool parse_value_list(std::vector<ExprId> &values,
 						  TokenType term = TK(")")) noexcept;
 };
 
-Parser::Parser(TokenizeResult &&tk_res, NameTable *nt) noexcept
-	: tokens(std::move(tk_res.tokens)), error(std::move(tk_res.error)),
-	  str_lits(tk_res.str_literals), name_table(nt) {}
+Parser::Parser(TokenStream &tokens, NameTable *nt,
+			   ParseOptions options) noexcept
+	: tokens(&tokens), name_table(nt), options(options) {}
 
-bool Parser::eof() const noexcept {
-	return tokens[pos].type == TK("(eof)");
+// A lexical error ends the token stream as well
+bool Parser::eof() noexcept {
+	auto type = tokens->peek().type;
+	return type == TK("(eof)") || type == TK("(error)");
 }
 
-const Token &Parser::peek(size_t offset) const noexcept {
-	return tokens[pos + offset];
+const Token &Parser::peek(size_t offset) noexcept {
+	return tokens->peek(offset);
 }
 
-Token &Parser::consume() noexcept {
-	return eof() ? tokens[pos] : tokens[pos++];
+Token Parser::consume() noexcept {
+	return tokens->consume();
 }
 
 bool Parser::match(TokenType type) noexcept {
@@ -366,8 +658,8 @@ bool Parser::match(TokenType type) noexcept {
 	return false;
 }
 
-Token &Parser::expect(TokenType type) noexcept {
-	auto &token = consume();
+Token Parser::expect(TokenType type) noexcept {
+	auto token = consume();
 	if (token.type != type) {
 		error.emplace(std::format("expected {}, got {}", TOKEN_TYPE_NAMES[type],
 								  TOKEN_TYPE_NAMES[token.type]),
@@ -377,10 +669,15 @@ Token &Parser::expect(TokenType type) noexcept {
 }
 
 bool Parser::has_error() const noexcept {
-	return error.has_value();
+	return error.has_value() || tokens->error().has_value();
 }
 
+// The parser only ever runs into the (error) token after the tokenizer
+// failed, so its own complaint about that token is not interesting.
 std::optional<SyntaxError> Parser::consume_error() noexcept {
+	if (tokens->error().has_value()) {
+		return std::move(tokens->error());
+	}
 	if (error.has_value()) {
 		return std::move(error);
 	}
@@ -397,15 +694,29 @@ std::optional<BytecodeModule> Parser::parse() noexcept {
 	while (!eof()) {
 		const auto &tk = peek();
 		switch (tk.type) {
-		case TK("Function"):
+		case TK("Function"): {
+			size_t begin = tk.offset;
+			uint32_t line = tk.loc.line;
 			if (auto func = parse_function()) {
+				if (options.opt_level >= 1) {
+					size_t removed = peephole_optimize(*func);
+					if (options.stats) {
+						options.stats->peephole_removed += removed;
+					}
+				}
+
 				// copy name, or it will be use-after-move
 				auto name = func->name;
 				mod.functions[name] = std::move(*func);
+				if (options.layout) {
+					options.layout->functions.push_back(
+						{name, begin, peek().offset, line});
+				}
 			} else {
 				return std::nullopt;
 			}
 			break;
+		}
 		case TK("Declare"):
 			// TODO: parse global variable declarations
 			error.emplace("global variable declarations not implemented yet",
@@ -423,8 +734,16 @@ std::optional<BytecodeModule> Parser::parse() noexcept {
 			return std::nullopt;
 		}
 	}
+	if (has_error()) {
+		return std::nullopt;
+	}
+	if (options.layout) {
+		options.layout->source_size = peek().offset;
+	}
 
-	mod.str_lits = std::move(str_lits);
+	// the only copy of each distinct literal
+	const auto &strs = tokens->str_literals();
+	mod.str_lits.assign(strs.begin(), strs.end());
 	return mod;
 }
 
@@ -432,7 +751,7 @@ std::optional<BytecodeFunction> Parser::parse_function() noexcept {
 	if (has_error()) {
 		return std::nullopt;
 	}
-	local_names = ScopedLocalNameTable();
+	local_names.reset();
 
 	BytecodeFunction func;
 	expect(TK("Function"));
@@ -452,7 +771,7 @@ std::optional<BytecodeFunction> Parser::parse_function() noexcept {
 
 	if (!match(TK(")"))) {
 		while (true) {
-			auto &token = expect(TK("(identifier)"));
+			auto token = expect(TK("(identifier)"));
 			if (has_error()) {
 				return std::nullopt;
 			}
@@ -483,6 +802,24 @@ std::optional<BytecodeFunction> Parser::parse_function() noexcept {
 		return std::nullopt;
 	}
 
+	// Falling off the end returns NULL, make it explicit so that the
+	// interpreter never runs past the last instruction.
+	auto &code = func.instructions;
+	bool falls_through = code.empty() ||
+						 (code.back().type != InstructionType::RET &&
+						  code.back().type != InstructionType::RETNULL);
+	for (const auto &inst : code) {
+		if ((inst.type == InstructionType::JMP ||
+			 inst.type == InstructionType::JZ ||
+			 inst.type == InstructionType::JNZ) &&
+			inst.idx() == code.size()) {
+			falls_through = true;
+		}
+	}
+	if (falls_through) {
+		code.emplace_back(InstructionType::RETNULL);
+	}
+
 	return func;
 }
 
@@ -501,7 +838,9 @@ bool Parser::parse_block(BytecodeFunction &func, bool if_block) noexcept {
 			(peek().type == TK("Else") || peek().type == TK("ElseIf") ||
 			 peek().type == TK("End"))) {
 			break;
-		} else if (match(TK("End"))) {
+		} else if (peek().type == TK("End")) {
+			// a function's implicit RETNULL goes after its End
+			func.lines.add(func.instructions.size(), consume().loc);
 			break;
 		}
 
@@ -515,6 +854,11 @@ bool Parser::parse_block(BytecodeFunction &func, bool if_block) noexcept {
 }
 
 bool Parser::parse_statement(BytecodeFunction &func) noexcept {
+	// the previous statement is emitted already, statements nested
+	// in blocks only start after their parent's expressions are done
+	exprs.clear();
+	func.lines.add(func.instructions.size(), peek().loc);
+
 	switch (peek().type) {
 	case TK("Declare"):
 		return parse_declare(func);
@@ -539,14 +883,16 @@ bool Parser::parse_statement(BytecodeFunction &func) noexcept {
 }
 
 bool Parser::parse_assign(BytecodeFunction &func) noexcept {
+	ExprId first = exprs.size();
 	auto lhs = parse_expr_et();
-	if (!lhs) {
+	if (lhs == INVALID_EXPR) {
 		return false;
 	}
 
 	if (match(TK(";"))) {
 		// this is not an assignment, just an expression
-		lhs->emit(func);
+		fold(first, lhs);
+		exprs.emit(lhs, func);
 		func.instructions.emplace_back(InstructionType::POPN, 1);
 		return true;
 	}
@@ -556,8 +902,8 @@ bool Parser::parse_assign(BytecodeFunction &func) noexcept {
 		return false;
 	}
 
-	auto &tk = consume();
-	auto type = lhs->lvalue_type();
+	auto tk = consume();
+	auto type = exprs.lvalue_type(lhs);
 	if (type == LvalaueType::NONE) {
 		error.emplace("cannot assign to rvalue", tk.loc);
 		return false;
@@ -569,12 +915,12 @@ bool Parser::parse_assign(BytecodeFunction &func) noexcept {
 
 	if (type == LvalaueType::SIMPLE) {
 		if (tk.type == TK("=")) {
-			lhs->emit_store(func);
+			exprs.emit_store(lhs, func);
 		} else {
-			lhs->emit(func);
+			exprs.emit(lhs, func);
 			func.instructions.emplace_back(InstructionType::SWP);
 			func.instructions.emplace_back(OP_TO_INSTR_TABLE[tk.type]);
-			lhs->emit_store(func);
+			exprs.emit_store(lhs, func);
 		}
 	} else {
 		// TODO: implement this
@@ -596,7 +942,7 @@ bool Parser::parse_declare(BytecodeFunction &func) noexcept {
 	}
 
 	while (true) {
-		auto &token = expect(TK("(identifier)"));
+		auto token = expect(TK("(identifier)"));
 		if (has_error()) {
 			return false;
 		}
@@ -609,15 +955,20 @@ bool Parser::parse_declare(BytecodeFunction &func) noexcept {
 			return false;
 		}
 
-		local_names.add(id);
-		func.local_count++;
+		// a slot freed by a sibling scope still holds that scope's value,
+		// which the initializer could read through the new name as well
+		size_t slot = local_names.add(id);
+		if (slot < func.local_count) {
+			func.instructions.emplace_back(InstructionType::LINULL);
+			func.instructions.emplace_back(InstructionType::STLOCAL, slot);
+		}
+		func.local_count = std::max(func.local_count, slot + 1);
 
 		if (match(TK("="))) {
 			if (!parse_expr(func)) {
 				return false;
 			}
-			func.instructions.emplace_back(InstructionType::LDLOCAL,
-										   func.local_count - 1);
+			func.instructions.emplace_back(InstructionType::STLOCAL, slot);
 		}
 
 		if (!match(TK(";"))) {
@@ -638,8 +989,8 @@ bool Parser::parse_if_else(BytecodeFunction &func) noexcept {
 		return false;
 	}
 
-	std::vector<size_t> then_jumps, else_jumps;
-	if (!parse_if_cond(func, then_jumps, else_jumps)) {
+	std::vector<size_t> else_jumps;
+	if (!parse_cond_expr(func, else_jumps)) {
 		return false;
 	}
 	expect(TK("Then"));
@@ -647,10 +998,6 @@ bool Parser::parse_if_else(BytecodeFunction &func) noexcept {
 		return false;
 	}
 
-	for (auto jump : then_jumps) {
-		func.instructions[jump].idx() = func.instructions.size();
-	}
-
 	if (!parse_block(func, true)) {
 		return false;
 	}
@@ -664,9 +1011,10 @@ bool Parser::parse_if_else(BytecodeFunction &func) noexcept {
 		func.instructions[jump].idx() = func.instructions.size();
 	}
 
-	while (match(TK("ElseIf"))) {
-		std::vector<size_t> ei_then_jumps, ei_else_jumps;
-		if (!parse_if_cond(func, ei_then_jumps, ei_else_jumps)) {
+	while (peek().type == TK("ElseIf")) {
+		func.lines.add(func.instructions.size(), consume().loc);
+		std::vector<size_t> ei_else_jumps;
+		if (!parse_cond_expr(func, ei_else_jumps)) {
 			return false;
 		}
 		expect(TK("Then"));
@@ -674,10 +1022,6 @@ bool Parser::parse_if_else(BytecodeFunction &func) noexcept {
 			return false;
 		}
 
-		for (auto jump : ei_then_jumps) {
-			func.instructions[jump].idx() = func.instructions.size();
-		}
-
 		if (!parse_block(func, true)) {
 			return false;
 		}
@@ -710,96 +1054,107 @@ bool Parser::parse_if_else(BytecodeFunction &func) noexcept {
 	return true;
 }
 
-bool Parser::parse_if_cond(BytecodeFunction &func,
-						   std::vector<size_t> &then_jmps,
-						   std::vector<size_t> &else_jmps) noexcept {
-	do {
-		// parse expr without || and &&
-		if (!parse_expr(func, OP_PRECEDENCE_TABLE[TK("||")] + 1)) {
-			return false;
-		}
-
-		if (match(TK("||"))) {
-			func.instructions.emplace_back(InstructionType::JNZ);
-			then_jmps.push_back(func.instructions.size() - 1);
-		} else if (match(TK("&&"))) {
-			func.instructions.emplace_back(InstructionType::JZ);
-			else_jmps.push_back(func.instructions.size() - 1);
-		}
-	} while (peek().type != TK("Then"));
-
-	// last branch
-	func.instructions.emplace_back(InstructionType::JZ);
-	else_jmps.push_back(func.instructions.size() - 1);
-
+bool Parser::parse_expr(BytecodeFunction &func, int precedence) noexcept {
+	ExprId first = exprs.size();
+	ExprId expr = parse_expr_et(precedence);
+	if (expr == INVALID_EXPR) {
+		return false;
+	}
+	fold(first, expr);
+	exprs.emit(expr, func);
 	return true;
 }
 
-bool Parser::parse_expr(BytecodeFunction &func, int precedence) noexcept {
-	ExprTreeNodePtr expr = parse_expr_et(precedence);
-	if (!expr) {
+// Condition that falls through when true, jumps added to false_jumps are
+// taken when false
+bool Parser::parse_cond_expr(BytecodeFunction &func,
+							 std::vector<size_t> &false_jumps) noexcept {
+	ExprId first = exprs.size();
+	ExprId expr = parse_expr_et();
+	if (expr == INVALID_EXPR) {
 		return false;
 	}
-	expr->emit(func);
+	fold(first, expr);
+	exprs.emit_branch(expr, false, func, false_jumps);
 	return true;
 }
 
-ExprTreeNodePtr Parser::parse_expr_et(int precedence) noexcept {
+void Parser::fold(ExprId first, ExprId root) noexcept {
+	if (options.fold_constants) {
+		exprs.fold(first, root);
+	}
+}
+
+ExprId Parser::parse_expr_et(int precedence) noexcept {
 	return parse_expr_bin(precedence); // For now, only binary operators
 }
 
-ExprTreeNodePtr Parser::parse_expr_bin(int precedence) noexcept {
+ExprId Parser::parse_expr_bin(int precedence) noexcept {
 	auto left = parse_expr_un();
-	if (!left) {
-		return nullptr;
+	if (left == INVALID_EXPR) {
+		return INVALID_EXPR;
 	}
 
 	while (OP_PRECEDENCE_TABLE[peek().type] >= precedence) {
-		auto &op = consume();
+		auto op = consume();
 		if (op.type == TK("(")) {
-			// function call
-			std::vector<ExprTreeNodePtr> args;
-			if (!parse_value_list(args)) {
-				return nullptr;
+			// function call, the arguments are collected above those of any
+			// enclosing call
+			size_t base = value_stack.size();
+			if (!parse_value_list(value_stack)) {
+				value_stack.resize(base);
+				return INVALID_EXPR;
 			}
 
 			// closing parenthesis already consumed by parse_value_list
-			left = std::make_unique<ExprTreeCall>(std::move(left),
-												  std::move(args));
+			left = exprs.add_call(
+				left, std::span<const ExprId>(value_stack).subspan(base));
+			value_stack.resize(base);
 		} else {
-			auto right = parse_expr_bin(OP_PRECEDENCE_TABLE[op.type]);
-			if (!right) {
-				return nullptr;
+			// ** is right associative, everything else left associative
+			int prec = OP_PRECEDENCE_TABLE[op.type];
+			auto right =
+				parse_expr_bin(op.type == TK("**") ? prec : prec + 1);
+			if (right == INVALID_EXPR) {
+				return INVALID_EXPR;
 			}
-			left = std::make_unique<ExprTreeBinOp>(
-				std::move(left), std::move(right), OP_TO_INSTR_TABLE[op.type]);
+			left = exprs.add(ExprTag::BINARY, left, right,
+							 OP_TO_INSTR_TABLE[op.type]);
 		}
 	}
 	return left;
 }
 
-ExprTreeNodePtr Parser::parse_expr_un() noexcept {
+ExprId Parser::parse_expr_un() noexcept {
 	switch (peek().type) {
 	case TK("-"):
-		return std::make_unique<ExprTreeUnOp>(parse_expr_un(),
-											  InstructionType::NEG);
 	case TK("!"):
 	case TK("~"):
-		return std::make_unique<ExprTreeUnOp>(parse_expr_un(),
-											  OP_TO_INSTR_TABLE[peek().type]);
+	case TK("_Yield"): {
+		// - maps to SUB as a binary operator
+		auto op = consume().type;
+		auto type = op == TK("-") ? InstructionType::NEG : OP_TO_INSTR_TABLE[op];
+
+		// calls bind tighter, -f(x) negates the result of the call
+		auto expr = parse_expr_bin(OP_PRECEDENCE_TABLE[TK("(")]);
+		if (expr == INVALID_EXPR) {
+			return INVALID_EXPR;
+		}
+		return exprs.add(ExprTag::UNARY, expr, 0, type);
+	}
 	default:
 		return parse_expr_primary();
 	}
 }
 
-bool Parser::parse_value_list(std::vector<ExprTreeNodePtr> &values,
+bool Parser::parse_value_list(std::vector<ExprId> &values,
 							  TokenType term) noexcept {
 	while (!match(term)) {
 		auto arg = parse_expr_et();
-		if (!arg) {
+		if (arg == INVALID_EXPR) {
 			return false;
 		}
-		values.push_back(std::move(arg));
+		values.push_back(arg);
 
 		// we accept trailing commas
 		if (peek().type != term) {
@@ -812,56 +1167,58 @@ bool Parser::parse_value_list(std::vector<ExprTreeNodePtr> &values,
 	return true;
 }
 
-ExprTreeNodePtr Parser::parse_expr_primary() noexcept {
+ExprId Parser::parse_expr_primary() noexcept {
 	switch (peek().type) {
 	case TK("("): {
 		// ( expr )
 		consume();
 		auto expr = parse_expr_et(0);
-		if (!expr) {
-			return nullptr;
+		if (expr == INVALID_EXPR) {
+			return INVALID_EXPR;
 		}
 		expect(TK(")"));
 		if (has_error()) {
-			return nullptr;
+			return INVALID_EXPR;
 		}
 		return expr;
 	}
 	case TK("(identifier)"): {
-		auto &tk = consume();
+		auto tk = consume();
 		auto local_id = local_names.get(tk.id);
 		if (local_id == ScopedLocalNameTable::INVALID_ID) {
-			return std::make_unique<ExprTreeGlobal>(tk.id);
+			return exprs.add(ExprTag::GLOBAL, tk.id);
 		}
-		return std::make_unique<ExprTreeLocal>(local_id);
+		return exprs.add(ExprTag::LOCAL, static_cast<uint32_t>(local_id));
 	}
 	case TK("TRUE"):
 		consume();
-		return std::make_unique<ExprTreeLitBool>(true);
+		return exprs.add(ExprTag::LIT_BOOL, true);
 	case TK("FALSE"):
 		consume();
-		return std::make_unique<ExprTreeLitBool>(false);
+		return exprs.add(ExprTag::LIT_BOOL, false);
 	case TK("NULL"):
 		consume();
-		return std::make_unique<ExprTreeSimpleLeaf>(InstructionType::LINULL);
+		return exprs.add(ExprTag::LIT_NULL);
 	case TK("(integer)"):
-		return std::make_unique<ExprTreeLitInt>(consume().integer);
+		return exprs.add_int(consume().integer);
 	case TK("(number)"):
-		return std::make_unique<ExprTreeLitNum>(consume().num);
+		return exprs.add_num(consume().num);
 	case TK("(string)"):
-		return std::make_unique<ExprTreeLitStr>(consume().str_idx);
+		return exprs.add(ExprTag::LIT_STR,
+						 static_cast<uint32_t>(consume().str_idx));
 	default:
 		break;
 	}
 	error.emplace("primary expression expected", peek().loc);
-	return nullptr;
+	return INVALID_EXPR;
 }
 
 } // namespace
 
 std::variant<BytecodeModule, SyntaxError>
-parse(TokenizeResult &&tk_res, NameTable &name_table) noexcept {
-	Parser parser(std::move(tk_res), &name_table);
+parse(TokenStream &tokens, NameTable &name_table,
+	  ParseOptions options) noexcept {
+	Parser parser(tokens, &name_table, options);
 	if (auto m = parser.parse()) {
 		return std::move(*m);
 	} else {
@@ -869,4 +1226,147 @@ parse(TokenizeResult &&tk_res, NameTable &name_table) noexcept {
 	}
 }
 
+std::variant<BytecodeModule, SyntaxError>
+parse(TokenizeResult &&tk_res, NameTable &name_table,
+	  ParseOptions options) noexcept {
+	TokenStream tokens(std::move(tk_res));
+	return parse(tokens, name_table, options);
+}
+
+std::optional<SyntaxError> reparse(BytecodeModule &mod, SourceLayout &layout,
+								   std::string_view source, SourceEdit edit,
+								   NameTable &name_table,
+								   ParseOptions options) noexcept {
+	auto &spans = layout.functions;
+	size_t edit_end = edit.begin + edit.removed;
+	if (edit_end > layout.source_size ||
+		source.size() != layout.source_size - edit.removed + edit.inserted) {
+		return SyntaxError("edit does not match the source", {0, 0});
+	}
+
+	// Functions [first, last) touch the edit. The region re-parsed runs from
+	// the end of the one before them to the start of the one after, in old
+	// offsets, so it covers the whitespace around the edit as well.
+	size_t first = 0;
+	while (first < spans.size() && spans[first].end < edit.begin) {
+		first++;
+	}
+	size_t last = first;
+	while (last < spans.size() && spans[last].begin <= edit_end) {
+		last++;
+	}
+	// A function starting on the line the edit ends on moves by columns as
+	// well, so it is re-parsed too, and the ones after only move by lines
+	size_t new_edit_end = edit.begin + edit.inserted;
+	while (last < spans.size()) {
+		size_t begin = spans[last].begin - edit.removed + edit.inserted;
+		if (source.substr(new_edit_end, begin - new_edit_end).find('\n') !=
+			std::string_view::npos) {
+			break;
+		}
+		last++;
+	}
+	// Re-parsing a function decides which definition of its name wins, so
+	// every other definition of a name the region has or had is re-parsed
+	// along with it, and the last one wins as in a full parse
+	size_t region_begin, region_end;
+	SourceLayout region_layout;
+	std::variant<BytecodeModule, SyntaxError> res;
+	for (;;) {
+		region_begin = first > 0 ? spans[first - 1].end : 0;
+		region_end = last < spans.size() ? spans[last].begin
+										 : layout.source_size;
+		region_end = region_end - edit.removed + edit.inserted;
+
+		region_layout = {};
+		options.layout = &region_layout;
+		TokenStream tokens(source.substr(0, region_end), name_table,
+						   region_begin);
+		res = parse(tokens, name_table, options);
+		if (auto err = std::get_if<SyntaxError>(&res)) {
+			return std::move(*err);
+		}
+
+		std::unordered_set<NameIdType> names;
+		for (size_t i = first; i < last; i++) {
+			names.insert(spans[i].name);
+		}
+		for (auto &span : region_layout.functions) {
+			names.insert(span.name);
+		}
+		size_t wide_first = first, wide_last = last;
+		for (size_t i = 0; i < spans.size(); i++) {
+			if ((i < first || i >= last) && names.contains(spans[i].name)) {
+				wide_first = std::min(wide_first, i);
+				wide_last = std::max(wide_last, i + 1);
+			}
+		}
+		if (wide_first == first && wide_last == last) {
+			break;
+		}
+		first = wide_first;
+		last = wide_last;
+	}
+	auto &region = std::get<BytecodeModule>(res);
+
+	// functions after the region only moved, by the lines the edit added
+	int64_t line_delta = 0;
+	if (last < spans.size()) {
+		auto new_line = 1 + std::count(source.begin(),
+									   source.begin() + region_end, '\n');
+		line_delta = new_line - int64_t{spans[last].line};
+	}
+
+	for (size_t i = first; i < last; i++) {
+		mod.functions.erase(spans[i].name);
+	}
+
+	// literals of the region reuse equal existing ones, or go after them,
+	// reserved up front so that the views in str_index stay valid
+	mod.str_lits.reserve(mod.str_lits.size() + region.str_lits.size());
+	std::unordered_map<std::string_view, size_t> str_index;
+	for (size_t i = 0; i < mod.str_lits.size(); i++) {
+		str_index.emplace(mod.str_lits[i], i);
+	}
+	std::vector<size_t> str_remap;
+	for (auto &str : region.str_lits) {
+		if (auto it = str_index.find(str); it != str_index.end()) {
+			str_remap.push_back(it->second);
+			continue;
+		}
+		mod.str_lits.push_back(std::move(str));
+		str_index.emplace(mod.str_lits.back(), mod.str_lits.size() - 1);
+		str_remap.push_back(mod.str_lits.size() - 1);
+	}
+	for (auto &[name, func] : region.functions) {
+		for (auto &inst : func.instructions) {
+			if (inst.type == InstructionType::LISTR) {
+				inst.idx() = str_remap[inst.idx()];
+			}
+		}
+		mod.functions[name] = std::move(func);
+	}
+
+	// all definitions of a name after the region move by the same lines, and
+	// the module holds only the last one
+	std::unordered_set<NameIdType> shifted;
+	std::vector<FunctionSpan> patched(spans.begin(), spans.begin() + first);
+	patched.insert(patched.end(), region_layout.functions.begin(),
+				   region_layout.functions.end());
+	for (size_t i = last; i < spans.size(); i++) {
+		auto span = spans[i];
+		span.begin = span.begin - edit.removed + edit.inserted;
+		span.end = span.end - edit.removed + edit.inserted;
+		span.line = static_cast<uint32_t>(span.line + line_delta);
+		auto *func = mod.functions.find(span.name);
+		if (func && line_delta != 0 && shifted.insert(span.name).second) {
+			func->lines.shift_lines(line_delta);
+		}
+		patched.push_back(span);
+	}
+	spans = std::move(patched);
+	layout.source_size = source.size();
+	return std::nullopt;
+}
+
 } // namespace cypheri
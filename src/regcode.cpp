@@ -0,0 +1,386 @@
+#include "cypheri/regcode.hpp"
+#include <algorithm>
+#include <bit>
+#include <limits>
+
+namespace cypheri {
+
+RegisterInstruction::RegisterInstruction(InstructionType type, uint16_t a,
+										 uint32_t k) noexcept
+	: type(type), a(a), k(k) {}
+
+RegisterInstruction::RegisterInstruction(InstructionType type, uint16_t a,
+										 uint16_t b, uint16_t c) noexcept
+	: type(type), a(a), k(b | (static_cast<uint32_t>(c) << 16)) {}
+
+namespace {
+
+constexpr size_t NO_PRODUCER = std::numeric_limits<size_t>::max();
+
+// Walks the stack code while tracking which register currently holds each
+// operand stack slot. Loads of locals just push the local's register, so
+// most LDLOCALs vanish, and a store right after the instruction computing
+// its value retargets that instruction's destination. Slots are moved back
+// to their home registers (local_count + depth) wherever control flow merges
+// or a call needs its arguments laid out consecutively.
+class RegisterLowering {
+public:
+	RegisterLowering(const BytecodeFunction &func,
+					 const std::vector<int> &depths, size_t max_depth) noexcept
+		: func(func), depths(depths), local_count(func.local_count),
+		  scratch(func.local_count + max_depth) {}
+
+	bool run(RegisterFunction &res) noexcept;
+
+private:
+	const BytecodeFunction &func;
+	const std::vector<int> &depths;
+	size_t local_count, scratch;
+
+	std::vector<RegisterInstruction> code;
+	std::vector<uint64_t> constants;
+	std::vector<uint16_t> slots; // register holding each stack slot
+	std::vector<size_t> starts;	 // first register instruction of each one
+	std::vector<size_t> jumps;	 // jumps whose target needs remapping
+	size_t producer = NO_PRODUCER; // instruction defining the top slot
+
+	uint16_t home(size_t depth) const noexcept {
+		return static_cast<uint16_t>(local_count + depth);
+	}
+
+	void emit(RegisterInstruction inst) noexcept {
+		code.push_back(inst);
+		producer = NO_PRODUCER;
+	}
+
+	// Emit an instruction writing a new top slot
+	void emit_def(InstructionType type, uint32_t k) noexcept;
+
+	uint32_t add_constant(uint64_t bits) noexcept {
+		constants.push_back(bits);
+		return static_cast<uint32_t>(constants.size() - 1);
+	}
+
+	bool referenced(uint16_t reg, size_t below) const noexcept {
+		return std::find(slots.begin(), slots.begin() + below, reg) !=
+			   slots.begin() + below;
+	}
+
+	// Make sure writing reg doesn't clobber one of the first live slots
+	void prepare_write(uint16_t reg, size_t live) noexcept {
+		if (referenced(reg, live)) {
+			flush(0);
+		}
+	}
+
+	void flush(size_t lo) noexcept;
+};
+
+void RegisterLowering::emit_def(InstructionType type, uint32_t k) noexcept {
+	uint16_t dst = home(slots.size());
+	prepare_write(dst, slots.size());
+	code.emplace_back(type, dst, k);
+	slots.push_back(dst);
+	producer = code.size() - 1;
+}
+
+// Move slots [lo, top) into their home registers. This is a parallel move,
+// cycles (left behind by SWP and ROT3) are broken with the scratch register.
+void RegisterLowering::flush(size_t lo) noexcept {
+	// the moves below would clobber lower slots still reading those homes
+	for (size_t i = 0; i < lo; i++) {
+		if (slots[i] >= home(lo) && slots[i] != home(i)) {
+			lo = 0;
+			break;
+		}
+	}
+
+	struct Move {
+		uint16_t dst, src;
+	};
+	std::vector<Move> pending;
+	for (size_t i = lo; i < slots.size(); i++) {
+		if (slots[i] != home(i)) {
+			pending.push_back({home(i), slots[i]});
+		}
+		slots[i] = home(i);
+	}
+
+	while (!pending.empty()) {
+		bool progress = false;
+		for (size_t i = 0; i < pending.size();) {
+			uint16_t dst = pending[i].dst;
+			bool blocked = std::any_of(
+				pending.begin(), pending.end(),
+				[dst](const Move &m) { return m.src == dst && m.dst != dst; });
+			if (blocked) {
+				i++;
+				continue;
+			}
+			if (pending[i].src != dst) {
+				emit(RegisterInstruction(InstructionType::MOV, dst,
+										 pending[i].src, 0));
+			}
+			pending.erase(pending.begin() + i);
+			progress = true;
+		}
+
+		if (!progress) {
+			// every destination is still read by another move
+			uint16_t saved = pending.front().dst;
+			emit(RegisterInstruction(InstructionType::MOV,
+									 static_cast<uint16_t>(scratch), saved, 0));
+			for (auto &m : pending) {
+				if (m.src == saved) {
+					m.src = static_cast<uint16_t>(scratch);
+				}
+			}
+		}
+	}
+	producer = NO_PRODUCER;
+}
+
+bool RegisterLowering::run(RegisterFunction &res) noexcept {
+	const auto &insts = func.instructions;
+	std::vector<bool> is_target(insts.size(), false);
+	for (size_t i = 0; i < insts.size(); i++) {
+		switch (insts[i].type) {
+		case InstructionType::JMP:
+		case InstructionType::JZ:
+		case InstructionType::JNZ:
+			if (depths[i] != -1) {
+				is_target[insts[i].idx()] = true;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	starts.resize(insts.size());
+	bool falls_through = true;
+	for (size_t i = 0; i < insts.size(); i++) {
+		if (depths[i] == -1) {
+			starts[i] = code.size();
+			continue;
+		}
+
+		if (is_target[i]) {
+			if (falls_through) {
+				flush(0);
+			}
+			slots.clear();
+			for (int d = 0; d < depths[i]; d++) {
+				slots.push_back(home(d));
+			}
+			producer = NO_PRODUCER;
+		}
+		starts[i] = code.size();
+		falls_through = true;
+
+		const auto &inst = insts[i];
+		size_t d = slots.size();
+		switch (inst.type) {
+		case InstructionType::NOP:
+			break;
+
+		case InstructionType::LII: {
+			auto val = static_cast<int64_t>(inst.i_lit);
+			if (val >= std::numeric_limits<int32_t>::min() &&
+				val <= std::numeric_limits<int32_t>::max()) {
+				emit_def(InstructionType::LII, static_cast<uint32_t>(val));
+			} else {
+				emit_def(InstructionType::LIIW, add_constant(inst.i_lit));
+			}
+			break;
+		}
+		case InstructionType::LIN:
+			emit_def(InstructionType::LIN,
+					 add_constant(std::bit_cast<uint64_t>(inst.f_lit)));
+			break;
+		case InstructionType::LINULL:
+			emit_def(InstructionType::LINULL, 0);
+			break;
+		case InstructionType::LIBOOL:
+			emit_def(InstructionType::LIBOOL, inst.i_lit != 0);
+			break;
+		case InstructionType::LISTR:
+		case InstructionType::LDGLOBAL:
+			if (inst.idx() > std::numeric_limits<uint32_t>::max()) {
+				return false;
+			}
+			emit_def(inst.type, static_cast<uint32_t>(inst.idx()));
+			break;
+
+		case InstructionType::LDLOCAL:
+			slots.push_back(static_cast<uint16_t>(inst.idx()));
+			producer = NO_PRODUCER;
+			break;
+
+		case InstructionType::STLOCAL: {
+			auto dst = static_cast<uint16_t>(inst.idx());
+			if (referenced(dst, d - 1)) {
+				flush(0);
+			}
+			uint16_t src = slots.back();
+			slots.pop_back();
+			if (producer == code.size() - 1 && src == home(d - 1)) {
+				code.back().a = dst;
+			} else if (src != dst) {
+				emit(RegisterInstruction(InstructionType::MOV, dst, src, 0));
+			}
+			producer = NO_PRODUCER;
+			break;
+		}
+		case InstructionType::STGLOBAL:
+			emit(RegisterInstruction(InstructionType::STGLOBAL, slots.back(),
+									 static_cast<uint32_t>(inst.idx())));
+			slots.pop_back();
+			break;
+
+		case InstructionType::POPN:
+			slots.resize(d - inst.n);
+			producer = NO_PRODUCER;
+			break;
+		case InstructionType::SWP:
+			std::swap(slots[d - 1], slots[d - 2]);
+			producer = NO_PRODUCER;
+			break;
+		case InstructionType::ROT3:
+			std::rotate(slots.end() - 3, slots.end() - 1, slots.end());
+			producer = NO_PRODUCER;
+			break;
+		case InstructionType::DUP:
+			slots.push_back(slots.back());
+			producer = NO_PRODUCER;
+			break;
+
+		case InstructionType::NEG:
+		case InstructionType::NOT:
+		case InstructionType::BNOT: {
+			uint16_t dst = home(d - 1);
+			prepare_write(dst, d - 1);
+			uint16_t src = slots.back();
+			code.emplace_back(inst.type, dst, src, 0);
+			slots.back() = dst;
+			producer = code.size() - 1;
+			break;
+		}
+
+		case InstructionType::JMP:
+			flush(0);
+			emit(RegisterInstruction(InstructionType::JMP, 0,
+									 static_cast<uint32_t>(inst.idx())));
+			jumps.push_back(code.size() - 1);
+			falls_through = false;
+			break;
+		case InstructionType::JZ:
+		case InstructionType::JNZ: {
+			uint16_t cond = slots.back();
+			if (cond < local_count) {
+				// locals are never written by flush
+				slots.pop_back();
+				flush(0);
+			} else {
+				flush(0);
+				cond = slots.back();
+				slots.pop_back();
+			}
+			emit(RegisterInstruction(inst.type, cond,
+									 static_cast<uint32_t>(inst.idx())));
+			jumps.push_back(code.size() - 1);
+			break;
+		}
+
+		case InstructionType::CALL: {
+			size_t lo = d - inst.n - 1;
+			flush(lo);
+			emit(RegisterInstruction(InstructionType::CALL, home(lo),
+									 static_cast<uint16_t>(inst.n), 0));
+			slots.resize(lo);
+			slots.push_back(home(lo));
+			break;
+		}
+		case InstructionType::RET:
+			emit(RegisterInstruction(InstructionType::RET, slots.back()));
+			slots.pop_back();
+			falls_through = false;
+			break;
+		case InstructionType::RETNULL:
+			emit(RegisterInstruction(InstructionType::RETNULL));
+			falls_through = false;
+			break;
+
+		case InstructionType::ADD:
+		case InstructionType::SUB:
+		case InstructionType::MUL:
+		case InstructionType::DIV:
+		case InstructionType::MOD:
+		case InstructionType::POW:
+		case InstructionType::IDIV:
+		case InstructionType::BXOR:
+		case InstructionType::BAND:
+		case InstructionType::BOR:
+		case InstructionType::SHL:
+		case InstructionType::SHR:
+		case InstructionType::EQ:
+		case InstructionType::NE:
+		case InstructionType::LT:
+		case InstructionType::LE:
+		case InstructionType::GT:
+		case InstructionType::GE:
+		case InstructionType::AND:
+		case InstructionType::OR: {
+			uint16_t dst = home(d - 2);
+			prepare_write(dst, d - 2);
+			uint16_t lhs = slots[d - 2], rhs = slots[d - 1];
+			code.emplace_back(inst.type, dst, lhs, rhs);
+			slots.resize(d - 2);
+			slots.push_back(dst);
+			producer = code.size() - 1;
+			break;
+		}
+
+		default:
+			return false;
+		}
+	}
+
+	for (auto j : jumps) {
+		code[j].k = static_cast<uint32_t>(starts[code[j].k]);
+	}
+
+	res.name = func.name;
+	res.local_count = func.local_count;
+	res.arg_count = func.arg_count;
+	res.register_count = scratch + 1;
+	res.instructions = std::move(code);
+	res.constants = std::move(constants);
+	res.lines = func.lines.remapped(starts);
+	return true;
+}
+
+} // namespace
+
+std::optional<RegisterFunction>
+lower_to_registers(const BytecodeFunction &func) noexcept {
+	auto depths = compute_stack_depths(func);
+	if (!depths) {
+		return std::nullopt;
+	}
+
+	size_t max_depth = *std::max_element(depths->begin(), depths->end());
+	if (func.local_count + max_depth + 1 >
+		std::numeric_limits<uint16_t>::max()) {
+		return std::nullopt;
+	}
+
+	RegisterFunction res;
+	RegisterLowering lowering(func, *depths, max_depth);
+	if (!lowering.run(res)) {
+		return std::nullopt;
+	}
+	return res;
+}
+
+} // namespace cypheri
@@ -0,0 +1,105 @@
+#include "cypheri/scheduler.hpp"
+#include "cypheri/workqueue.hpp"
+#include <algorithm>
+#include <deque>
+#include <format>
+#include <thread>
+#include <utility>
+
+namespace cypheri {
+
+SchedulerStats run_actors(std::shared_ptr<const CodeImage> image,
+						  NameTable &name_table, std::span<const Actor> actors,
+						  const SchedulerOptions &options) noexcept {
+	size_t threads = options.threads;
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if (!name_table.is_concurrent()) {
+		threads = 1;
+	}
+	threads = std::max<size_t>(1, std::min(threads, actors.size()));
+
+	// each worker pops from the back of its deque, push the last ones first
+	WorkStealingQueues queues(threads);
+	for (size_t k = actors.size(); k-- > 0;) {
+		queues.push(k % threads, k);
+	}
+
+	auto finish = [&](size_t actor, VM &vm,
+					  const std::variant<Value, RuntimeError> &result) {
+		if (options.on_exit) {
+			options.on_exit(actor, vm, result);
+		}
+	};
+
+	std::vector<size_t> resumes(threads);
+	auto work = [&](size_t worker) {
+		// Loading an image can't fail, it was verified and linked when it
+		// was built and only links its slots to this VM's globals
+		VM vm(name_table, options.vm);
+		vm.load(image);
+		if (options.setup) {
+			options.setup(vm);
+		}
+
+		// Started actors take turns, admitting one more before each turn
+		// keeps this isolate from hoarding work other ones could steal
+		std::deque<std::pair<size_t, Coroutine *>> ready;
+		bool drained = false;
+		while (!drained || !ready.empty()) {
+			if (!drained) {
+				if (auto task = queues.pop(worker)) {
+					const Actor &actor = actors[*task];
+					auto callee = vm.get_global(actor.entry);
+					if (!callee) {
+						finish(*task, vm,
+							   RuntimeError(std::format(
+								   "undefined global variable {}",
+								   name_table.get_name(actor.entry))));
+						continue;
+					}
+					auto co = vm.spawn(*callee, actor.args);
+					if (auto *err = std::get_if<RuntimeError>(&co)) {
+						finish(*task, vm, *err);
+						continue;
+					}
+					ready.emplace_back(*task, std::get<Coroutine *>(co));
+				} else {
+					drained = true;
+				}
+			}
+			if (ready.empty()) {
+				continue;
+			}
+
+			auto [actor, co] = ready.front();
+			ready.pop_front();
+			auto res = vm.resume(*co);
+			resumes[worker]++;
+			if (co->status() == CoroutineStatus::SUSPENDED) {
+				ready.emplace_back(actor, co);
+			} else {
+				finish(actor, vm, res);
+				vm.release(*co);
+			}
+		}
+	};
+
+	{
+		std::vector<std::jthread> pool;
+		for (size_t w = 1; w < threads; w++) {
+			pool.emplace_back(work, w);
+		}
+		work(0);
+	}
+
+	SchedulerStats stats;
+	stats.isolates = threads;
+	for (size_t n : resumes) {
+		stats.resumes += n;
+	}
+	return stats;
+}
+
+} // namespace cypheri
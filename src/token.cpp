@@ -1,8 +1,25 @@
 #include "cypheri/token.hpp"
-#include <cctype>
+#include <array>
+#include <bit>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 
+// Vectorized scanning of whitespace, identifiers and string literals, build
+// with CYPHERI_TOKEN_SIMD=0 to use the lookup table only.
+#ifndef CYPHERI_TOKEN_SIMD
+#define CYPHERI_TOKEN_SIMD 1
+#endif
+
+#if !CYPHERI_TOKEN_SIMD
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CYPHERI_TOKEN_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CYPHERI_TOKEN_NEON 1
+#endif
+
 namespace cypheri {
 
 Token::Token(TokenType type, SourceLocation loc) noexcept
@@ -39,128 +56,280 @@ TokenizeResult TokenizeResult::from_error(SourceLocation loc,
 
 namespace {
 
-class SourceStream {
-public:
-	SourceStream(std::string_view source) noexcept
-		: source(source), pos{0}, cur_loc{1, 1} {}
+enum CharClass : uint8_t {
+	CC_SPACE = 1,
+	CC_DIGIT = 2,
+	CC_ALPHA = 4, // letters and '_', may start an identifier
+	CC_STRING_SPECIAL = 8, // ends a run of plain string characters
+};
 
-	char peek() const noexcept {
-		return source[pos];
+// ASCII only, so that the tokenizer doesn't depend on the C locale
+consteval std::array<uint8_t, 256> make_char_class_table() {
+	std::array<uint8_t, 256> table{};
+	for (int c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+		table[c] |= CC_SPACE;
+	}
+	for (int c = '0'; c <= '9'; c++) {
+		table[c] |= CC_DIGIT;
 	}
+	for (int c = 'a'; c <= 'z'; c++) {
+		table[c] |= CC_ALPHA;
+		table[c - 'a' + 'A'] |= CC_ALPHA;
+	}
+	table['_'] |= CC_ALPHA;
+	table['"'] |= CC_STRING_SPECIAL;
+	table['\\'] |= CC_STRING_SPECIAL;
+	return table;
+}
 
-	char consume() noexcept {
-		char c = source[pos];
-		if (c == '\n') {
-			cur_loc.line++;
-			cur_loc.column = 1;
-		} else {
-			cur_loc.column++;
+constexpr std::array<uint8_t, 256> CHAR_CLASS_TABLE = make_char_class_table();
+
+bool char_is(char c, uint8_t cls) noexcept {
+	return CHAR_CLASS_TABLE[static_cast<unsigned char>(c)] & cls;
+}
+
+// Block classifiers, each returns a mask with the bits of byte i set when
+// it belongs to the class. SSE2 gives one bit per byte, NEON has no movemask
+// and narrows the comparison to four bits per byte instead.
+#if CYPHERI_TOKEN_SSE2
+
+constexpr size_t BLOCK_SIZE = 16;
+constexpr int MASK_BITS_PER_BYTE = 1;
+constexpr uint64_t FULL_MASK = 0xffff;
+
+// (x - lo) <= n as unsigned bytes
+__m128i in_range(__m128i x, char lo, char n) noexcept {
+	__m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+	__m128i lim = _mm_set1_epi8(n);
+	return _mm_cmpeq_epi8(_mm_max_epu8(d, lim), lim);
+}
+
+__m128i load_block(const char *p) noexcept {
+	return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+uint64_t to_mask(__m128i m) noexcept {
+	return static_cast<uint32_t>(_mm_movemask_epi8(m));
+}
+
+uint64_t space_mask(const char *p) noexcept {
+	__m128i x = load_block(p);
+	return to_mask(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+								in_range(x, '\t', '\r' - '\t')));
+}
+
+uint64_t ident_mask(const char *p) noexcept {
+	__m128i x = load_block(p);
+	__m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+	__m128i m = _mm_or_si128(in_range(x, '0', 9), in_range(lower, 'a', 25));
+	return to_mask(_mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('_'))));
+}
+
+uint64_t string_special_mask(const char *p) noexcept {
+	__m128i x = load_block(p);
+	return to_mask(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+								_mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+}
+
+uint64_t newline_mask(const char *p) noexcept {
+	return to_mask(_mm_cmpeq_epi8(load_block(p), _mm_set1_epi8('\n')));
+}
+
+#elif CYPHERI_TOKEN_NEON
+
+constexpr size_t BLOCK_SIZE = 16;
+constexpr int MASK_BITS_PER_BYTE = 4;
+constexpr uint64_t FULL_MASK = ~uint64_t{0};
+
+uint8x16_t in_range(uint8x16_t x, char lo, char n) noexcept {
+	return vcleq_u8(vsubq_u8(x, vdupq_n_u8(lo)), vdupq_n_u8(n));
+}
+
+uint8x16_t load_block(const char *p) noexcept {
+	return vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+}
+
+uint64_t to_mask(uint8x16_t m) noexcept {
+	uint8x8_t narrow = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(narrow), 0);
+}
+
+uint64_t space_mask(const char *p) noexcept {
+	uint8x16_t x = load_block(p);
+	return to_mask(
+		vorrq_u8(vceqq_u8(x, vdupq_n_u8(' ')), in_range(x, '\t', '\r' - '\t')));
+}
+
+uint64_t ident_mask(const char *p) noexcept {
+	uint8x16_t x = load_block(p);
+	uint8x16_t lower = vorrq_u8(x, vdupq_n_u8(0x20));
+	uint8x16_t m = vorrq_u8(in_range(x, '0', 9), in_range(lower, 'a', 25));
+	return to_mask(vorrq_u8(m, vceqq_u8(x, vdupq_n_u8('_'))));
+}
+
+uint64_t string_special_mask(const char *p) noexcept {
+	uint8x16_t x = load_block(p);
+	return to_mask(
+		vorrq_u8(vceqq_u8(x, vdupq_n_u8('"')), vceqq_u8(x, vdupq_n_u8('\\'))));
+}
+
+uint64_t newline_mask(const char *p) noexcept {
+	return to_mask(vceqq_u8(load_block(p), vdupq_n_u8('\n')));
+}
+
+#else
+
+// never called, scan_class only uses the lookup table
+constexpr uint64_t (*space_mask)(const char *) = nullptr;
+constexpr uint64_t (*ident_mask)(const char *) = nullptr;
+constexpr uint64_t (*string_special_mask)(const char *) = nullptr;
+
+#endif
+
+// First position in [p, end) whose class is (or with skip, is not) cls
+template <uint64_t (*block_mask)(const char *)>
+const char *scan_class(const char *p, const char *end, uint8_t cls,
+					   bool skip) noexcept {
+#if CYPHERI_TOKEN_SSE2 || CYPHERI_TOKEN_NEON
+	while (static_cast<size_t>(end - p) >= BLOCK_SIZE) {
+		uint64_t m = block_mask(p);
+		if (skip) {
+			m = ~m & FULL_MASK;
 		}
-		pos++;
-		return c;
+		if (m != 0) {
+			return p + std::countr_zero(m) / MASK_BITS_PER_BYTE;
+		}
+		p += BLOCK_SIZE;
+	}
+#endif
+	while (p < end && char_is(*p, cls) == skip) {
+		p++;
 	}
+	return p;
+}
+
+} // namespace
 
-	bool match(char expected) noexcept {
-		if (peek() == expected) {
-			consume();
-			return true;
+SourceLocation SourceStream::location() noexcept {
+	const char *begin = source.data();
+	const char *p = begin + line_pos;
+	const char *end = begin + pos;
+#if CYPHERI_TOKEN_SSE2 || CYPHERI_TOKEN_NEON
+	while (static_cast<size_t>(end - p) >= BLOCK_SIZE) {
+		uint64_t m = newline_mask(p);
+		if (m != 0) {
+			line += std::popcount(m) / MASK_BITS_PER_BYTE;
+			int last = (63 - std::countl_zero(m)) / MASK_BITS_PER_BYTE;
+			line_start = p - begin + last + 1;
 		}
-		return false;
+		p += BLOCK_SIZE;
 	}
-
-	bool eof() const noexcept {
-		return pos >= source.size();
+#endif
+	for (; p < end; p++) {
+		if (*p == '\n') {
+			line++;
+			line_start = p - begin + 1;
+		}
 	}
+	line_pos = pos;
+	return SourceLocation{line, static_cast<uint32_t>(pos - line_start + 1)};
+}
 
-	SourceLocation location() const noexcept {
-		return cur_loc;
-	}
+void SourceStream::skip_whitespace() noexcept {
+	const char *begin = source.data();
+	pos = scan_class<space_mask>(begin + pos, begin + source.size(), CC_SPACE,
+								 true) -
+		  begin;
+}
 
-	void skip_whitespace() noexcept {
-		while (!eof() && std::isspace(peek())) {
-			consume();
-		}
+std::string_view SourceStream::consumeIdentifier() noexcept {
+	// consume() already advanced the position, rollback
+	size_t begin = pos - 1;
+	const char *data = source.data();
+	pos = scan_class<ident_mask>(data + pos, data + source.size(),
+								 CC_ALPHA | CC_DIGIT, true) -
+		  data;
+	return source.substr(begin, pos - begin);
+}
+
+std::string_view SourceStream::consumeString(std::string &buf) noexcept {
+	// The opening quote is already consumed
+	const char *data = source.data();
+	size_t begin = pos;
+	size_t end = scan_class<string_special_mask>(
+					 data + pos, data + source.size(), CC_STRING_SPECIAL,
+					 false) -
+				 data;
+	if (end < source.size() && source[end] == '"') {
+		// no escape sequences, the text is a view of the source
+		pos = end + 1;
+		return source.substr(begin, end - begin);
 	}
 
-	std::string_view consumeIdentifier() noexcept {
-		// consume() already advanced the position, rollback
-		pos -= 1;
-		cur_loc.column -= 1;
-
-		size_t len = 0, begin = pos;
-		char c = peek();
-		while (!eof() && (std::isalnum(c) || c == '_')) {
-			len++;
-			consume();
-			c = peek();
+	std::string &res = buf;
+	res.clear();
+	while (!eof()) {
+		// copy the run up to the next quote or backslash at once
+		size_t run = scan_class<string_special_mask>(
+						 data + pos, data + source.size(), CC_STRING_SPECIAL,
+						 false) -
+					 data;
+		res.append(source.substr(pos, run - pos));
+		pos = run;
+		if (eof()) {
+			break;
 		}
-		return source.substr(begin, len);
-	}
 
-	std::string consumeString() noexcept {
-		// The opening quote is already consumed
-		std::string res;
-		bool escaped = false;
-		while (!eof()) {
-			char c = consume();
-			if (escaped) {
-				switch (c) {
-				case 'n':
-					res += '\n';
-					break;
-				case 't':
-					res += '\t';
-					break;
-				case 'r':
-					res += '\r';
-					break;
-				case 'b':
-					res += '\b';
-					break;
-				case 'f':
-					res += '\f';
-					break;
-				case '"':
-					res += '"';
-					break;
-				case '\'':
-					res += '\'';
-					break;
-				case '\\':
-					res += '\\';
-					break;
-				// TODO: \0, \x, \u
-				default:
-					// unknown escape sequence, keep it as is
-					res += c;
-					break;
-				}
-				escaped = false;
-			} else {
-				switch (c) {
-				case '"':
-					return res;
-				case '\\':
-					escaped = true;
-					break;
-				default:
-					res += c;
-					break;
-				}
-			}
+		char c = consume();
+		if (c == '"') {
+			return res;
 		}
 
-		// unterminated string
-		// keep it as is for now
-		// TODO: error handling
-		return res;
+		// backslash, an escape sequence follows
+		if (eof()) {
+			break;
+		}
+		c = consume();
+		switch (c) {
+		case 'n':
+			res += '\n';
+			break;
+		case 't':
+			res += '\t';
+			break;
+		case 'r':
+			res += '\r';
+			break;
+		case 'b':
+			res += '\b';
+			break;
+		case 'f':
+			res += '\f';
+			break;
+		case '"':
+			res += '"';
+			break;
+		case '\'':
+			res += '\'';
+			break;
+		case '\\':
+			res += '\\';
+			break;
+		// TODO: \0, \x, \u
+		default:
+			// unknown escape sequence, keep it as is
+			res += c;
+			break;
+		}
 	}
 
-private:
-	std::string_view source;
-	size_t pos;
-	SourceLocation cur_loc;
-};
+	// unterminated string
+	// keep it as is for now
+	// TODO: error handling
+	return res;
+}
+
+namespace {
 
 // NOTE: this is not a full-fledged hex parser
 // assumes that the char is a valid hex number! (0-9, a-f, A-F)
@@ -173,310 +342,351 @@ int hex2int(char c) noexcept {
 	return c - 'A' + 10;
 }
 
-TokenType match_keyword(std::string_view str) noexcept {
-	// TODO: BuiltinXXX
+// Keywords are the contiguous range of TOKEN_TYPE_NAMES starting at Break,
+// up to the (guard) token.
+constexpr TokenType FIRST_KEYWORD = TK("Break");
+constexpr TokenType KEYWORD_END = TK("(guard)");
 
-	switch (str[0]) {
-	case 'B':
-		if (str == "Break") {
-			return TK("Break");
-		}
-		break;
-	case 'C':
-		if (str == "Class") {
-			return TK("Class");
-		} else if (str == "Continue") {
-			return TK("Continue");
-		} else if (str == "Catch") {
-			return TK("Catch");
-		}
-		break;
-	case 'D':
-		if (str == "Declare") {
-			return TK("Declare");
-		} else if (str == "Do") {
-			return TK("Do");
-		}
-		break;
-	case 'E':
-		if (str == "End") {
-			return TK("End");
-		} else if (str == "Else") {
-			return TK("Else");
-		} else if (str == "ElseIf") {
-			return TK("ElseIf");
-		}
-		break;
-	case 'F':
-		if (str == "Function") {
-			return TK("Function");
-		} else if (str == "For") {
-			return TK("For");
-		} else if (str == "FALSE") {
-			return TK("FALSE");
-		}
-		break;
-	case 'I':
-		if (str == "If") {
-			return TK("If");
-		} else if (str == "Import") {
-			return TK("Import");
-		}
-		break;
-	case 'L':
-		if (str == "Lambda") {
-			return TK("Lambda");
-		}
-		break;
-	case 'M':
-		if (str == "Module") {
-			return TK("Module");
-		}
-		break;
-	case 'N':
-		if (str == "New") {
-			return TK("New");
-		} else if (str == "NULL") {
-			return TK("NULL");
-		}
-		break;
-	case 'R':
-		if (str == "Return") {
-			return TK("Return");
-		}
-		break;
-	case 'W':
-		if (str == "While") {
-			return TK("While");
-		}
-		break;
-	case 'T':
-		if (str == "Then") {
-			return TK("Then");
-		} else if (str == "Throw") {
-			return TK("Throw");
-		} else if (str == "Try") {
-			return TK("Try");
-		} else if (str == "Typeof") {
-			return TK("Typeof");
-		} else if (str == "TRUE") {
-			return TK("TRUE");
+constexpr size_t KEYWORD_HASH_BITS = 7;
+constexpr size_t KEYWORD_HASH_SIZE = size_t{1} << KEYWORD_HASH_BITS;
+static_assert(KEYWORD_END - FIRST_KEYWORD <= KEYWORD_HASH_SIZE / 2,
+			  "keyword hash table is too crowded");
+
+constexpr size_t cstr_length(const char *str) {
+	size_t len = 0;
+	while (str[len]) {
+		len++;
+	}
+	return len;
+}
+
+// FNV-1a, seeded so that the table below can search for a seed without
+// collisions among the keywords
+constexpr uint32_t keyword_hash(const char *str, size_t len, uint32_t seed) {
+	uint32_t h = 2166136261u ^ seed;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ static_cast<unsigned char>(str[i])) * 16777619u;
+	}
+	return h >> (32 - KEYWORD_HASH_BITS);
+}
+
+struct KeywordHashTable {
+	uint32_t seed;
+	std::array<TokenType, KEYWORD_HASH_SIZE> tokens; // (identifier) if empty
+	std::array<uint8_t, TOKEN_COUNT> lengths;
+};
+
+consteval KeywordHashTable make_keyword_hash_table() {
+	KeywordHashTable table{};
+	for (TokenType tk = FIRST_KEYWORD; tk < KEYWORD_END; tk++) {
+		table.lengths[tk] =
+			static_cast<uint8_t>(cstr_length(TOKEN_TYPE_NAMES[tk]));
+	}
+
+	for (uint32_t seed = 0; seed < 1 << 16; seed++) {
+		table.seed = seed;
+		table.tokens.fill(TK("(identifier)"));
+		bool perfect = true;
+		for (TokenType tk = FIRST_KEYWORD; tk < KEYWORD_END && perfect; tk++) {
+			uint32_t h =
+				keyword_hash(TOKEN_TYPE_NAMES[tk], table.lengths[tk], seed);
+			if (table.tokens[h] != TK("(identifier)")) {
+				perfect = false;
+			}
+			table.tokens[h] = tk;
 		}
-		break;
-	case '_':
-		if (str == "_Yield") {
-			return TK("_Yield");
+		if (perfect) {
+			return table;
 		}
-		break;
-	default:
-		break;
+	}
+	throw "no perfect hash found for the keywords, enlarge the table";
+}
+
+constexpr KeywordHashTable KEYWORD_HASH_TABLE = make_keyword_hash_table();
+
+TokenType match_keyword(std::string_view str) noexcept {
+	uint32_t h = keyword_hash(str.data(), str.size(), KEYWORD_HASH_TABLE.seed);
+	TokenType tk = KEYWORD_HASH_TABLE.tokens[h];
+	if (tk != TK("(identifier)") &&
+		KEYWORD_HASH_TABLE.lengths[tk] == str.size() &&
+		std::memcmp(TOKEN_TYPE_NAMES[tk], str.data(), str.size()) == 0) {
+		return tk;
 	}
 	return TK("(identifier)");
 }
 
 } // namespace
 
-TokenizeResult tokenize(std::string_view source,
-						NameTable &name_table) noexcept {
-	TokenizeResult res;
-	auto &tokens = res.tokens;
-	SourceStream stream(source);
+
+TokenStream::TokenStream(std::string_view source, NameTable &name_table,
+						 size_t begin) noexcept
+	: stream(source, begin), name_table(&name_table),
+	  ring(LOOKAHEAD, Token(TK("(eof)"), SourceLocation{1, 1})) {}
+
+TokenStream::TokenStream(TokenizeResult &&tk_res) noexcept
+	: stream(std::string_view()), name_table(nullptr),
+	  err(std::move(tk_res.error)),
+	  ring(LOOKAHEAD, Token(TK("(eof)"), SourceLocation{1, 1})),
+	  replay(std::move(tk_res.tokens)),
+	  replay_strs(std::move(tk_res.str_literals)) {
+	// the tokens refer to these by index already, no deduplication
+	strs.assign(replay_strs.begin(), replay_strs.end());
+}
+
+Token TokenStream::consume() noexcept {
+	Token token = peek();
+	// (eof) and (error) stay at the front forever
+	if (token.type != TK("(eof)") && token.type != TK("(error)")) {
+		head = (head + 1) & (LOOKAHEAD - 1);
+		count--;
+	}
+	return token;
+}
+
+std::optional<SyntaxError> &TokenStream::error() noexcept {
+	return err;
+}
+
+const std::vector<std::string_view> &TokenStream::str_literals() noexcept {
+	return strs;
+}
+
+size_t TokenStream::add_literal(std::string_view str) noexcept {
+	if (auto it = str_index.find(str); it != str_index.end()) {
+		return it->second;
+	}
+
+	// text with escapes was unescaped into string_buf, which the next
+	// literal overwrites
+	if (str.data() == string_buf.data()) {
+		auto *copy = static_cast<char *>(str_arena.allocate(str.size(), 1));
+		std::memcpy(copy, str.data(), str.size());
+		str = std::string_view(copy, str.size());
+	}
+	strs.push_back(str);
+	str_index.emplace(str, strs.size() - 1);
+	return strs.size() - 1;
+}
+
+void TokenStream::fill(size_t offset) noexcept {
+	while (count <= offset) {
+		ring[(head + count) & (LOOKAHEAD - 1)] = next();
+		count++;
+	}
+}
+
+Token TokenStream::next() noexcept {
+	if (replay_pos < replay.size()) {
+		return replay[replay_pos++];
+	}
+	// a replayed stream ends with its own (eof), repeat it
+	if (!replay.empty()) {
+		return replay.back();
+	}
+	Token token = scan();
+	token.offset = static_cast<uint32_t>(token_begin);
+	return token;
+}
+
+Token TokenStream::fail(SourceLocation loc, const char *msg) noexcept {
+	err.emplace(msg, loc);
+	return Token(TK("(error)"), loc);
+}
+
+Token TokenStream::scan() noexcept {
+	if (err.has_value()) {
+		return Token(TK("(error)"), err->location);
+	}
 
 	stream.skip_whitespace();
-	while (!stream.eof()) {
-		auto loc = stream.location();
-		char c = stream.consume();
+	token_begin = stream.offset();
+	if (stream.eof()) {
+		return Token(TK("(eof)"), stream.location());
+	}
 
-		switch (c) {
-		case '+':
-			if (stream.match('=')) {
-				tokens.emplace_back(TK("+="), loc);
-			} else {
-				tokens.emplace_back(TK("+"), loc);
-			}
-			break;
-		case '-':
-			if (stream.match('=')) {
-				tokens.emplace_back(TK("-="), loc);
-			} else {
-				tokens.emplace_back(TK("-"), loc);
-			}
-			break;
-		case '*':
-			if (stream.match('=')) {
-				tokens.emplace_back(TK("*="), loc);
-			} else if (stream.match('*')) {
-				if (stream.match('=')) {
-					tokens.emplace_back(TK("**="), loc);
-				} else {
-					tokens.emplace_back(TK("**"), loc);
-				}
-			} else {
-				tokens.emplace_back(TK("*"), loc);
-			}
-			break;
-		case '/':
-			if (stream.match('=')) {
-				tokens.emplace_back(TK("/="), loc);
-			} else if (stream.match('/')) {
-				if (stream.match('=')) {
-					tokens.emplace_back(TK("//="), loc);
-				} else {
-					tokens.emplace_back(TK("//"), loc);
-				}
-			} else {
-				tokens.emplace_back(TK("/"), loc);
-			}
-			break;
-		case '%':
+	auto loc = stream.location();
+	char c = stream.consume();
+
+	switch (c) {
+	case '+':
+		if (stream.match('=')) {
+			return Token(TK("+="), loc);
+		} else {
+			return Token(TK("+"), loc);
+		}
+	case '-':
+		if (stream.match('=')) {
+			return Token(TK("-="), loc);
+		} else {
+			return Token(TK("-"), loc);
+		}
+	case '*':
+		if (stream.match('=')) {
+			return Token(TK("*="), loc);
+		} else if (stream.match('*')) {
 			if (stream.match('=')) {
-				tokens.emplace_back(TK("%="), loc);
+				return Token(TK("**="), loc);
 			} else {
-				tokens.emplace_back(TK("%"), loc);
+				return Token(TK("**"), loc);
 			}
-			break;
-		case '^':
+		} else {
+			return Token(TK("*"), loc);
+		}
+	case '/':
+		if (stream.match('=')) {
+			return Token(TK("/="), loc);
+		} else if (stream.match('/')) {
 			if (stream.match('=')) {
-				tokens.emplace_back(TK("^="), loc);
+				return Token(TK("//="), loc);
 			} else {
-				tokens.emplace_back(TK("^"), loc);
+				return Token(TK("//"), loc);
 			}
-			break;
-		case '=':
+		} else {
+			return Token(TK("/"), loc);
+		}
+	case '%':
+		if (stream.match('=')) {
+			return Token(TK("%="), loc);
+		} else {
+			return Token(TK("%"), loc);
+		}
+	case '^':
+		if (stream.match('=')) {
+			return Token(TK("^="), loc);
+		} else {
+			return Token(TK("^"), loc);
+		}
+	case '=':
+		if (stream.match('=')) {
+			return Token(TK("=="), loc);
+		} else {
+			return Token(TK("="), loc);
+		}
+	case '!':
+		if (stream.match('=')) {
+			return Token(TK("!="), loc);
+		} else {
+			return Token(TK("!"), loc);
+		}
+	case '<':
+		if (stream.match('=')) {
+			return Token(TK("<="), loc);
+		} else if (stream.match('<')) {
 			if (stream.match('=')) {
-				tokens.emplace_back(TK("=="), loc);
+				return Token(TK("<<="), loc);
 			} else {
-				tokens.emplace_back(TK("="), loc);
+				return Token(TK("<<"), loc);
 			}
-			break;
-		case '!':
+		} else {
+			return Token(TK("<"), loc);
+		}
+	case '>':
+		if (stream.match('=')) {
+			return Token(TK(">="), loc);
+		} else if (stream.match('>')) {
 			if (stream.match('=')) {
-				tokens.emplace_back(TK("!="), loc);
+				return Token(TK(">>="), loc);
 			} else {
-				tokens.emplace_back(TK("!"), loc);
+				return Token(TK(">>"), loc);
 			}
-			break;
-		case '<':
-			if (stream.match('=')) {
-				tokens.emplace_back(TK("<="), loc);
-			} else if (stream.match('<')) {
-				if (stream.match('=')) {
-					tokens.emplace_back(TK("<<="), loc);
-				} else {
-					tokens.emplace_back(TK("<<"), loc);
+		} else {
+			return Token(TK(">"), loc);
+		}
+	case '&':
+		if (stream.match('&')) {
+			return Token(TK("&&"), loc);
+		} else if (stream.match('=')) {
+			return Token(TK("&="), loc);
+		} else {
+			return Token(TK("&"), loc);
+		}
+	case '|':
+		if (stream.match('|')) {
+			return Token(TK("||"), loc);
+		} else if (stream.match('=')) {
+			return Token(TK("|="), loc);
+		} else {
+			return Token(TK("|"), loc);
+		}
+	case ';':
+		return Token(TK(";"), loc);
+	case '(':
+		return Token(TK("("), loc);
+	case ')':
+		return Token(TK(")"), loc);
+	case '{':
+		return Token(TK("{"), loc);
+	case '}':
+		return Token(TK("}"), loc);
+	case ',':
+		return Token(TK(","), loc);
+	case '[':
+		return Token(TK("["), loc);
+	case ']':
+		return Token(TK("]"), loc);
+	case ':':
+		if (!stream.match(':')) {
+			return fail(loc, "Expected '::'");
+		} else {
+			return Token(TK("::"), loc);
+		}
+	case '"':
+		return Token::from_string(
+			loc, add_literal(stream.consumeString(string_buf)));
+	default:
+		if (char_is(c, CC_DIGIT)) {
+			// TODO: handle hex, oct, and binary numbers, as well as floats
+			uint64_t val = c - '0';
+			bool overflow = false;
+			char x = stream.peek();
+			while (char_is(x, CC_DIGIT)) {
+				if (val > std::numeric_limits<uint64_t>::max() / 10) {
+					overflow = true;
+					break;
 				}
-			} else {
-				tokens.emplace_back(TK("<"), loc);
-			}
-			break;
-		case '>':
-			if (stream.match('=')) {
-				tokens.emplace_back(TK(">="), loc);
-			} else if (stream.match('>')) {
-				if (stream.match('=')) {
-					tokens.emplace_back(TK(">>="), loc);
-				} else {
-					tokens.emplace_back(TK(">>"), loc);
+				val = val * 10 + (x - '0');
+				stream.consume();
+				if (stream.eof()) {
+					break;
 				}
-			} else {
-				tokens.emplace_back(TK(">"), loc);
+				x = stream.peek();
 			}
-			break;
-		case '&':
-			if (stream.match('&')) {
-				tokens.emplace_back(TK("&&"), loc);
-			} else if (stream.match('=')) {
-				tokens.emplace_back(TK("&="), loc);
+			if (overflow) {
+				return fail(loc, "Integer literal overflow");
 			} else {
-				tokens.emplace_back(TK("&"), loc);
+				return Token::from_integer(loc, val);
 			}
-			break;
-		case '|':
-			if (stream.match('|')) {
-				tokens.emplace_back(TK("||"), loc);
-			} else if (stream.match('=')) {
-				tokens.emplace_back(TK("|="), loc);
-			} else {
-				tokens.emplace_back(TK("|"), loc);
-			}
-			break;
-		case ';':
-			tokens.emplace_back(TK(";"), loc);
-			break;
-		case '(':
-			tokens.emplace_back(TK("("), loc);
-			break;
-		case ')':
-			tokens.emplace_back(TK(")"), loc);
-			break;
-		case '{':
-			tokens.emplace_back(TK("{"), loc);
-			break;
-		case '}':
-			tokens.emplace_back(TK("}"), loc);
-			break;
-		case ',':
-			tokens.emplace_back(TK(","), loc);
-			break;
-		case '[':
-			tokens.emplace_back(TK("["), loc);
-			break;
-		case ']':
-			tokens.emplace_back(TK("]"), loc);
-			break;
-		case ':':
-			if (!stream.match(':')) {
-				return TokenizeResult::from_error(loc, "Expected '::'");
-			} else {
-				tokens.emplace_back(TK("::"), loc);
-			}
-			break;
-		case '"':
-			res.str_literals.push_back(stream.consumeString());
-			tokens.push_back(
-				Token::from_string(loc, res.str_literals.size() - 1));
-			break;
-		default:
-			if (std::isdigit(c)) {
-				// TODO: handle hex, oct, and binary numbers, as well as floats
-				uint64_t val = c - '0';
-				bool overflow = false;
-				char x = stream.peek();
-				while (std::isdigit(x)) {
-					if (val > std::numeric_limits<uint64_t>::max() / 10) {
-						overflow = true;
-						break;
-					}
-					val = val * 10 + (x - '0');
-					stream.consume();
-					if (stream.eof()) {
-						break;
-					}
-					x = stream.peek();
-				}
-				if (overflow) {
-					return TokenizeResult::from_error(
-						loc, "Integer literal overflow");
-				} else {
-					tokens.push_back(Token::from_integer(loc, val));
-				}
-			} else if (std::isalpha(c) || c == '_') {
-				std::string_view id = stream.consumeIdentifier();
-				TokenType keyword = match_keyword(id);
-				if (keyword != TK("(identifier)")) {
-					tokens.emplace_back(keyword, loc);
-				} else {
-					tokens.push_back(Token::from_identifier(
-						loc, name_table.get_id_or_insert(id)));
-				}
+		} else if (char_is(c, CC_ALPHA)) {
+			std::string_view id = stream.consumeIdentifier();
+			TokenType keyword = match_keyword(id);
+			if (keyword != TK("(identifier)")) {
+				return Token(keyword, loc);
 			} else {
-				return TokenizeResult::from_error(loc, "Unexpected character");
+				return Token::from_identifier(
+					loc, name_table->get_id_or_insert(id));
 			}
+		} else {
+			return fail(loc, "Unexpected character");
 		}
-		stream.skip_whitespace();
 	}
+}
 
-	tokens.emplace_back(TK("(eof)"), stream.location());
+TokenizeResult tokenize(std::string_view source,
+						NameTable &name_table) noexcept {
+	TokenStream stream(source, name_table);
+	TokenizeResult res;
+	while (true) {
+		Token token = stream.consume();
+		if (token.type == TK("(error)")) {
+			return TokenizeResult{.error = std::move(stream.error())};
+		}
+		res.tokens.push_back(token);
+		if (token.type == TK("(eof)")) {
+			break;
+		}
+	}
+	const auto &strs = stream.str_literals();
+	res.str_literals.assign(strs.begin(), strs.end());
 	return res;
 }
 
@@ -0,0 +1,371 @@
+#include "cypheri/value.hpp"
+#include "cypheri/heap.hpp"
+#include <cmath>
+#include <iterator>
+#include <limits>
+
+namespace cypheri {
+
+namespace {
+
+constexpr const char *UNSUPPORTED_OPERANDS = "unsupported operand types";
+
+bool is_numeric(const Value &v) noexcept {
+	return v.is_number() || v.type() == ValueType::INT;
+}
+
+double to_double(const Value &v) noexcept {
+	return v.is_number() ? v.as_number() : static_cast<double>(v.as_int());
+}
+
+int64_t wrapping_pow(int64_t base, int64_t exp) noexcept {
+	uint64_t res = 1, b = static_cast<uint64_t>(base);
+	while (exp > 0) {
+		if (exp & 1) {
+			res *= b;
+		}
+		b *= b;
+		exp >>= 1;
+	}
+	return static_cast<int64_t>(res);
+}
+
+// Shifts are logical, negative counts shift to the other direction
+int64_t shift_left(int64_t a, int64_t n) noexcept;
+
+int64_t shift_right(int64_t a, int64_t n) noexcept {
+	if (n < 0) {
+		return n == std::numeric_limits<int64_t>::min() ? 0
+														: shift_left(a, -n);
+	}
+	return n >= 64 ? 0 : static_cast<int64_t>(static_cast<uint64_t>(a) >> n);
+}
+
+int64_t shift_left(int64_t a, int64_t n) noexcept {
+	if (n < 0) {
+		return n == std::numeric_limits<int64_t>::min() ? 0
+														: shift_right(a, -n);
+	}
+	return n >= 64 ? 0 : static_cast<int64_t>(static_cast<uint64_t>(a) << n);
+}
+
+int compare_values(const Value &a, const Value &b, bool &ok) noexcept {
+	ok = true;
+	if (a.type() == ValueType::INT && b.type() == ValueType::INT) {
+		int64_t x = a.as_int(), y = b.as_int();
+		return (x > y) - (x < y);
+	}
+	if (is_numeric(a) && is_numeric(b)) {
+		double x = to_double(a), y = to_double(b);
+		return (x > y) - (x < y);
+	}
+	if (a.type() == ValueType::STRING && b.type() == ValueType::STRING) {
+		int c = a.as_string()->compare(*b.as_string());
+		return (c > 0) - (c < 0);
+	}
+	ok = false;
+	return 0;
+}
+
+} // namespace
+
+const char *value_type_name(ValueType type) noexcept {
+	switch (type) {
+	case ValueType::NIL:
+		return "NULL";
+	case ValueType::BOOL:
+		return "boolean";
+	case ValueType::INT:
+		return "integer";
+	case ValueType::NUMBER:
+		return "number";
+	case ValueType::STRING:
+		return "string";
+	case ValueType::FUNCTION:
+	case ValueType::NATIVE:
+		return "function";
+	case ValueType::ARRAY:
+		return "array";
+	case ValueType::OBJECT:
+		return "object";
+	}
+	return "(unknown)";
+}
+
+int64_t Value::as_int() const noexcept {
+	return is_small_int() ? small_int() : pointer<BoxedInt>()->value;
+}
+
+Value Value::box_int(int64_t i, Heap &heap) noexcept {
+	return from_pointer(BOXED_INT_TAG, heap.make_int(i));
+}
+
+bool is_truthy(const Value &v) noexcept {
+	switch (v.type()) {
+	case ValueType::NIL:
+		return false;
+	case ValueType::BOOL:
+		return v.as_bool();
+	case ValueType::INT:
+		return v.as_int() != 0;
+	case ValueType::NUMBER:
+		return v.as_number() != 0;
+	default:
+		return true;
+	}
+}
+
+bool values_equal(const Value &a, const Value &b) noexcept {
+	if (is_numeric(a) && is_numeric(b)) {
+		if (a.type() == ValueType::INT && b.type() == ValueType::INT) {
+			return a.as_int() == b.as_int();
+		}
+		return to_double(a) == to_double(b);
+	}
+	if (a.type() == ValueType::STRING && b.type() == ValueType::STRING) {
+		return a.as_string() == b.as_string() ||
+			   *a.as_string() == *b.as_string();
+	}
+
+	// everything else is the same value only if it is the same word
+	return a.raw_bits() == b.raw_bits();
+}
+
+const char *binary_op(InstructionType op, const Value &a, const Value &b,
+					  Value &out, Heap &heap) noexcept {
+	using enum InstructionType;
+
+	switch (op) {
+	case EQ:
+		out = Value::from_bool(values_equal(a, b));
+		return nullptr;
+	case NE:
+		out = Value::from_bool(!values_equal(a, b));
+		return nullptr;
+	case AND:
+		out = Value::from_bool(is_truthy(a) && is_truthy(b));
+		return nullptr;
+	case OR:
+		out = Value::from_bool(is_truthy(a) || is_truthy(b));
+		return nullptr;
+	case LT:
+	case LE:
+	case GT:
+	case GE: {
+		bool ok;
+		int c = compare_values(a, b, ok);
+		if (!ok) {
+			return UNSUPPORTED_OPERANDS;
+		}
+		switch (op) {
+		case LT:
+			out = Value::from_bool(c < 0);
+			break;
+		case LE:
+			out = Value::from_bool(c <= 0);
+			break;
+		case GT:
+			out = Value::from_bool(c > 0);
+			break;
+		default:
+			out = Value::from_bool(c >= 0);
+			break;
+		}
+		return nullptr;
+	}
+	default:
+		break;
+	}
+
+	auto from_int = [&heap](int64_t i) { return Value::from_int(i, heap); };
+
+	if (a.type() == ValueType::INT && b.type() == ValueType::INT) {
+		int64_t x = a.as_int(), y = b.as_int();
+		switch (op) {
+		case ADD:
+			out = from_int(wrapping_add(x, y));
+			return nullptr;
+		case SUB:
+			out = from_int(wrapping_sub(x, y));
+			return nullptr;
+		case MUL:
+			out = from_int(wrapping_mul(x, y));
+			return nullptr;
+		case DIV:
+			out = Value::from_number(static_cast<double>(x) / y);
+			return nullptr;
+		case IDIV: {
+			if (y == 0) {
+				return "integer division by zero";
+			}
+			if (y == -1) {
+				out = from_int(wrapping_sub(0, x));
+				return nullptr;
+			}
+			// round towards negative infinity
+			int64_t q = x / y;
+			if (x % y != 0 && (x < 0) != (y < 0)) {
+				q--;
+			}
+			out = from_int(q);
+			return nullptr;
+		}
+		case MOD: {
+			if (y == 0) {
+				return "integer modulo by zero";
+			}
+			if (y == -1) {
+				out = from_int(0);
+				return nullptr;
+			}
+			// result has the same sign as the divisor
+			int64_t r = x % y;
+			if (r != 0 && (r < 0) != (y < 0)) {
+				r += y;
+			}
+			out = from_int(r);
+			return nullptr;
+		}
+		case POW:
+			if (y >= 0) {
+				out = from_int(wrapping_pow(x, y));
+			} else {
+				out = Value::from_number(std::pow(static_cast<double>(x),
+												  static_cast<double>(y)));
+			}
+			return nullptr;
+		case BXOR:
+			out = from_int(x ^ y);
+			return nullptr;
+		case BAND:
+			out = from_int(x & y);
+			return nullptr;
+		case BOR:
+			out = from_int(x | y);
+			return nullptr;
+		case SHL:
+			out = from_int(shift_left(x, y));
+			return nullptr;
+		case SHR:
+			out = from_int(shift_right(x, y));
+			return nullptr;
+		default:
+			return UNSUPPORTED_OPERANDS;
+		}
+	}
+
+	if (!is_numeric(a) || !is_numeric(b)) {
+		return UNSUPPORTED_OPERANDS;
+	}
+
+	double x = to_double(a), y = to_double(b);
+	switch (op) {
+	case ADD:
+		out = Value::from_number(x + y);
+		return nullptr;
+	case SUB:
+		out = Value::from_number(x - y);
+		return nullptr;
+	case MUL:
+		out = Value::from_number(x * y);
+		return nullptr;
+	case DIV:
+		out = Value::from_number(x / y);
+		return nullptr;
+	case IDIV:
+		out = Value::from_number(std::floor(x / y));
+		return nullptr;
+	case MOD: {
+		double r = std::fmod(x, y);
+		if (r != 0 && (r < 0) != (y < 0)) {
+			r += y;
+		}
+		out = Value::from_number(r);
+		return nullptr;
+	}
+	case POW:
+		out = Value::from_number(std::pow(x, y));
+		return nullptr;
+	case BXOR:
+	case BAND:
+	case BOR:
+	case SHL:
+	case SHR:
+		return "bitwise operation on non-integer";
+	default:
+		return UNSUPPORTED_OPERANDS;
+	}
+}
+
+const char *unary_op(InstructionType op, const Value &a, Value &out,
+					 Heap &heap) noexcept {
+	switch (op) {
+	case InstructionType::NOT:
+		out = Value::from_bool(!is_truthy(a));
+		return nullptr;
+	case InstructionType::NEG:
+		if (a.type() == ValueType::INT) {
+			out = Value::from_int(wrapping_sub(0, a.as_int()), heap);
+			return nullptr;
+		} else if (a.is_number()) {
+			out = Value::from_number(-a.as_number());
+			return nullptr;
+		}
+		return UNSUPPORTED_OPERANDS;
+	case InstructionType::BNOT:
+		if (a.type() == ValueType::INT) {
+			out = Value::from_int(~a.as_int(), heap);
+			return nullptr;
+		}
+		return "bitwise operation on non-integer";
+	default:
+		return UNSUPPORTED_OPERANDS;
+	}
+}
+
+void format_value(std::string &out, const Value &v, int depth) noexcept {
+	switch (v.type()) {
+	case ValueType::NIL:
+		out += "NULL";
+		break;
+	case ValueType::BOOL:
+		out += v.as_bool() ? "TRUE" : "FALSE";
+		break;
+	case ValueType::INT:
+		std::format_to(std::back_inserter(out), "{}", v.as_int());
+		break;
+	case ValueType::NUMBER:
+		std::format_to(std::back_inserter(out), "{}", v.as_number());
+		break;
+	case ValueType::STRING:
+		out += *v.as_string();
+		break;
+	case ValueType::FUNCTION:
+		out += "<function>";
+		break;
+	case ValueType::NATIVE:
+		out += "<native function>";
+		break;
+	case ValueType::ARRAY: {
+		if (depth >= 8) {
+			out += "[...]";
+			break;
+		}
+		const Array *arr = v.as_array();
+		out += '[';
+		for (uint32_t i = 0; i < arr->size; i++) {
+			if (i > 0) {
+				out += ", ";
+			}
+			format_value(out, arr->items[i], depth + 1);
+		}
+		out += ']';
+		break;
+	}
+	case ValueType::OBJECT:
+		out += "<object>";
+		break;
+	}
+}
+
+} // namespace cypheri
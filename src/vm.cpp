@@ -0,0 +1,1880 @@
+#include "cypheri/vm.hpp"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <format>
+#include <iterator>
+#include <utility>
+
+namespace cypheri {
+
+namespace {
+
+// Fill the first unused way, or give up on the site when all are taken
+void remember(PropertyCache &cache, PropertyCache::Entry entry) noexcept {
+	for (auto &way : cache.entries) {
+		if (!way.shape) {
+			way = entry;
+			return;
+		}
+	}
+	cache.megamorphic = true;
+}
+
+std::string operand_error(const char *msg, InstructionType op, const Value &a,
+						  const Value &b) noexcept {
+	return std::format("{} in {} ({}, {})", msg, op, value_type_name(a.type()),
+					   value_type_name(b.type()));
+}
+
+std::string operand_error(const char *msg, InstructionType op,
+						  const Value &a) noexcept {
+	return std::format("{} in {} ({})", msg, op, value_type_name(a.type()));
+}
+
+// Type feedback of a generic arithmetic instruction: the quickened variant
+// for the operands it is about to run with. Operands no variant covers, and
+// instructions without any, stay generic for good.
+PackedInstruction quicken(InstructionType op, const Value &a,
+						  const Value &b) noexcept {
+	using enum InstructionType;
+	bool numbers = a.is_number() && b.is_number();
+	InstructionType res = op;
+	switch (op) {
+	case ADD:
+		if (numbers) {
+			res = ADD_NN;
+		} else if (a.type() == ValueType::STRING ||
+				   b.type() == ValueType::STRING) {
+			res = CONCAT;
+		}
+		break;
+	case SUB:
+		res = numbers ? SUB_NN : op;
+		break;
+	case MUL:
+		res = numbers ? MUL_NN : op;
+		break;
+	case DIV:
+		if (numbers) {
+			res = DIV_NN;
+		} else if (a.is_small_int() && b.is_small_int()) {
+			res = DIV_II;
+		}
+		break;
+	case LT:
+		res = numbers ? LT_NN : op;
+		break;
+	case LE:
+		res = numbers ? LE_NN : op;
+		break;
+	case GT:
+		res = numbers ? GT_NN : op;
+		break;
+	case GE:
+		res = numbers ? GE_NN : op;
+		break;
+	default:
+		break;
+	}
+	return res == op ? pack_instruction(op, PACKED_GENERIC_SITE)
+					 : pack_instruction(res);
+}
+
+uint64_t now_ns() noexcept {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			   std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+} // namespace
+
+VM::VM(NameTable &name_table, VMOptions options) noexcept
+	: name_table(&name_table), options(options),
+	  stack(std::make_unique<Value[]>(options.stack_size)),
+	  stack_end(stack.get() + options.stack_size), stack_top(stack.get()) {
+	frames.reserve(options.max_call_depth);
+	if (CYPHERI_VM_PAIR_PROFILE) {
+		pair_counts.resize(INSTRUCTION_COUNT * INSTRUCTION_COUNT);
+	}
+	if (CYPHERI_VM_PROFILE) {
+		op_counts.resize(INSTRUCTION_COUNT);
+		frame_times.reserve(options.max_call_depth);
+		sample_countdown = options.sample_interval;
+	}
+}
+
+std::optional<RuntimeError> VM::load(const BytecodeModule &mod) noexcept {
+	auto image = CodeImage::build(mod, *name_table,
+								  {options.register_isa || options.jit,
+								   options.superinstructions});
+	if (auto *err = std::get_if<RuntimeError>(&image)) {
+		return std::move(*err);
+	}
+	load(std::get<std::shared_ptr<const CodeImage>>(std::move(image)));
+	return std::nullopt;
+}
+
+void VM::load(std::shared_ptr<const CodeImage> image) noexcept {
+	auto &loaded = images.emplace_back(std::move(image));
+	for (NameIdType name : loaded.image->global_names()) {
+		loaded.links.push_back(&global_cell(name));
+	}
+
+	for (const auto &func : loaded.image->functions()) {
+		functions.push_back(
+			{&func, &loaded.image->module(), loaded.links.data(),
+			 std::vector<PropertyCache>(func.packed.property_names.size()),
+			 func.packed.code});
+		NameIdType name = func.packed.name;
+		global_cell(name) = {Value::from_function(&functions.back()), name,
+							 true};
+	}
+}
+
+GlobalCell &VM::global_cell(NameIdType name) noexcept {
+	if (GlobalCell **cell = global_cells.find(name)) {
+		return **cell;
+	}
+	GlobalCell *cell = &globals.emplace_back(Value(), name, false);
+	global_cells[name] = cell;
+	return *cell;
+}
+
+void VM::define_native(std::string_view name, NativeFunction fn) noexcept {
+	NameIdType id = name_table->get_id_or_insert(name);
+	natives.push_back({id, std::move(fn)});
+	global_cell(id) = {Value::from_native(&natives.back()), id, true};
+}
+
+void VM::set_global(NameIdType name, Value value) noexcept {
+	global_cell(name) = {value, name, true};
+}
+
+std::optional<Value> VM::get_global(NameIdType name) const noexcept {
+	GlobalCell *const *cell = global_cells.find(name);
+	if (!cell || !(*cell)->defined) {
+		return std::nullopt;
+	}
+	return (*cell)->value;
+}
+
+std::variant<Value, RuntimeError>
+VM::call(NameIdType name, std::span<const Value> args) noexcept {
+	auto callee = get_global(name);
+	if (!callee) {
+		return RuntimeError(std::format("undefined global variable {}",
+										name_table->get_name(name)));
+	}
+	return call(*callee, args);
+}
+
+std::variant<Value, RuntimeError>
+VM::call(Value callee, std::span<const Value> args) noexcept {
+	if (static_cast<size_t>(stack_end - stack_top) < args.size()) {
+		return RuntimeError("stack overflow");
+	}
+	Value *base = stack_top;
+	std::copy(args.begin(), args.end(), base);
+	return execute(base, args.size(), callee);
+}
+
+std::variant<Coroutine *, RuntimeError>
+VM::spawn(Value callee, std::span<const Value> args) noexcept {
+	if (args.size() > options.coroutine_stack_size) {
+		return RuntimeError("stack overflow");
+	}
+
+	Coroutine *co = free_coroutines;
+	if (co) {
+		free_coroutines = co->next_free;
+	} else {
+		co = &coroutines.emplace_back();
+		co->stack = std::make_unique<Value[]>(options.coroutine_stack_size);
+	}
+	co->state = CoroutineStatus::SUSPENDED;
+	co->callee = callee;
+	co->argc = args.size();
+	co->sp = nullptr;
+	std::copy(args.begin(), args.end(), co->stack.get());
+	return co;
+}
+
+std::variant<Value, RuntimeError> VM::resume(Coroutine &co,
+											 Value sent) noexcept {
+	if (co.state != CoroutineStatus::SUSPENDED) {
+		return RuntimeError(co.state == CoroutineStatus::RUNNING
+								? "cannot resume a running coroutine"
+								: "cannot resume a finished coroutine");
+	}
+
+	// Switch to the coroutine's frames and stack segment, the resumer's
+	// are put back when it yields or returns
+	Coroutine *const saved_running = running;
+	Value *const saved_top = stack_top, *const saved_end = stack_end;
+	frames.swap(co.frames);
+	if (CYPHERI_VM_PROFILE) {
+		// the time it spent suspended isn't spent in its functions
+		frame_times.swap(co.frame_times);
+		uint64_t suspended = now_ns() - co.suspended_at;
+		for (auto &time : frame_times) {
+			time.start += suspended;
+		}
+	}
+	stack_end = co.stack.get() + options.coroutine_stack_size;
+	running = &co;
+	co.state = CoroutineStatus::RUNNING;
+
+	std::variant<Value, RuntimeError> res;
+	if (!co.sp) {
+		// first resume, the arguments are at the start of the segment
+		stack_top = co.stack.get() + co.argc;
+		res = execute(co.stack.get(), co.argc, co.callee);
+	} else {
+		*co.sp = sent;
+		stack_top = co.sp + 1;
+		res = run(0, co.sp + 1);
+	}
+
+	if (co.state == CoroutineStatus::RUNNING) {
+		// it returned or failed instead of yielding
+		co.state = std::holds_alternative<RuntimeError>(res)
+					   ? CoroutineStatus::FAILED
+					   : CoroutineStatus::DONE;
+	}
+	frames.swap(co.frames);
+	if (CYPHERI_VM_PROFILE) {
+		frame_times.swap(co.frame_times);
+		co.suspended_at = now_ns();
+	}
+	stack_top = saved_top;
+	stack_end = saved_end;
+	running = saved_running;
+	return res;
+}
+
+void VM::release(Coroutine &co) noexcept {
+	if (CYPHERI_VM_PROFILE) {
+		// frames of a coroutine left suspended never return
+		for (const auto &frame : co.frames) {
+			frame.func->times.active--;
+		}
+		co.frame_times.clear();
+	}
+	co.frames.clear(); // keeps the capacity for the next coroutine
+	co.callee = Value();
+	co.next_free = free_coroutines;
+	free_coroutines = &co;
+}
+
+Value VM::make_string(std::string str) noexcept {
+	strings.push_back(std::move(str));
+	return Value::from_string(&strings.back());
+}
+
+Heap &VM::heap() noexcept {
+	return objects;
+}
+
+NameTable &VM::names() const noexcept {
+	return *name_table;
+}
+
+std::vector<OpcodeCount> VM::opcode_profile() const noexcept {
+	std::vector<OpcodeCount> res;
+	for (size_t i = 0; i < op_counts.size(); i++) {
+		if (op_counts[i] != 0) {
+			res.push_back({static_cast<InstructionType>(i), op_counts[i]});
+		}
+	}
+	std::sort(res.begin(), res.end(),
+			  [](const OpcodeCount &a, const OpcodeCount &b) {
+				  return a.count > b.count;
+			  });
+	return res;
+}
+
+std::vector<FunctionProfile> VM::function_profile() const noexcept {
+	std::vector<FunctionProfile> res;
+	for (const auto &record : functions) {
+		if (record.times.calls != 0) {
+			res.push_back({record.code->packed.name, record.times});
+		}
+	}
+	std::sort(res.begin(), res.end(),
+			  [](const FunctionProfile &a, const FunctionProfile &b) {
+				  return a.times.exclusive_ns > b.times.exclusive_ns;
+			  });
+	return res;
+}
+
+std::vector<ProfileSample> VM::take_profile_samples() noexcept {
+	return std::exchange(samples, {});
+}
+
+std::vector<OpcodePairCount> VM::opcode_pair_profile() const noexcept {
+	std::vector<OpcodePairCount> res;
+	for (size_t i = 0; i < pair_counts.size(); i++) {
+		if (pair_counts[i] != 0) {
+			res.push_back({static_cast<InstructionType>(i / INSTRUCTION_COUNT),
+						   static_cast<InstructionType>(i % INSTRUCTION_COUNT),
+						   pair_counts[i]});
+		}
+	}
+	std::sort(res.begin(), res.end(),
+			  [](const OpcodePairCount &a, const OpcodePairCount &b) {
+				  return a.count > b.count;
+			  });
+	return res;
+}
+
+std::vector<PropertySiteStats> VM::property_cache_stats() const noexcept {
+	std::vector<PropertySiteStats> res;
+	for (const auto &record : functions) {
+		const auto &code = record.code->packed.code;
+		for (size_t pc = 0; pc < code.size(); pc++) {
+			InstructionType type = packed_type(code[pc]);
+			if (type != InstructionType::GET && type != InstructionType::SET) {
+				continue;
+			}
+			uint32_t site = packed_operand(code[pc]);
+			const auto &cache = record.property_caches[site];
+			if (cache.hits + cache.misses == 0) {
+				continue;
+			}
+			size_t shapes = std::count_if(
+				cache.entries.begin(), cache.entries.end(),
+				[](const PropertyCache::Entry &e) { return e.shape; });
+			res.push_back({record.code->packed.name,
+						   record.code->packed.property_names[site], pc, shapes,
+						   cache.megamorphic, cache.hits, cache.misses});
+		}
+	}
+	std::sort(res.begin(), res.end(),
+			  [](const PropertySiteStats &a, const PropertySiteStats &b) {
+				  return a.misses > b.misses;
+			  });
+	return res;
+}
+
+JitStats VM::jit_stats() const noexcept {
+	return jit_counts;
+}
+
+bool VM::push_frame(const FunctionRecord *func, Value *args, size_t argc,
+					size_t frame_size, std::string &error) noexcept {
+	const auto &code = func->code->packed;
+	if (argc != code.arg_count) {
+		error = std::format("function {} expects {} arguments, got {}",
+							name_table->get_name(code.name), code.arg_count,
+							argc);
+		return false;
+	}
+
+	if (frames.size() >= options.max_call_depth ||
+		static_cast<size_t>(stack_end - args) < frame_size) {
+		error = "stack overflow";
+		return false;
+	}
+
+	std::fill(args + argc, args + code.local_count, Value());
+	frames.push_back({func, {nullptr}, args});
+	if (CYPHERI_VM_PROFILE) {
+		func->times.calls++;
+		func->times.active++;
+		frame_times.push_back({now_ns(), 0});
+	}
+	return true;
+}
+
+// Charge the time of the top frame to its function, before it is popped
+void VM::profile_return() noexcept {
+	FrameTime time = frame_times.back();
+	frame_times.pop_back();
+	uint64_t elapsed = now_ns() - time.start;
+	FunctionTimes &times = frames[frame_times.size()].func->times;
+	times.exclusive_ns += elapsed - time.callees;
+	if (--times.active == 0) {
+		times.inclusive_ns += elapsed;
+	}
+	if (!frame_times.empty()) {
+		frame_times.back().callees += elapsed;
+	}
+}
+
+void VM::sample(const FunctionRecord *func, size_t pc,
+				bool registers) noexcept {
+	const auto &lines =
+		registers ? func->code->registers->lines : func->code->packed.lines;
+	samples.push_back({func->code->packed.name, static_cast<uint32_t>(pc),
+					   registers, lines.find(pc)});
+	sample_countdown = options.sample_interval;
+}
+
+Value VM::get_property(PropertyCache &cache, NameIdType name,
+					   const Object *obj) noexcept {
+	for (const auto &entry : cache.entries) {
+		if (entry.shape == obj->shape) {
+			cache.hits++;
+			return entry.slot == Heap::NO_SLOT ? Value()
+											   : obj->slots[entry.slot];
+		}
+		if (!entry.shape) {
+			break;
+		}
+	}
+
+	cache.misses++;
+	uint32_t slot = Heap::find_slot(obj->shape, name);
+	remember(cache, {obj->shape, obj->shape, slot});
+	return slot == Heap::NO_SLOT ? Value() : obj->slots[slot];
+}
+
+void VM::set_property(PropertyCache &cache, NameIdType name, Object *obj,
+					  Value value) noexcept {
+	for (const auto &entry : cache.entries) {
+		if (entry.shape == obj->shape) {
+			cache.hits++;
+			if (entry.next == entry.shape) {
+				obj->slots[entry.slot] = value;
+			} else {
+				objects.add_property(obj, entry.next, value);
+			}
+			return;
+		}
+		if (!entry.shape) {
+			break;
+		}
+	}
+
+	cache.misses++;
+	const Shape *shape = obj->shape;
+	uint32_t slot = Heap::find_slot(shape, name);
+	if (slot != Heap::NO_SLOT) {
+		obj->slots[slot] = value;
+		remember(cache, {shape, shape, slot});
+	} else {
+		const Shape *next = objects.transition(shape, name);
+		objects.add_property(obj, next, value);
+		remember(cache, {shape, next, next->size - 1});
+	}
+}
+
+bool VM::get_dynamic(const Value &obj, const Value &key, Value &out,
+					 std::string &error) noexcept {
+	if (obj.type() == ValueType::ARRAY && key.type() == ValueType::INT) {
+		const Array *arr = obj.as_array();
+		int64_t i = key.as_int();
+		if (i < 0 || i >= arr->size) {
+			error = std::format("array index {} out of range [0, {})", i,
+								arr->size);
+			return false;
+		}
+		out = arr->items[i];
+		return true;
+	}
+
+	if (obj.type() == ValueType::OBJECT && key.type() == ValueType::STRING) {
+		NameIdType name = name_table->get_id(*key.as_string());
+		out = name == NameTable::INVALID_ID ? Value()
+											: Heap::get(obj.as_object(), name);
+		return true;
+	}
+
+	error = std::format("attempt to index a {} value with a {} value",
+						value_type_name(obj.type()),
+						value_type_name(key.type()));
+	return false;
+}
+
+bool VM::set_dynamic(const Value &obj, const Value &key, const Value &value,
+					 std::string &error) noexcept {
+	if (obj.type() == ValueType::ARRAY && key.type() == ValueType::INT) {
+		Array *arr = obj.as_array();
+		int64_t i = key.as_int();
+		if (i == arr->size) {
+			objects.push(arr, value);
+			return true;
+		}
+		if (i < 0 || i > arr->size) {
+			error = std::format("array index {} out of range [0, {}]", i,
+								arr->size);
+			return false;
+		}
+		arr->items[i] = value;
+		return true;
+	}
+
+	if (obj.type() == ValueType::OBJECT && key.type() == ValueType::STRING) {
+		objects.set(obj.as_object(),
+					name_table->get_id_or_insert(*key.as_string()), value);
+		return true;
+	}
+
+	error = std::format("attempt to index a {} value with a {} value",
+						value_type_name(obj.type()),
+						value_type_name(key.type()));
+	return false;
+}
+
+RuntimeError VM::make_error(const std::string &message, NameIdType func,
+							const LineTable &lines, size_t pc) const noexcept {
+	if (auto loc = lines.find(pc)) {
+		return RuntimeError(std::format("{} (in {} at {}:{})", message,
+										name_table->get_name(func), loc->line,
+										loc->column));
+	}
+	return RuntimeError(std::format("{} (in {} at +{:0>4d})", message,
+									name_table->get_name(func), pc));
+}
+
+std::variant<Value, RuntimeError> VM::execute(Value *args, size_t argc,
+											  Value callee) noexcept {
+	if (callee.type() == ValueType::NATIVE) {
+		Value *saved_top = stack_top;
+		stack_top = args + argc;
+		auto res = callee.as_native()->fn(*this, {args, argc});
+		stack_top = saved_top;
+		return res;
+	}
+
+	if (callee.type() != ValueType::FUNCTION) {
+		return RuntimeError(std::format("attempt to call a {} value",
+										value_type_name(callee.type())));
+	}
+
+	const FunctionRecord *target = callee.as_function();
+	std::string error;
+	if (!push_call(target, args, argc, error)) {
+		return RuntimeError(error);
+	}
+	return run_call(target);
+}
+
+// Coroutines stay in the stack interpreter, so that every frame between a
+// resume and a YIELD is one it can suspend
+bool VM::push_call(const FunctionRecord *func, Value *args, size_t argc,
+				   std::string &error) noexcept {
+	if (func->code->registers && !running) {
+		return push_frame(func, args, argc,
+						  func->code->registers->register_count, error);
+	}
+	return push_frame(func, args, argc, func->code->frame_size, error);
+}
+
+std::variant<Value, RuntimeError>
+VM::run_call(const FunctionRecord *func) noexcept {
+	if (func->code->registers && !running) {
+		if (options.jit && tier_up(func)) {
+			return run_jit(frames.size() - 1);
+		}
+		frames.back().reg_pc = func->code->registers->instructions.data();
+		return run_registers(frames.size() - 1);
+	}
+	frames.back().pc = func->quickened.data();
+	return run(frames.size() - 1,
+			   frames.back().base + func->code->packed.local_count);
+}
+
+// Count the instruction about to run and take a sample when it is time, in
+// both interpreters
+#if CYPHERI_VM_PROFILE
+#define CYPHERI_VM_PROFILE_STEP(op, registers)                                 \
+	do {                                                                       \
+		op_counts[op]++;                                                       \
+		if (sample_countdown != 0 && --sample_countdown == 0) {                \
+			sample(func, pc - code, registers);                                \
+		}                                                                      \
+	} while (0)
+#else
+#define CYPHERI_VM_PROFILE_STEP(op, registers)                                 \
+	do {                                                                       \
+	} while (0)
+#endif
+
+// Run the stack interpreter from the saved pc of the top frame, with the
+// operand stack ending at sp, until the frame above entry_depth returns or
+// the running coroutine yields
+std::variant<Value, RuntimeError> VM::run(size_t entry_depth,
+										  Value *sp) noexcept {
+	std::string error;
+	std::optional<RuntimeError> failure;
+	Value *const saved_top = stack_top;
+
+	// Interpreter registers, everything the handlers touch lives here
+	const FunctionRecord *func = frames.back().func;
+	const PackedInstruction *code = func->quickened.data();
+	const PackedInstruction *pc = frames.back().pc;
+	const uint64_t *consts = func->code->packed.constants.data();
+	Value *locals = frames.back().base;
+	Value result;
+	size_t call_argc; // for do_call
+	Value call_target;
+	InstructionType generic_type; // for unquicken
+
+#if CYPHERI_VM_COMPUTED_GOTO
+	// Must be kept in the same order as InstructionType
+	static const void *const DISPATCH_TABLE[] = {
+		&&op_NOP,
+		&&op_UNSUPPORTED, // INVALID
+		&&op_ADD,
+		&&op_SUB,
+		&&op_MUL,
+		&&op_DIV,
+		&&op_MOD,
+		&&op_POW,
+		&&op_IDIV,
+		&&op_NEG,
+		&&op_BXOR,
+		&&op_BAND,
+		&&op_BOR,
+		&&op_BNOT,
+		&&op_SHL,
+		&&op_SHR,
+		&&op_EQ,
+		&&op_NE,
+		&&op_LT,
+		&&op_LE,
+		&&op_GT,
+		&&op_GE,
+		&&op_AND,
+		&&op_OR,
+		&&op_NOT,
+		&&op_LII,
+		&&op_LIN,
+		&&op_LIIW,
+		&&op_LINULL,
+		&&op_LIBOOL,
+		&&op_LISTR,
+		&&op_LIARR,
+		&&op_LIOBJ,
+		&&op_UNSUPPORTED, // LILAMBDA
+		&&op_LDGLOBAL,
+		&&op_LDLOCAL,
+		&&op_STGLOBAL,
+		&&op_STLOCAL,
+		&&op_POPN,
+		&&op_SWP,
+		&&op_ROT3,
+		&&op_DUP,
+		&&op_GET,
+		&&op_SET,
+		&&op_GETDNY,
+		&&op_SETDNY,
+		&&op_UNSUPPORTED, // NEWOBJ
+		&&op_JMP,
+		&&op_JZ,
+		&&op_JNZ,
+		&&op_CALL,
+		&&op_RET,
+		&&op_RETNULL,
+		&&op_YIELD,
+		&&op_UNSUPPORTED, // MOV
+		&&op_ADDLL,
+		&&op_LTLI_JZ,
+		&&op_CALLGLOBAL,
+		&&op_ADD_NN,
+		&&op_SUB_NN,
+		&&op_MUL_NN,
+		&&op_DIV_NN,
+		&&op_DIV_II,
+		&&op_LT_NN,
+		&&op_LE_NN,
+		&&op_GT_NN,
+		&&op_GE_NN,
+		&&op_CONCAT,
+	};
+
+	static_assert(std::size(DISPATCH_TABLE) == INSTRUCTION_COUNT,
+				  "dispatch table out of sync with InstructionType");
+
+// Not L_##op, <unistd.h> defines L_SET
+#define CYPHERI_VM_TARGET(op) op_##op:
+#define CYPHERI_VM_NEXT()                                                      \
+	do {                                                                       \
+		CYPHERI_VM_RECORD_PAIR();                                              \
+		CYPHERI_VM_PROFILE_STEP(*pc & 0xff, false);                            \
+		goto *DISPATCH_TABLE[*pc & 0xff];                                      \
+	} while (0)
+#else
+#define CYPHERI_VM_TARGET(op) case InstructionType::op:
+#define CYPHERI_VM_NEXT()                                                      \
+	do {                                                                       \
+		CYPHERI_VM_RECORD_PAIR();                                              \
+		CYPHERI_VM_PROFILE_STEP(*pc & 0xff, false);                            \
+		goto dispatch;                                                         \
+	} while (0)
+#endif
+
+#if CYPHERI_VM_PAIR_PROFILE
+	size_t last_op = static_cast<size_t>(InstructionType::NOP);
+#define CYPHERI_VM_RECORD_PAIR()                                               \
+	do {                                                                       \
+		size_t op = *pc & 0xff;                                                \
+		pair_counts[last_op * INSTRUCTION_COUNT + op]++;                       \
+		last_op = op;                                                          \
+	} while (0)
+#else
+#define CYPHERI_VM_RECORD_PAIR()                                               \
+	do {                                                                       \
+	} while (0)
+#endif
+
+	// Quicken the generic instruction at pc for operands a and b, unless it
+	// has been given up on
+#define CYPHERI_VM_QUICKEN(op, a, b)                                           \
+	do {                                                                       \
+		if (packed_operand(*pc) != PACKED_GENERIC_SITE) {                      \
+			func->quickened[pc - code] = quicken(InstructionType::op, a, b);   \
+		}                                                                      \
+	} while (0)
+
+	// Common shape of binary instructions, with a fast path for inline
+	// integers x and y
+#define CYPHERI_VM_BINARY(op, int_expr)                                        \
+	CYPHERI_VM_TARGET(op) {                                                    \
+		Value &a = sp[-2];                                                     \
+		const Value &b = sp[-1];                                               \
+		if (a.is_small_int() && b.is_small_int()) {                            \
+			int64_t x = a.small_int(), y = b.small_int();                      \
+			a = int_expr;                                                      \
+		} else {                                                               \
+			CYPHERI_VM_QUICKEN(op, a, b);                                      \
+			Value res;                                                         \
+			if (const char *msg =                                              \
+					binary_op(InstructionType::op, a, b, res, objects)) {      \
+				error = operand_error(msg, InstructionType::op, a, b);         \
+				goto error;                                                    \
+			}                                                                  \
+			a = res;                                                           \
+		}                                                                      \
+		--sp;                                                                  \
+		++pc;                                                                  \
+		CYPHERI_VM_NEXT();                                                     \
+	}
+
+#define CYPHERI_VM_BINARY_GENERIC(op)                                          \
+	CYPHERI_VM_TARGET(op) {                                                    \
+		CYPHERI_VM_QUICKEN(op, sp[-2], sp[-1]);                                \
+		Value res;                                                             \
+		if (const char *msg = binary_op(InstructionType::op, sp[-2], sp[-1],   \
+										res, objects)) {                       \
+			error = operand_error(msg, InstructionType::op, sp[-2], sp[-1]);   \
+			goto error;                                                        \
+		}                                                                      \
+		*(sp - 2) = res;                                                       \
+		--sp;                                                                  \
+		++pc;                                                                  \
+		CYPHERI_VM_NEXT();                                                     \
+	}
+
+	// Quickened instructions on two doubles x and y, anything else turns
+	// the site back into the generic instruction
+#define CYPHERI_VM_BINARY_NN(op, generic, num_expr)                            \
+	CYPHERI_VM_TARGET(op) {                                                    \
+		Value &a = sp[-2];                                                     \
+		const Value &b = sp[-1];                                               \
+		if (a.is_number() && b.is_number()) {                                  \
+			double x = a.as_number(), y = b.as_number();                       \
+			a = num_expr;                                                      \
+			--sp;                                                              \
+			++pc;                                                              \
+			CYPHERI_VM_NEXT();                                                 \
+		}                                                                      \
+		generic_type = InstructionType::generic;                               \
+		goto unquicken;                                                        \
+	}
+
+#define CYPHERI_VM_UNARY(op)                                                   \
+	CYPHERI_VM_TARGET(op) {                                                    \
+		Value res;                                                             \
+		if (const char *msg =                                                  \
+				unary_op(InstructionType::op, sp[-1], res, objects)) {         \
+			error = operand_error(msg, InstructionType::op, sp[-1]);           \
+			goto error;                                                        \
+		}                                                                      \
+		sp[-1] = res;                                                          \
+		++pc;                                                                  \
+		CYPHERI_VM_NEXT();                                                     \
+	}
+
+#if CYPHERI_VM_COMPUTED_GOTO
+	CYPHERI_VM_NEXT();
+#else
+dispatch:
+	switch (packed_type(*pc)) {
+#endif
+
+	CYPHERI_VM_TARGET(NOP) {
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(ADD) {
+		Value &a = sp[-2];
+		const Value &b = sp[-1];
+		if (a.is_small_int() && b.is_small_int()) {
+			a = Value::from_int(a.small_int() + b.small_int(), objects);
+			--sp;
+			++pc;
+			CYPHERI_VM_NEXT();
+		}
+		CYPHERI_VM_QUICKEN(ADD, a, b);
+	}
+
+add_slow: {
+	// also the slow path for ADDLL, with both operands pushed
+	Value &a = sp[-2];
+	const Value &b = sp[-1];
+	if (a.type() == ValueType::STRING || b.type() == ValueType::STRING) {
+		a = make_string(std::format("{}{}", a, b));
+	} else {
+		Value res;
+		if (const char *msg =
+				binary_op(InstructionType::ADD, a, b, res, objects)) {
+			error = operand_error(msg, InstructionType::ADD, a, b);
+			goto error;
+		}
+		a = res;
+	}
+	--sp;
+	++pc;
+	CYPHERI_VM_NEXT();
+}
+
+	CYPHERI_VM_BINARY(SUB, Value::from_int(x - y, objects))
+	CYPHERI_VM_BINARY(MUL, Value::from_int(wrapping_mul(x, y), objects))
+	CYPHERI_VM_BINARY_GENERIC(DIV)
+	CYPHERI_VM_BINARY_GENERIC(MOD)
+	CYPHERI_VM_BINARY_GENERIC(POW)
+	CYPHERI_VM_BINARY_GENERIC(IDIV)
+	CYPHERI_VM_UNARY(NEG)
+	CYPHERI_VM_BINARY(BXOR, Value::from_small_int(x ^ y))
+	CYPHERI_VM_BINARY(BAND, Value::from_small_int(x & y))
+	CYPHERI_VM_BINARY(BOR, Value::from_small_int(x | y))
+	CYPHERI_VM_UNARY(BNOT)
+	CYPHERI_VM_BINARY_GENERIC(SHL)
+	CYPHERI_VM_BINARY_GENERIC(SHR)
+	CYPHERI_VM_BINARY(EQ, Value::from_bool(x == y))
+	CYPHERI_VM_BINARY(NE, Value::from_bool(x != y))
+	CYPHERI_VM_BINARY(LT, Value::from_bool(x < y))
+	CYPHERI_VM_BINARY(LE, Value::from_bool(x <= y))
+	CYPHERI_VM_BINARY(GT, Value::from_bool(x > y))
+	CYPHERI_VM_BINARY(GE, Value::from_bool(x >= y))
+	CYPHERI_VM_BINARY_GENERIC(AND)
+	CYPHERI_VM_BINARY_GENERIC(OR)
+
+	CYPHERI_VM_TARGET(NOT) {
+		Value &a = sp[-1];
+		a = Value::from_bool(a.is_bool() ? !a.as_bool() : !is_truthy(a));
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LII) {
+		*sp++ = Value::from_small_int(packed_soperand(*pc));
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LIN) {
+		*sp++ = Value::from_number(
+			std::bit_cast<double>(consts[packed_operand(*pc)]));
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LIIW) {
+		*sp++ = Value::from_int(
+			static_cast<int64_t>(consts[packed_operand(*pc)]), objects);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LINULL) {
+		*sp++ = Value();
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LIBOOL) {
+		*sp++ = Value::from_bool(packed_operand(*pc) != 0);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LISTR) {
+		*sp++ = Value::from_string(&func->module->str_lits[packed_operand(*pc)]);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LIARR) {
+		uint32_t n = packed_operand(*pc);
+		sp -= n;
+		*sp = Value::from_array(objects.make_array({sp, n}));
+		++sp;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LIOBJ) {
+		*sp++ = Value::from_object(objects.make_object(packed_operand(*pc)));
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LDGLOBAL) {
+		const GlobalCell &global = *func->globals[packed_operand(*pc)];
+		if (!global.defined) {
+			error = std::format("undefined global variable {}",
+								name_table->get_name(global.name));
+			goto error;
+		}
+		*sp++ = global.value;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LDLOCAL) {
+		*sp++ = locals[packed_operand(*pc)];
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(STGLOBAL) {
+		GlobalCell &global = *func->globals[packed_operand(*pc)];
+		global.value = *--sp;
+		global.defined = true;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(STLOCAL) {
+		locals[packed_operand(*pc)] = *--sp;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(POPN) {
+		sp -= packed_operand(*pc);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(SWP) {
+		std::swap(sp[-1], sp[-2]);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(ROT3) {
+		Value c = sp[-1];
+		sp[-1] = sp[-2];
+		sp[-2] = sp[-3];
+		sp[-3] = c;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(DUP) {
+		*sp = sp[-1];
+		++sp;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(GET) {
+		Value &obj = sp[-1];
+		uint32_t site = packed_operand(*pc);
+		NameIdType name = func->code->packed.property_names[site];
+		if (obj.type() != ValueType::OBJECT) {
+			error = std::format("attempt to get property {} of a {} value",
+								name_table->get_name(name),
+								value_type_name(obj.type()));
+			goto error;
+		}
+		obj = get_property(func->property_caches[site], name, obj.as_object());
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(SET) {
+		const Value &obj = sp[-2];
+		uint32_t site = packed_operand(*pc);
+		NameIdType name = func->code->packed.property_names[site];
+		if (obj.type() != ValueType::OBJECT) {
+			error = std::format("attempt to set property {} of a {} value",
+								name_table->get_name(name),
+								value_type_name(obj.type()));
+			goto error;
+		}
+		set_property(func->property_caches[site], name, obj.as_object(),
+					 sp[-1]);
+		--sp;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(GETDNY) {
+		Value res;
+		if (!get_dynamic(sp[-2], sp[-1], res, error)) {
+			goto error;
+		}
+		sp[-2] = res;
+		--sp;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(SETDNY) {
+		if (!set_dynamic(sp[-3], sp[-2], sp[-1], error)) {
+			goto error;
+		}
+		sp -= 2;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(JMP) {
+		pc = code + packed_operand(*pc);
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(JZ) {
+		const Value &v = *--sp;
+		bool cond = v.is_bool() ? v.as_bool() : is_truthy(v);
+		pc = cond ? pc + 1 : code + packed_operand(*pc);
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(JNZ) {
+		const Value &v = *--sp;
+		bool cond = v.is_bool() ? v.as_bool() : is_truthy(v);
+		pc = cond ? code + packed_operand(*pc) : pc + 1;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(CALL) {
+		call_argc = packed_operand(*pc);
+		call_target = *--sp;
+		goto do_call;
+	}
+
+	CYPHERI_VM_TARGET(CALLGLOBAL) {
+		uint32_t operand = packed_operand(*pc);
+		const GlobalCell &global =
+			*func->globals[operand & ((1u << CALLGLOBAL_SLOT_BITS) - 1)];
+		if (!global.defined) {
+			error = std::format("undefined global variable {}",
+								name_table->get_name(global.name));
+			goto error;
+		}
+		call_argc = operand >> CALLGLOBAL_SLOT_BITS;
+		call_target = global.value;
+		goto do_call;
+	}
+
+do_call: {
+	Value *call_args = sp - call_argc;
+	if (call_target.type() == ValueType::FUNCTION &&
+		(!call_target.as_function()->code->registers || running)) {
+		const FunctionRecord *callee_func = call_target.as_function();
+		frames.back().pc = pc + 1;
+		if (!push_frame(callee_func, call_args, call_argc,
+						callee_func->code->frame_size, error)) {
+			goto error;
+		}
+		func = callee_func;
+		code = func->quickened.data();
+		pc = code;
+		consts = func->code->packed.constants.data();
+		locals = call_args;
+		sp = locals + func->code->packed.local_count;
+		CYPHERI_VM_NEXT();
+	}
+
+	// register functions, errors raised in them are located already
+	stack_top = sp;
+	if (call_target.type() == ValueType::FUNCTION) {
+		const FunctionRecord *callee_func = call_target.as_function();
+		frames.back().pc = pc + 1;
+		if (!push_call(callee_func, call_args, call_argc, error)) {
+			goto error;
+		}
+		auto res = run_call(callee_func);
+		if (auto *err = std::get_if<RuntimeError>(&res)) {
+			failure = std::move(*err);
+			goto unwind;
+		}
+		*call_args = std::get<Value>(res);
+		sp = call_args + 1;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	// natives and values that can't be called
+	auto res = execute(call_args, call_argc, call_target);
+	if (auto *err = std::get_if<RuntimeError>(&res)) {
+		error = std::move(err->message);
+		goto error;
+	}
+	*call_args = std::get<Value>(res);
+	sp = call_args + 1;
+	++pc;
+	CYPHERI_VM_NEXT();
+}
+
+	CYPHERI_VM_TARGET(ADDLL) {
+		uint32_t operand = packed_operand(*pc);
+		const Value &a = locals[operand & ((1u << ADDLL_LOCAL_BITS) - 1)];
+		const Value &b = locals[operand >> ADDLL_LOCAL_BITS];
+		if (a.is_small_int() && b.is_small_int()) {
+			*sp++ = Value::from_int(a.small_int() + b.small_int(), objects);
+			++pc;
+			CYPHERI_VM_NEXT();
+		}
+		sp[0] = a;
+		sp[1] = b;
+		sp += 2;
+		goto add_slow;
+	}
+
+	CYPHERI_VM_TARGET(LTLI_JZ) {
+		uint64_t operand = consts[packed_operand(*pc)];
+		const Value &a = locals[(operand >> 32) & 0xffff];
+		auto k = static_cast<int16_t>(operand >> 48);
+		bool cond;
+		if (a.is_small_int()) {
+			cond = a.small_int() < k;
+		} else {
+			Value b = Value::from_small_int(k), res;
+			if (const char *msg =
+					binary_op(InstructionType::LT, a, b, res, objects)) {
+				error = operand_error(msg, InstructionType::LT, a, b);
+				goto error;
+			}
+			cond = res.as_bool();
+		}
+		pc = cond ? pc + 1 : code + static_cast<uint32_t>(operand);
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_BINARY_NN(ADD_NN, ADD, Value::from_number(x + y))
+	CYPHERI_VM_BINARY_NN(SUB_NN, SUB, Value::from_number(x - y))
+	CYPHERI_VM_BINARY_NN(MUL_NN, MUL, Value::from_number(x * y))
+	CYPHERI_VM_BINARY_NN(DIV_NN, DIV, Value::from_number(x / y))
+	// NaN compares as equal to everything, like in the generic ones
+	CYPHERI_VM_BINARY_NN(LT_NN, LT, Value::from_bool(x < y))
+	CYPHERI_VM_BINARY_NN(LE_NN, LE, Value::from_bool(!(x > y)))
+	CYPHERI_VM_BINARY_NN(GT_NN, GT, Value::from_bool(x > y))
+	CYPHERI_VM_BINARY_NN(GE_NN, GE, Value::from_bool(!(x < y)))
+
+	CYPHERI_VM_TARGET(DIV_II) {
+		Value &a = sp[-2];
+		const Value &b = sp[-1];
+		if (a.is_small_int() && b.is_small_int()) {
+			a = Value::from_number(static_cast<double>(a.small_int()) /
+								   b.small_int());
+			--sp;
+			++pc;
+			CYPHERI_VM_NEXT();
+		}
+		generic_type = InstructionType::DIV;
+		goto unquicken;
+	}
+
+	CYPHERI_VM_TARGET(CONCAT) {
+		Value &a = sp[-2];
+		const Value &b = sp[-1];
+		if (a.type() == ValueType::STRING || b.type() == ValueType::STRING) {
+			a = make_string(std::format("{}{}", a, b));
+			--sp;
+			++pc;
+			CYPHERI_VM_NEXT();
+		}
+		generic_type = InstructionType::ADD;
+		goto unquicken;
+	}
+
+unquicken: {
+	// dispatched again as the generic instruction, which it stays
+	func->quickened[pc - code] =
+		pack_instruction(generic_type, PACKED_GENERIC_SITE);
+	CYPHERI_VM_NEXT();
+}
+
+	CYPHERI_VM_TARGET(RET) {
+		result = sp[-1];
+		goto do_return;
+	}
+
+	CYPHERI_VM_TARGET(RETNULL) {
+		result = Value();
+		goto do_return;
+	}
+
+	CYPHERI_VM_TARGET(YIELD) {
+		// only frames of this run can be suspended, not the C++ frames of
+		// natives below it
+		if (!running || entry_depth != 0) {
+			error = running ? "attempt to yield across a native call"
+							: "attempt to yield outside a coroutine";
+			goto error;
+		}
+		result = *--sp;
+		frames.back().pc = pc + 1;
+		running->sp = sp;
+		running->state = CoroutineStatus::SUSPENDED;
+		stack_top = saved_top;
+		return result;
+	}
+
+#if CYPHERI_VM_COMPUTED_GOTO
+op_UNSUPPORTED:
+#else
+	default:
+#endif
+	error = std::format("unsupported instruction {}", packed_type(*pc));
+	goto error;
+
+#if !CYPHERI_VM_COMPUTED_GOTO
+	}
+#endif
+
+do_return: {
+	// the result replaces the callee's arguments on the caller's stack
+	Value *base = frames.back().base;
+	if (CYPHERI_VM_PROFILE) {
+		profile_return();
+	}
+	frames.pop_back();
+	if (frames.size() == entry_depth) {
+		stack_top = saved_top;
+		return result;
+	}
+
+	const auto &caller = frames.back();
+	func = caller.func;
+	code = func->quickened.data();
+	pc = caller.pc;
+	consts = func->code->packed.constants.data();
+	locals = caller.base;
+	sp = base;
+	*sp++ = result;
+	CYPHERI_VM_NEXT();
+}
+
+error:
+	failure = make_error(error, func->code->packed.name,
+						 func->code->packed.lines, pc - code);
+unwind:
+	while (CYPHERI_VM_PROFILE && frame_times.size() > entry_depth) {
+		profile_return();
+	}
+	frames.resize(entry_depth);
+	stack_top = saved_top;
+	return std::move(*failure);
+
+#undef CYPHERI_VM_UNARY
+#undef CYPHERI_VM_BINARY_NN
+#undef CYPHERI_VM_BINARY_GENERIC
+#undef CYPHERI_VM_BINARY
+#undef CYPHERI_VM_QUICKEN
+#undef CYPHERI_VM_RECORD_PAIR
+#undef CYPHERI_VM_NEXT
+#undef CYPHERI_VM_TARGET
+}
+
+// Run the register interpreter from the saved pc of the top frame, until the
+// frame above entry_depth returns
+std::variant<Value, RuntimeError>
+VM::run_registers(size_t entry_depth) noexcept {
+	std::string error;
+	std::optional<RuntimeError> failure;
+	Value *const saved_top = stack_top;
+
+	const FunctionRecord *func = frames.back().func;
+	const RegisterInstruction *code = func->code->registers->instructions.data();
+	const RegisterInstruction *pc = frames.back().reg_pc;
+	const uint64_t *consts = func->code->registers->constants.data();
+	Value *reg = frames.back().base;
+	Value result;
+
+#if CYPHERI_VM_COMPUTED_GOTO
+	// Must be kept in the same order as InstructionType
+	static const void *const DISPATCH_TABLE[] = {
+		&&op_NOP,
+		&&op_UNSUPPORTED, // INVALID
+		&&op_ADD,
+		&&op_SUB,
+		&&op_MUL,
+		&&op_DIV,
+		&&op_MOD,
+		&&op_POW,
+		&&op_IDIV,
+		&&op_NEG,
+		&&op_BXOR,
+		&&op_BAND,
+		&&op_BOR,
+		&&op_BNOT,
+		&&op_SHL,
+		&&op_SHR,
+		&&op_EQ,
+		&&op_NE,
+		&&op_LT,
+		&&op_LE,
+		&&op_GT,
+		&&op_GE,
+		&&op_AND,
+		&&op_OR,
+		&&op_NOT,
+		&&op_LII,
+		&&op_LIN,
+		&&op_LIIW,
+		&&op_LINULL,
+		&&op_LIBOOL,
+		&&op_LISTR,
+		&&op_UNSUPPORTED, // LIARR
+		&&op_UNSUPPORTED, // LIOBJ
+		&&op_UNSUPPORTED, // LILAMBDA
+		&&op_LDGLOBAL,
+		&&op_UNSUPPORTED, // LDLOCAL
+		&&op_STGLOBAL,
+		&&op_UNSUPPORTED, // STLOCAL
+		&&op_UNSUPPORTED, // POPN
+		&&op_UNSUPPORTED, // SWP
+		&&op_UNSUPPORTED, // ROT3
+		&&op_UNSUPPORTED, // DUP
+		&&op_UNSUPPORTED, // GET
+		&&op_UNSUPPORTED, // SET
+		&&op_UNSUPPORTED, // GETDNY
+		&&op_UNSUPPORTED, // SETDNY
+		&&op_UNSUPPORTED, // NEWOBJ
+		&&op_JMP,
+		&&op_JZ,
+		&&op_JNZ,
+		&&op_CALL,
+		&&op_RET,
+		&&op_RETNULL,
+		&&op_UNSUPPORTED, // YIELD
+		&&op_MOV,
+		&&op_UNSUPPORTED, // ADDLL
+		&&op_UNSUPPORTED, // LTLI_JZ
+		&&op_UNSUPPORTED, // CALLGLOBAL
+		&&op_UNSUPPORTED, // ADD_NN
+		&&op_UNSUPPORTED, // SUB_NN
+		&&op_UNSUPPORTED, // MUL_NN
+		&&op_UNSUPPORTED, // DIV_NN
+		&&op_UNSUPPORTED, // DIV_II
+		&&op_UNSUPPORTED, // LT_NN
+		&&op_UNSUPPORTED, // LE_NN
+		&&op_UNSUPPORTED, // GT_NN
+		&&op_UNSUPPORTED, // GE_NN
+		&&op_UNSUPPORTED, // CONCAT
+	};
+
+	static_assert(std::size(DISPATCH_TABLE) == INSTRUCTION_COUNT,
+				  "dispatch table out of sync with InstructionType");
+
+#define CYPHERI_VM_TARGET(op) op_##op:
+#define CYPHERI_VM_NEXT()                                                      \
+	do {                                                                       \
+		CYPHERI_VM_PROFILE_STEP(static_cast<size_t>(pc->type), true);          \
+		goto *DISPATCH_TABLE[static_cast<size_t>(pc->type)];                   \
+	} while (0)
+#else
+#define CYPHERI_VM_TARGET(op) case InstructionType::op:
+#define CYPHERI_VM_NEXT()                                                      \
+	do {                                                                       \
+		CYPHERI_VM_PROFILE_STEP(static_cast<size_t>(pc->type), true);          \
+		goto dispatch;                                                         \
+	} while (0)
+#endif
+
+#define CYPHERI_VM_BINARY(op, int_expr)                                        \
+	CYPHERI_VM_TARGET(op) {                                                    \
+		const Value &a = reg[pc->b()];                                         \
+		const Value &b = reg[pc->c()];                                         \
+		if (a.is_small_int() && b.is_small_int()) {                            \
+			int64_t x = a.small_int(), y = b.small_int();                      \
+			reg[pc->a] = int_expr;                                             \
+		} else {                                                               \
+			Value res;                                                         \
+			if (const char *msg =                                              \
+					binary_op(InstructionType::op, a, b, res, objects)) {      \
+				error = operand_error(msg, InstructionType::op, a, b);         \
+				goto error;                                                    \
+			}                                                                  \
+			reg[pc->a] = res;                                                  \
+		}                                                                      \
+		++pc;                                                                  \
+		CYPHERI_VM_NEXT();                                                     \
+	}
+
+#define CYPHERI_VM_BINARY_GENERIC(op)                                          \
+	CYPHERI_VM_TARGET(op) {                                                    \
+		const Value &a = reg[pc->b()];                                         \
+		const Value &b = reg[pc->c()];                                         \
+		Value res;                                                             \
+		if (const char *msg =                                                  \
+				binary_op(InstructionType::op, a, b, res, objects)) {          \
+			error = operand_error(msg, InstructionType::op, a, b);             \
+			goto error;                                                        \
+		}                                                                      \
+		reg[pc->a] = res;                                                      \
+		++pc;                                                                  \
+		CYPHERI_VM_NEXT();                                                     \
+	}
+
+#define CYPHERI_VM_UNARY(op)                                                   \
+	CYPHERI_VM_TARGET(op) {                                                    \
+		const Value &a = reg[pc->b()];                                         \
+		Value res;                                                             \
+		if (const char *msg = unary_op(InstructionType::op, a, res, objects)) {\
+			error = operand_error(msg, InstructionType::op, a);                \
+			goto error;                                                        \
+		}                                                                      \
+		reg[pc->a] = res;                                                      \
+		++pc;                                                                  \
+		CYPHERI_VM_NEXT();                                                     \
+	}
+
+#if CYPHERI_VM_COMPUTED_GOTO
+	CYPHERI_VM_NEXT();
+#else
+dispatch:
+	switch (pc->type) {
+#endif
+
+	CYPHERI_VM_TARGET(NOP) {
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(ADD) {
+		const Value &a = reg[pc->b()];
+		const Value &b = reg[pc->c()];
+		if (a.is_small_int() && b.is_small_int()) {
+			reg[pc->a] = Value::from_int(a.small_int() + b.small_int(), objects);
+		} else if (a.type() == ValueType::STRING ||
+				   b.type() == ValueType::STRING) {
+			reg[pc->a] = make_string(std::format("{}{}", a, b));
+		} else {
+			Value res;
+			if (const char *msg =
+					binary_op(InstructionType::ADD, a, b, res, objects)) {
+				error = operand_error(msg, InstructionType::ADD, a, b);
+				goto error;
+			}
+			reg[pc->a] = res;
+		}
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_BINARY(SUB, Value::from_int(x - y, objects))
+	CYPHERI_VM_BINARY(MUL, Value::from_int(wrapping_mul(x, y), objects))
+	CYPHERI_VM_BINARY_GENERIC(DIV)
+	CYPHERI_VM_BINARY_GENERIC(MOD)
+	CYPHERI_VM_BINARY_GENERIC(POW)
+	CYPHERI_VM_BINARY_GENERIC(IDIV)
+	CYPHERI_VM_UNARY(NEG)
+	CYPHERI_VM_BINARY(BXOR, Value::from_small_int(x ^ y))
+	CYPHERI_VM_BINARY(BAND, Value::from_small_int(x & y))
+	CYPHERI_VM_BINARY(BOR, Value::from_small_int(x | y))
+	CYPHERI_VM_UNARY(BNOT)
+	CYPHERI_VM_BINARY_GENERIC(SHL)
+	CYPHERI_VM_BINARY_GENERIC(SHR)
+	CYPHERI_VM_BINARY(EQ, Value::from_bool(x == y))
+	CYPHERI_VM_BINARY(NE, Value::from_bool(x != y))
+	CYPHERI_VM_BINARY(LT, Value::from_bool(x < y))
+	CYPHERI_VM_BINARY(LE, Value::from_bool(x <= y))
+	CYPHERI_VM_BINARY(GT, Value::from_bool(x > y))
+	CYPHERI_VM_BINARY(GE, Value::from_bool(x >= y))
+	CYPHERI_VM_BINARY_GENERIC(AND)
+	CYPHERI_VM_BINARY_GENERIC(OR)
+
+	CYPHERI_VM_TARGET(NOT) {
+		const Value &a = reg[pc->b()];
+		reg[pc->a] =
+			Value::from_bool(a.is_bool() ? !a.as_bool() : !is_truthy(a));
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(MOV) {
+		reg[pc->a] = reg[pc->b()];
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LII) {
+		reg[pc->a] = Value::from_small_int(static_cast<int32_t>(pc->k));
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LIN) {
+		reg[pc->a] = Value::from_number(std::bit_cast<double>(consts[pc->k]));
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LIIW) {
+		reg[pc->a] =
+			Value::from_int(static_cast<int64_t>(consts[pc->k]), objects);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LINULL) {
+		reg[pc->a] = Value();
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LIBOOL) {
+		reg[pc->a] = Value::from_bool(pc->k != 0);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LISTR) {
+		reg[pc->a] = Value::from_string(&func->module->str_lits[pc->k]);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(LDGLOBAL) {
+		const GlobalCell &global = *func->globals[pc->k];
+		if (!global.defined) {
+			error = std::format("undefined global variable {}",
+								name_table->get_name(global.name));
+			goto error;
+		}
+		reg[pc->a] = global.value;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(STGLOBAL) {
+		GlobalCell &global = *func->globals[pc->k];
+		global.value = reg[pc->a];
+		global.defined = true;
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(JMP) {
+		pc = code + pc->k;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(JZ) {
+		const Value &v = reg[pc->a];
+		bool cond = v.is_bool() ? v.as_bool() : is_truthy(v);
+		pc = cond ? pc + 1 : code + pc->k;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(JNZ) {
+		const Value &v = reg[pc->a];
+		bool cond = v.is_bool() ? v.as_bool() : is_truthy(v);
+		pc = cond ? code + pc->k : pc + 1;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(CALL) {
+		size_t n = pc->b();
+		Value *call_args = reg + pc->a;
+		Value target = call_args[n];
+
+		if (target.type() == ValueType::FUNCTION &&
+			target.as_function()->code->registers) {
+			const FunctionRecord *callee_func = target.as_function();
+			frames.back().reg_pc = pc + 1;
+			size_t size = callee_func->code->registers->register_count;
+			if (!push_frame(callee_func, call_args, n, size, error)) {
+				goto error;
+			}
+			if (options.jit && tier_up(callee_func)) {
+				auto res = run_jit(frames.size() - 1);
+				if (auto *err = std::get_if<RuntimeError>(&res)) {
+					// located where it was raised already
+					failure = std::move(*err);
+					goto unwind;
+				}
+				*call_args = std::get<Value>(res);
+				++pc;
+				CYPHERI_VM_NEXT();
+			}
+			func = callee_func;
+			code = func->code->registers->instructions.data();
+			pc = code;
+			consts = func->code->registers->constants.data();
+			reg = call_args;
+			CYPHERI_VM_NEXT();
+		}
+
+		// the callee's frame may reuse everything from the arguments on
+		stack_top = call_args + n + 1;
+		if (target.type() == ValueType::FUNCTION) {
+			// one without a register form, located like the ones above
+			const FunctionRecord *callee_func = target.as_function();
+			frames.back().reg_pc = pc + 1;
+			if (!push_call(callee_func, call_args, n, error)) {
+				goto error;
+			}
+			auto res = run_call(callee_func);
+			if (auto *err = std::get_if<RuntimeError>(&res)) {
+				failure = std::move(*err);
+				goto unwind;
+			}
+			*call_args = std::get<Value>(res);
+			++pc;
+			CYPHERI_VM_NEXT();
+		}
+		auto res = execute(call_args, n, target);
+		if (auto *err = std::get_if<RuntimeError>(&res)) {
+			error = std::move(err->message);
+			goto error;
+		}
+		*call_args = std::get<Value>(res);
+		++pc;
+		CYPHERI_VM_NEXT();
+	}
+
+	CYPHERI_VM_TARGET(RET) {
+		result = reg[pc->a];
+		goto do_return;
+	}
+
+	CYPHERI_VM_TARGET(RETNULL) {
+		result = Value();
+		goto do_return;
+	}
+
+#if CYPHERI_VM_COMPUTED_GOTO
+op_UNSUPPORTED:
+#else
+	default:
+#endif
+	error = std::format("unsupported instruction {}", pc->type);
+	goto error;
+
+#if !CYPHERI_VM_COMPUTED_GOTO
+	}
+#endif
+
+do_return: {
+	// the result goes to the register the caller's CALL named as frame start
+	Value *base = frames.back().base;
+	if (CYPHERI_VM_PROFILE) {
+		profile_return();
+	}
+	frames.pop_back();
+	if (frames.size() == entry_depth) {
+		stack_top = saved_top;
+		return result;
+	}
+
+	const auto &caller = frames.back();
+	func = caller.func;
+	code = func->code->registers->instructions.data();
+	pc = caller.reg_pc;
+	consts = func->code->registers->constants.data();
+	reg = caller.base;
+	*base = result;
+	CYPHERI_VM_NEXT();
+}
+
+error:
+	failure = make_error(error, func->code->packed.name,
+						 func->code->registers->lines, pc - code);
+unwind:
+	while (CYPHERI_VM_PROFILE && frame_times.size() > entry_depth) {
+		profile_return();
+	}
+	frames.resize(entry_depth);
+	stack_top = saved_top;
+	return std::move(*failure);
+
+#undef CYPHERI_VM_UNARY
+#undef CYPHERI_VM_BINARY_GENERIC
+#undef CYPHERI_VM_BINARY
+#undef CYPHERI_VM_NEXT
+#undef CYPHERI_VM_TARGET
+}
+
+#undef CYPHERI_VM_PROFILE_STEP
+
+// Count a call to func towards compiling it, compiling it on the call that
+// reaches the threshold. Returns its native code, if it has any.
+const JitFunction *VM::tier_up(const FunctionRecord *func) noexcept {
+	static constexpr JitHelpers HELPERS{jit_slow, jit_call, is_truthy};
+	uint32_t threshold = std::max<uint32_t>(options.jit_threshold, 1);
+	if (!func->jit && func->hotness < threshold &&
+		++func->hotness == threshold) {
+		if (auto jit = JitFunction::compile(*func, HELPERS)) {
+			jit_counts.functions++;
+			jit_counts.code_bytes += jit->code_size();
+			func->jit = jit.get();
+			jit_code.push_back(std::move(jit));
+		}
+	}
+	return func->jit;
+}
+
+// Run the native code of the top frame's function, on the C stack like a
+// native, until the frame above entry_depth returns. A frame that
+// deoptimizes finishes in the register interpreter. Errors come back
+// located where they were raised.
+std::variant<Value, RuntimeError> VM::run_jit(size_t entry_depth) noexcept {
+	Value *const saved_top = stack_top;
+	JitResult res = frames.back().func->jit->run(*this, frames.back().base);
+	return finish_jit(res, entry_depth, saved_top);
+}
+
+std::variant<Value, RuntimeError>
+VM::finish_jit(JitResult res, size_t entry_depth, Value *saved_top) noexcept {
+	const FunctionRecord *func = frames.back().func;
+	if (res.status == JIT_RETURNED) {
+		if (CYPHERI_VM_PROFILE) {
+			profile_return();
+		}
+		frames.pop_back();
+		stack_top = saved_top;
+		return std::bit_cast<Value>(res.value);
+	}
+
+	if (res.status == JIT_FAILED) {
+		while (CYPHERI_VM_PROFILE && frame_times.size() > entry_depth) {
+			profile_return();
+		}
+		frames.resize(entry_depth);
+		stack_top = saved_top;
+		RuntimeError err = std::move(*jit_error);
+		jit_error.reset();
+		return err;
+	}
+
+	jit_counts.deopts++;
+	stack_top = saved_top;
+	frames.back().reg_pc =
+		func->code->registers->instructions.data() + (res.status - 1);
+	return run_registers(entry_depth);
+}
+
+// Same as the register interpreter's slow paths, for the instructions the
+// compiler leaves to them. Errors are left to the interpreter to raise.
+bool VM::jit_slow(VM *vm, const FunctionRecord *func, Value *reg,
+				  const RegisterInstruction *inst) noexcept {
+	const Value &a = reg[inst->b()];
+	const Value &b = reg[inst->c()];
+	Value res;
+	switch (inst->type) {
+	case InstructionType::NOT:
+		res = Value::from_bool(!is_truthy(a));
+		break;
+	case InstructionType::NEG:
+	case InstructionType::BNOT:
+		if (unary_op(inst->type, a, res, vm->objects)) {
+			return false;
+		}
+		break;
+	case InstructionType::LIIW:
+		res = Value::from_int(
+			static_cast<int64_t>(func->code->registers->constants[inst->k]),
+			vm->objects);
+		break;
+	default:
+		if (inst->type == InstructionType::ADD &&
+			(a.type() == ValueType::STRING || b.type() == ValueType::STRING)) {
+			res = vm->make_string(std::format("{}{}", a, b));
+		} else if (binary_op(inst->type, a, b, res, vm->objects)) {
+			return false;
+		}
+		break;
+	}
+	reg[inst->a] = res;
+	return true;
+}
+
+// A CALL from native code. Calls the interpreter would fail before running
+// anything deoptimize, so that it reports them, other errors are located
+// the way the interpreter locates them.
+uint64_t VM::jit_call(VM *vm, const FunctionRecord *func, Value *reg,
+					  const RegisterInstruction *inst) noexcept {
+	size_t n = inst->b();
+	Value *call_args = reg + inst->a;
+	Value target = call_args[n];
+	size_t pc = inst - func->code->registers->instructions.data();
+	const uint64_t deopt = pc + 1;
+
+	std::variant<Value, RuntimeError> res;
+	if (target.type() == ValueType::FUNCTION &&
+		target.as_function()->code->registers) {
+		// like a call the register interpreter makes without leaving its loop
+		const FunctionRecord *callee = target.as_function();
+		std::string error;
+		if (!vm->push_frame(callee, call_args, n,
+							callee->code->registers->register_count, error)) {
+			return deopt;
+		}
+		if (vm->tier_up(callee)) {
+			// returning is the common case, without building a variant
+			Value *const saved_top = vm->stack_top;
+			JitResult direct = callee->jit->run(*vm, vm->frames.back().base);
+			if (direct.status == JIT_RETURNED) {
+				if (CYPHERI_VM_PROFILE) {
+					vm->profile_return();
+				}
+				vm->frames.pop_back();
+				vm->stack_top = saved_top;
+				*call_args = std::bit_cast<Value>(direct.value);
+				return JIT_RETURNED;
+			}
+			res = vm->finish_jit(direct, vm->frames.size() - 1, saved_top);
+		} else {
+			vm->frames.back().reg_pc =
+				callee->code->registers->instructions.data();
+			res = vm->run_registers(vm->frames.size() - 1);
+		}
+		if (auto *err = std::get_if<RuntimeError>(&res)) {
+			vm->jit_error = std::move(*err);
+			return JIT_FAILED;
+		}
+	} else {
+		if (target.type() != ValueType::FUNCTION &&
+			target.type() != ValueType::NATIVE) {
+			return deopt;
+		}
+		vm->stack_top = call_args + n + 1;
+		if (target.type() == ValueType::FUNCTION) {
+			// one without a register form, located where it failed
+			const FunctionRecord *callee = target.as_function();
+			std::string error;
+			if (!vm->push_call(callee, call_args, n, error)) {
+				return deopt;
+			}
+			res = vm->run_call(callee);
+			if (auto *err = std::get_if<RuntimeError>(&res)) {
+				vm->jit_error = std::move(*err);
+				return JIT_FAILED;
+			}
+			*call_args = std::get<Value>(res);
+			return JIT_RETURNED;
+		}
+		res = vm->execute(call_args, n, target);
+		if (auto *err = std::get_if<RuntimeError>(&res)) {
+			vm->jit_error = vm->make_error(err->message, func->code->packed.name,
+										   func->code->registers->lines, pc);
+			return JIT_FAILED;
+		}
+	}
+	*call_args = std::get<Value>(res);
+	return JIT_RETURNED;
+}
+
+} // namespace cypheri
@@ -0,0 +1,36 @@
+#include "cypheri/compile.hpp"
+#include "cypheri/errors.hpp"
+#include <algorithm>
+#include <format>
+#include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv) {
+	// Compile every file given on the command line into a shared table
+	std::vector<std::string> paths(argv + 1, argv + argc);
+	cypheri::NameTable name_table(true);
+	auto files = cypheri::compile_many(paths, name_table);
+
+	for (const auto &file : files) {
+		if (auto err = std::get_if<cypheri::SyntaxError>(&file.result)) {
+			std::cout << std::format("{}: Error: {}", file.path, *err)
+					  << std::endl;
+			continue;
+		}
+
+		const auto &mod = std::get<cypheri::BytecodeModule>(file.result);
+		std::cout << std::format("{}: {} functions:", file.path,
+								 mod.functions.size());
+		std::vector<std::string_view> names;
+		for (const auto &[name, func] : mod.functions) {
+			names.push_back(name_table.get_name(name));
+		}
+		std::sort(names.begin(), names.end());
+		for (auto name : names) {
+			std::cout << " " << name;
+		}
+		std::cout << std::endl;
+	}
+	return 0;
+}
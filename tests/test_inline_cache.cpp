@@ -0,0 +1,206 @@
+#include "cypheri/bytecode.hpp"
+#include "cypheri/errors.hpp"
+#include "cypheri/heap.hpp"
+#include "cypheri/vm.hpp"
+#include <format>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using cypheri::BytecodeFunction;
+using cypheri::InstructionType;
+using cypheri::Value;
+
+constexpr int SHAPES = 6;
+
+// Site counters expected after main() has run, see there
+struct Expected {
+	const char *func, *property;
+	size_t shapes;
+	bool megamorphic;
+	uint64_t hits, misses;
+};
+
+constexpr Expected EXPECTED[] = {
+	{"mono", "x", 1, false, 3, 1},
+	{"poly", "x", 4, false, 4, 4},
+	{"mega", "x", 4, true, 4, 8},
+	{"missing", "y", 1, false, 1, 1},
+	{"store", "x", 2, false, 2, 2},
+	{"grow", "y", 1, false, 2, 1},
+};
+
+int main(int argc, char **argv) {
+	if (argc >= 2) {
+		freopen(argv[1], "w", stdout);
+	}
+
+	// The module is built by hand, the parser has no syntax for objects
+	cypheri::NameTable name_table;
+	auto id = [&](std::string_view name) {
+		return name_table.get_id_or_insert(name);
+	};
+	auto add = [](BytecodeFunction &func, InstructionType type, auto operand) {
+		func.instructions.emplace_back(type, operand);
+	};
+	cypheri::BytecodeModule mod;
+
+	// make<k>() gives {x: 10} for k = 0, else {p<k>: k, x: 10 + k}, so
+	// that each k has a shape of its own with x in a different slot
+	for (int k = 0; k < SHAPES; k++) {
+		BytecodeFunction func;
+		func.name = id(std::format("make{}", k));
+		add(func, InstructionType::LIOBJ, 2);
+		if (k > 0) {
+			add(func, InstructionType::LII, uint64_t(k));
+			add(func, InstructionType::SET, id(std::format("p{}", k)));
+		}
+		add(func, InstructionType::LII, uint64_t(10 + k));
+		add(func, InstructionType::SET, id("x"));
+		add(func, InstructionType::RET, 0);
+		mod.functions[func.name] = std::move(func);
+	}
+
+	// A GET site each, (o) -> o.<property>
+	for (auto [name, property] : {std::pair{"mono", "x"},
+								  {"poly", "x"},
+								  {"mega", "x"},
+								  {"missing", "y"}}) {
+		BytecodeFunction func;
+		func.name = id(name);
+		func.arg_count = func.local_count = 1;
+		add(func, InstructionType::LDLOCAL, uint64_t(0));
+		add(func, InstructionType::GET, id(property));
+		add(func, InstructionType::RET, 0);
+		mod.functions[func.name] = std::move(func);
+	}
+
+	// A SET site each, (o, v) -> o after o.<property> = v
+	for (auto [name, property] :
+		 {std::pair{"store", "x"}, std::pair{"grow", "y"}}) {
+		BytecodeFunction func;
+		func.name = id(name);
+		func.arg_count = func.local_count = 2;
+		add(func, InstructionType::LDLOCAL, uint64_t(0));
+		add(func, InstructionType::LDLOCAL, uint64_t(1));
+		add(func, InstructionType::SET, id(property));
+		add(func, InstructionType::RET, 0);
+		mod.functions[func.name] = std::move(func);
+	}
+
+	// "registers" selects the register form, the counters must not change
+	cypheri::VMOptions options;
+	for (int i = 2; i < argc; i++) {
+		if (std::string(argv[i]) == "registers") {
+			options.register_isa = true;
+		}
+	}
+	cypheri::VM vm(name_table, options);
+	if (auto err = vm.load(mod)) {
+		std::cout << std::format("Error: \n{}", *err) << std::endl;
+		return 1;
+	}
+
+	bool ok = true;
+	auto call = [&](std::string_view name, std::vector<Value> args) {
+		auto res = vm.call(id(name), args);
+		if (auto err = std::get_if<cypheri::RuntimeError>(&res)) {
+			std::cout << std::format("Error: \n{}", *err) << std::endl;
+			ok = false;
+			return Value();
+		}
+		return std::get<Value>(res);
+	};
+	auto check = [&](std::string_view what, Value got, Value expected) {
+		if (std::format("{}", got) != std::format("{}", expected)) {
+			std::cout << std::format("{}: got {}, expected {}", what, got,
+									 expected)
+					  << std::endl;
+			ok = false;
+		}
+	};
+
+	std::vector<Value> objects;
+	for (int k = 0; k < SHAPES; k++) {
+		objects.push_back(call(std::format("make{}", k), {}));
+	}
+
+	// One shape: a miss to fill the cache, then hits
+	for (int i = 0; i < 4; i++) {
+		check("mono", call("mono", {objects[0]}), Value::from_small_int(10));
+	}
+	// As many shapes as the cache has ways: each misses once
+	for (int round = 0; round < 2; round++) {
+		for (int k = 0; k < 4; k++) {
+			check("poly", call("poly", {objects[k]}),
+				  Value::from_small_int(10 + k));
+		}
+	}
+	// More shapes than ways: the first ones stay cached, the others miss
+	// every time
+	for (int round = 0; round < 2; round++) {
+		for (int k = 0; k < SHAPES; k++) {
+			check("mega", call("mega", {objects[k]}),
+				  Value::from_small_int(10 + k));
+		}
+	}
+	// A missing property is cached as such and reads as NULL
+	for (int i = 0; i < 2; i++) {
+		check("missing", call("missing", {objects[1]}), Value());
+	}
+	// Stores are read back from the heap, so that no site counts the
+	// reads
+	auto property = [&](Value obj, std::string_view name) {
+		return cypheri::Heap::get(obj.as_object(), id(name));
+	};
+	// Stores to an existing slot, for two shapes, leave the other property
+	for (int round = 0; round < 2; round++) {
+		for (int k = 0; k < 2; k++) {
+			call("store", {objects[k], Value::from_small_int(20 + k)});
+			check("store", property(objects[k], "x"),
+				  Value::from_small_int(20 + k));
+			if (k > 0) {
+				check("store", property(objects[k], std::format("p{}", k)),
+					  Value::from_small_int(k));
+			}
+		}
+	}
+	// Stores adding a property to fresh objects of one shape take the
+	// cached transition after the first, and keep x
+	for (int i = 0; i < 3; i++) {
+		Value obj = call("make0", {});
+		call("grow", {obj, Value::from_small_int(30 + i)});
+		check("grow", property(obj, "y"), Value::from_small_int(30 + i));
+		check("grow", property(obj, "x"), Value::from_small_int(10));
+	}
+
+	auto stats = vm.property_cache_stats();
+	for (const auto &site : stats) {
+		std::cout << std::format("{} {} +{:0>4d}: shapes {}{}, {} hits, {} "
+								 "misses",
+								 name_table.get_name(site.func),
+								 name_table.get_name(site.property), site.pc,
+								 site.shapes,
+								 site.megamorphic ? " (megamorphic)" : "",
+								 site.hits, site.misses)
+				  << std::endl;
+	}
+
+	for (const auto &expected : EXPECTED) {
+		const cypheri::PropertySiteStats *found = nullptr;
+		for (const auto &site : stats) {
+			if (name_table.get_name(site.func) == expected.func &&
+				name_table.get_name(site.property) == expected.property) {
+				found = &site;
+			}
+		}
+		if (!found || found->shapes != expected.shapes ||
+			found->megamorphic != expected.megamorphic ||
+			found->hits != expected.hits || found->misses != expected.misses) {
+			std::cout << std::format("{}: unexpected counters", expected.func)
+					  << std::endl;
+			ok = false;
+		}
+	}
+	return ok ? 0 : 1;
+}
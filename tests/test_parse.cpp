@@ -23,9 +23,24 @@ int main(int argc, char **argv) {
 	// Tokenize
 	cypheri::NameTable name_table;
 
-	// Parse
-	auto parse_res =
-		cypheri::parse(cypheri::tokenize(source, name_table), name_table);
+	// Parse, "nofold" and "O0" turn off the optimizations for debugging,
+	// "reparse" re-parses every function on its own afterwards, which must
+	// not change the output
+	cypheri::ParseOptions options;
+	bool reparse = false;
+	for (int i = 3; i < argc; i++) {
+		if (std::string(argv[i]) == "nofold") {
+			options.fold_constants = false;
+		} else if (std::string(argv[i]) == "O0") {
+			options.opt_level = 0;
+		} else if (std::string(argv[i]) == "reparse") {
+			reparse = true;
+		}
+	}
+	cypheri::SourceLayout layout;
+	options.layout = &layout;
+	auto parse_res = cypheri::parse(cypheri::tokenize(source, name_table),
+									name_table, options);
 
 	if (auto err = std::get_if<cypheri::SyntaxError>(&parse_res)) {
 		std::cout << std::format("Error: \n{}", *err) << std::endl;
@@ -33,6 +48,58 @@ int main(int argc, char **argv) {
 	}
 
 	auto bc = std::get<cypheri::BytecodeModule>(std::move(parse_res));
+	for (size_t i = 0; reparse && i < layout.functions.size(); i++) {
+		auto span = layout.functions[i];
+		size_t len = span.end - span.begin;
+		if (auto err = cypheri::reparse(bc, layout, source,
+										{span.begin, len, len}, name_table,
+										options)) {
+			std::cout << std::format("Error: \n{}", *err) << std::endl;
+			return 0;
+		}
+	}
+	// Then spaces go after each Function keyword, last one first so that
+	// no edit re-parses the functions an earlier one moved, and the line
+	// tables must match a full parse
+	constexpr size_t SPACES = 6;
+	for (size_t i = layout.functions.size(); reparse && i-- > 0;) {
+		size_t at = layout.functions[i].begin + std::string("Function").size();
+		source.insert(at, SPACES, ' ');
+		if (auto err = cypheri::reparse(bc, layout, source, {at, 0, SPACES},
+										name_table, options)) {
+			std::cout << std::format("Error: \n{}", *err) << std::endl;
+			return 0;
+		}
+	}
+	if (reparse) {
+		auto full_res = cypheri::parse(cypheri::tokenize(source, name_table),
+									   name_table, options);
+		if (auto err = std::get_if<cypheri::SyntaxError>(&full_res)) {
+			std::cout << std::format("Error: \n{}", *err) << std::endl;
+			return 0;
+		}
+		auto &full = std::get<cypheri::BytecodeModule>(full_res);
+		auto runs = [](const cypheri::LineTable &lines) {
+			std::string text;
+			for (auto entry : lines.entries()) {
+				text += std::format(" +{}@{}:{}", entry.pc, entry.loc.line,
+									entry.loc.column);
+			}
+			return text;
+		};
+		for (auto &[name, func] : bc.functions) {
+			auto *expected = full.functions.find(name);
+			if (!expected || runs(func.lines) != runs(expected->lines)) {
+				std::cout << std::format("Line table of {} differs:{}, full "
+										 "parse:{}",
+										 name_table.get_name(name),
+										 runs(func.lines),
+										 expected ? runs(expected->lines)
+												  : std::string())
+						  << std::endl;
+			}
+		}
+	}
 	for (auto &[name, func] : bc.functions) {
 		std::cout << std::format("Function {}(args = {}, locals = {}):",
 								 name_table.get_name(name), func.arg_count,
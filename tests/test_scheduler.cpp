@@ -0,0 +1,115 @@
+#include "cypheri/errors.hpp"
+#include "cypheri/image.hpp"
+#include "cypheri/parse.hpp"
+#include "cypheri/scheduler.hpp"
+#include "cypheri/token.hpp"
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+constexpr size_t ACTORS = 16;
+constexpr size_t THREADS = 2;
+
+int main(int argc, char **argv) {
+	if (argc >= 2) {
+		freopen(argv[1], "r", stdin);
+	}
+
+	if (argc >= 3) {
+		freopen(argv[2], "w", stdout);
+	}
+
+	std::string source, line;
+	// Read until EOF
+	while (std::getline(std::cin, line)) {
+		source += line + "\n";
+	}
+
+	// "single" parses into a table that isn't concurrent, which makes the
+	// scheduler fall back to a single isolate on this thread
+	bool single = false;
+	for (int i = 3; i < argc; i++) {
+		if (std::string(argv[i]) == "single") {
+			single = true;
+		}
+	}
+
+	cypheri::NameTable name_table(!single);
+	cypheri::TokenStream tokens(source, name_table);
+	auto parse_res = cypheri::parse(tokens, name_table);
+	if (auto err = std::get_if<cypheri::SyntaxError>(&parse_res)) {
+		std::cout << std::format("Error: \n{}", *err) << std::endl;
+		return 0;
+	}
+	const auto &bc = std::get<cypheri::BytecodeModule>(parse_res);
+
+	auto built = cypheri::CodeImage::build(bc, name_table);
+	if (auto err = std::get_if<cypheri::RuntimeError>(&built)) {
+		std::cout << std::format("Error: \n{}", *err) << std::endl;
+		return 0;
+	}
+	auto image = std::get<std::shared_ptr<const cypheri::CodeImage>>(built);
+
+	// actor(k) for every k, and one whose entry isn't defined
+	std::vector<cypheri::Actor> actors;
+	for (size_t k = 0; k < ACTORS; k++) {
+		actors.push_back({name_table.get_id_or_insert("actor"),
+						  {cypheri::Value::from_small_int(k)}});
+	}
+	actors.push_back({name_table.get_id_or_insert("missingActor"), {}});
+
+	// The first isolate set up waits long enough for the others to run
+	// out of their own actors and steal its ones. Actors are dealt
+	// round-robin, so one isolate finishing actors dealt to different ones
+	// means some were stolen.
+	std::mutex mutex;
+	std::vector<std::string> results(actors.size());
+	std::map<const cypheri::VM *, std::vector<size_t>> finished_on;
+	std::atomic<size_t> isolates_set_up = 0;
+
+	cypheri::SchedulerOptions options;
+	options.threads = THREADS;
+	options.setup = [&](cypheri::VM &) {
+		if (isolates_set_up++ == 0 && !single) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	};
+	options.on_exit = [&](size_t actor, cypheri::VM &vm,
+						  const std::variant<cypheri::Value,
+											 cypheri::RuntimeError> &result) {
+		std::string text;
+		if (auto err = std::get_if<cypheri::RuntimeError>(&result)) {
+			text = std::format("Error: {}", *err);
+		} else {
+			text = std::format("{}", std::get<cypheri::Value>(result));
+		}
+		std::lock_guard lock(mutex);
+		results[actor] = std::move(text);
+		finished_on[&vm].push_back(actor);
+	};
+
+	auto stats = cypheri::run_actors(image, name_table, actors, options);
+	for (size_t i = 0; i < results.size(); i++) {
+		std::cout << std::format("actor {}: {}", i, results[i]) << std::endl;
+	}
+
+	bool stolen = false;
+	for (const auto &[vm, finished] : finished_on) {
+		std::set<size_t> dealt_to;
+		for (size_t actor : finished) {
+			dealt_to.insert(actor % stats.isolates);
+		}
+		stolen = stolen || dealt_to.size() > 1;
+	}
+	std::cout << std::format("isolates: {}", stats.isolates) << std::endl;
+	std::cout << std::format("resumes: {}", stats.resumes) << std::endl;
+	std::cout << std::format("stolen: {}", stolen) << std::endl;
+	return 0;
+}
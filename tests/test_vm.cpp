@@ -0,0 +1,232 @@
+#include "cypheri/cache.hpp"
+#include "cypheri/errors.hpp"
+#include "cypheri/parse.hpp"
+#include "cypheri/token.hpp"
+#include "cypheri/vm.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+
+std::variant<cypheri::Value, cypheri::RuntimeError>
+print(cypheri::VM &vm, std::span<const cypheri::Value> args) {
+	for (size_t i = 0; i < args.size(); i++) {
+		if (i > 0) {
+			std::cout << ' ';
+		}
+		std::cout << std::format("{}", args[i]);
+	}
+	std::cout << std::endl;
+	return cypheri::Value();
+}
+
+// Coroutines for the scripts, by the handle spawn() gave them. resume()
+// gives back the error message of a failed resume instead of stopping the
+// script, so that fixtures can check it.
+std::vector<cypheri::Coroutine *> coroutines;
+
+// Slot of the coroutine whose handle is the first argument, if any
+cypheri::Coroutine **coroutine_arg(std::span<const cypheri::Value> args) {
+	if (args.empty() || !args[0].is_small_int() || args[0].small_int() < 0 ||
+		static_cast<size_t>(args[0].small_int()) >= coroutines.size() ||
+		!coroutines[args[0].small_int()]) {
+		return nullptr;
+	}
+	return &coroutines[args[0].small_int()];
+}
+
+std::variant<cypheri::Value, cypheri::RuntimeError>
+spawn(cypheri::VM &vm, std::span<const cypheri::Value> args) {
+	if (args.empty()) {
+		return cypheri::RuntimeError("spawn needs a function");
+	}
+	auto res = vm.spawn(args[0], args.subspan(1));
+	if (auto err = std::get_if<cypheri::RuntimeError>(&res)) {
+		return std::move(*err);
+	}
+	coroutines.push_back(std::get<cypheri::Coroutine *>(res));
+	return cypheri::Value::from_small_int(coroutines.size() - 1);
+}
+
+std::variant<cypheri::Value, cypheri::RuntimeError>
+resume(cypheri::VM &vm, std::span<const cypheri::Value> args) {
+	auto co = coroutine_arg(args);
+	if (!co) {
+		return cypheri::RuntimeError("invalid coroutine handle");
+	}
+	auto res = vm.resume(**co,
+						 args.size() > 1 ? args[1] : cypheri::Value());
+	if (auto err = std::get_if<cypheri::RuntimeError>(&res)) {
+		return vm.make_string(err->message);
+	}
+	return res;
+}
+
+std::variant<cypheri::Value, cypheri::RuntimeError>
+status(cypheri::VM &vm, std::span<const cypheri::Value> args) {
+	auto co = coroutine_arg(args);
+	if (!co) {
+		return cypheri::RuntimeError("invalid coroutine handle");
+	}
+	switch ((*co)->status()) {
+	case cypheri::CoroutineStatus::SUSPENDED:
+		return vm.make_string("suspended");
+	case cypheri::CoroutineStatus::RUNNING:
+		return vm.make_string("running");
+	case cypheri::CoroutineStatus::DONE:
+		return vm.make_string("done");
+	default:
+		return vm.make_string("failed");
+	}
+}
+
+std::variant<cypheri::Value, cypheri::RuntimeError>
+release(cypheri::VM &vm, std::span<const cypheri::Value> args) {
+	auto co = coroutine_arg(args);
+	if (!co) {
+		return cypheri::RuntimeError("invalid coroutine handle");
+	}
+	vm.release(**co);
+	*co = nullptr;
+	return cypheri::Value();
+}
+
+int main(int argc, char **argv) {
+	if (argc >= 2) {
+		freopen(argv[1], "r", stdin);
+	}
+
+	if (argc >= 3) {
+		freopen(argv[2], "w", stdout);
+	}
+
+	std::string source, line;
+	// Read until EOF
+	while (std::getline(std::cin, line)) {
+		source += line + "\n";
+	}
+
+	// Tokenize and parse in one pass
+	cypheri::NameTable name_table;
+	cypheri::TokenStream tokens(source, name_table);
+	auto parse_res = cypheri::parse(tokens, name_table);
+
+	if (auto err = std::get_if<cypheri::SyntaxError>(&parse_res)) {
+		std::cout << std::format("Error: \n{}", *err) << std::endl;
+		return 0;
+	}
+
+	auto bc = std::get<cypheri::BytecodeModule>(std::move(parse_res));
+
+	// Run, "registers" selects the register form, "jit" compiles every
+	// function on its first call, "profile" prints the most frequent opcode
+	// pairs of unfused code (needs CYPHERI_VM_PAIR_PROFILE), then opcode
+	// counts, function times and where samples landed (needs
+	// CYPHERI_VM_PROFILE), "cache" runs the module after a round trip
+	// through a cache file
+	cypheri::VMOptions options;
+	bool profile = false;
+	for (int i = 3; i < argc; i++) {
+		if (std::string(argv[i]) == "registers") {
+			options.register_isa = true;
+		} else if (std::string(argv[i]) == "jit") {
+			options.jit = true;
+			options.jit_threshold = 1;
+		} else if (std::string(argv[i]) == "profile") {
+			options.superinstructions = false;
+			options.sample_interval = 64;
+			profile = true;
+		} else if (std::string(argv[i]) == "cache") {
+			auto path = (std::filesystem::temp_directory_path() /
+						 "cypheri_test_vm.cbc")
+							.string();
+			auto hash = cypheri::hash_source(source);
+			auto cached = cypheri::write_bytecode_cache(path, bc, name_table,
+														hash)
+							  ? cypheri::MappedBytecode::open(path, hash)
+							  : std::nullopt;
+			if (!cached) {
+				std::cout << "Error: \ncache round trip failed" << std::endl;
+				return 0;
+			}
+			bc = cached->to_module(name_table);
+		}
+	}
+	cypheri::VM vm(name_table, options);
+	vm.define_native("print", print);
+	vm.define_native("spawn", spawn);
+	vm.define_native("resume", resume);
+	vm.define_native("status", status);
+	vm.define_native("release", release);
+
+	if (auto err = vm.load(bc)) {
+		std::cout << std::format("Error: \n{}", *err) << std::endl;
+		return 0;
+	}
+
+	auto res = vm.call(name_table.get_id_or_insert("onBoot"));
+	if (auto err = std::get_if<cypheri::RuntimeError>(&res)) {
+		std::cout << std::format("Error: \n{}", *err) << std::endl;
+		return 0;
+	}
+
+	if (profile) {
+		auto pairs = vm.opcode_pair_profile();
+		for (size_t i = 0; i < pairs.size() && i < 20; i++) {
+			std::cout << std::format("{} {}\t{}", pairs[i].first,
+									 pairs[i].second, pairs[i].count)
+					  << std::endl;
+		}
+
+		auto opcodes = vm.opcode_profile();
+		if (!opcodes.empty()) {
+			std::cout << "Opcodes:" << std::endl;
+		}
+		for (size_t i = 0; i < opcodes.size() && i < 20; i++) {
+			std::cout << std::format("\t{}\t{}", opcodes[i].type,
+									 opcodes[i].count)
+					  << std::endl;
+		}
+
+		auto functions = vm.function_profile();
+		if (!functions.empty()) {
+			std::cout << "Functions (calls, inclusive ns, exclusive ns):"
+					  << std::endl;
+		}
+		for (const auto &func : functions) {
+			std::cout << std::format("\t{}\t{}\t{}\t{}",
+									 name_table.get_name(func.func),
+									 func.times.calls, func.times.inclusive_ns,
+									 func.times.exclusive_ns)
+					  << std::endl;
+		}
+
+		// samples by the source location they landed on, most first
+		std::map<std::pair<cypheri::NameIdType, std::string>, size_t> places;
+		for (const auto &sample : vm.take_profile_samples()) {
+			auto loc = sample.loc ? std::format("{}", *sample.loc)
+								  : std::string("?");
+			places[{sample.func, loc}]++;
+		}
+		std::vector<std::pair<size_t, std::string>> sorted;
+		for (const auto &[place, count] : places) {
+			sorted.emplace_back(count,
+								std::format("{} at {}",
+											name_table.get_name(place.first),
+											place.second));
+		}
+		std::sort(sorted.begin(), sorted.end(), std::greater<>());
+		if (!sorted.empty()) {
+			std::cout << "Samples:" << std::endl;
+		}
+		for (size_t i = 0; i < sorted.size() && i < 20; i++) {
+			std::cout << std::format("\t{}\t{}", sorted[i].second,
+									 sorted[i].first)
+					  << std::endl;
+		}
+	}
+	return 0;
+}